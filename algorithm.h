@@ -0,0 +1,464 @@
+#ifndef ALGORITHM_H
+#define ALGORITHM_H
+
+#include <random>
+
+#include "kd_tree.h"
+#include "compact_kd_tree.h"
+#include "bvh.h"
+#include "grid.h"
+#include "dynamic_index.h"
+
+// acceleration structures the algorithm can use
+enum class IndexType
+{
+    kdtree,
+    bvh,
+    grid,
+    compact_kdtree
+};
+
+// repeated queries of a ray that moves a little from one to the next, e.g.
+// one dragged by the mouse. the part of the ray within the bounds of the
+// circles is a segment; the circles within margin of it are gathered once
+// from the index, by a capsule query, into buckets of their own. a later ray
+// whose segment has both ends within margin of the gathered one lies inside
+// that capsule, so every circle it hits is among them and is found by
+// testing them alone, with no traversal. otherwise they are gathered again
+// around the new segment.
+class CoherentRayQuery
+{
+private:
+    const SpatialIndex* m_index = nullptr;
+    BBox m_bounds;
+    Segment m_segment;
+    double m_margin = 0.0;
+    bool m_valid = false;
+    CircleBuckets m_candidates;
+    std::vector<std::uint32_t> m_ids; // scratch of the gathering
+    std::vector<Circle> m_found;
+
+    std::size_t m_queries = 0, m_gathers = 0;
+
+public:
+    // the index or its circles changed
+    void reset()
+    {
+        m_index = nullptr;
+        m_valid = false;
+        m_candidates.clear();
+    }
+
+    std::size_t candidates() const { return m_candidates.size(); }
+    std::size_t queries() const { return m_queries; }
+    std::size_t gathers() const { return m_gathers; }
+
+    // appends the ids of the circles the ray hits, like detect_intersection;
+    // circles are the ones the index was built from. returns whether the
+    // candidates were gathered again for this ray.
+    bool query(const SpatialIndex &index, const std::vector<Circle> &circles, const Ray &ray, 
+        double margin, std::vector<std::uint32_t> &ids)
+    {
+        if (&index != m_index)
+        {
+            reset();
+            m_index = &index;
+            m_bounds = BBox::empty();
+            for (const Circle& circle : circles) m_bounds.extend(BBox::of(circle));
+        }
+        ++m_queries;
+
+        Segment segment;
+        if (!clip(ray, segment)) return false; // misses the bounds, and so every circle
+
+        bool gather = !m_valid || margin != m_margin 
+            || segment_distance(segment.origin, m_segment) > m_margin
+            || segment_distance(segment.destination, m_segment) > m_margin;
+        if (gather) gather_candidates(index, circles, segment, margin);
+
+        RayRange range(ray);
+        std::uint32_t count = std::uint32_t(m_candidates.size());
+        for (std::uint32_t first = 0; first < count; first += 32)
+        {
+            std::uint32_t mask = m_candidates.intersect(range, first, std::min(32u, count - first));
+            for (; mask; mask &= mask - 1) ids.push_back(m_candidates.ids[first + lowest_bit(mask)]);
+        }
+        return gather;
+    }
+
+private:
+    // the part of the ray within the bounds
+    bool clip(const Ray &ray, Segment &segment) const
+    {
+        if (m_bounds.bottom_left.x > m_bounds.top_right.x) return false;
+        double tmin = 0.0, tmax = std::numeric_limits<double>::infinity();
+        const double origin[2] = { ray.origin.x, ray.origin.y };
+        const double direction[2] = { ray.direction.x, ray.direction.y };
+        const double low[2] = { m_bounds.bottom_left.x, m_bounds.bottom_left.y };
+        const double high[2] = { m_bounds.top_right.x, m_bounds.top_right.y };
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            if (direction[axis] == 0.0)
+            {
+                if (origin[axis] < low[axis] || origin[axis] > high[axis]) return false;
+                continue;
+            }
+            double t0 = (low[axis] - origin[axis]) / direction[axis];
+            double t1 = (high[axis] - origin[axis]) / direction[axis];
+            tmin = std::max(tmin, std::min(t0, t1));
+            tmax = std::min(tmax, std::max(t0, t1));
+        }
+        if (tmin > tmax) return false;
+        segment = Segment(ray.origin + ray.direction * tmin, ray.origin + ray.direction * tmax);
+        return true;
+    }
+
+    // the circles within margin of the segment
+    void gather_candidates(const SpatialIndex &index, const std::vector<Circle> &circles, 
+        const Segment &segment, double margin)
+    {
+        struct Collector : CircleVisitor
+        {
+            std::vector<std::uint32_t>& ids;
+            std::vector<Circle>& found;
+
+            Collector(std::vector<std::uint32_t>& ids, std::vector<Circle>& found) : ids(ids), found(found) {}
+
+            bool on_circle(std::uint32_t id, double cx, double cy, double radius) override 
+            { 
+                ids.push_back(id);
+                found.push_back(Circle(Point(cx, cy), radius));
+                return true; 
+            }
+        } collector(m_ids, m_found);
+
+        ++m_gathers;
+        m_segment = segment;
+        m_margin = margin;
+        m_valid = true;
+        m_ids.clear();
+        m_found.clear();
+        index.query_capsule(segment, margin, circles, collector);
+
+        m_candidates.resize(m_ids.size());
+        for (std::size_t i = 0; i < m_ids.size(); ++i) m_candidates.set(i, m_found[i], m_ids[i]);
+    }
+};
+
+class Algorithm
+{
+private:
+    std::random_device m_rd;
+    std::mt19937 m_gen;
+
+public:
+    std::mt19937& random_generator() {return m_gen;}
+
+    // reproducible circles and rays
+    void seed(std::uint32_t value) { m_gen.seed(value); }
+
+public:
+    IndexType m_index_type = IndexType::kdtree;
+    bool m_dynamic = false;
+    std::unique_ptr<SpatialIndex> m_index_ptr 
+        = make_index(IndexType::kdtree);
+    std::unique_ptr<ThreadPool> m_pool_ptr 
+        = std::make_unique<ThreadPool>();
+    Algorithm() : m_gen(m_rd()) {}
+
+private:
+    // filled only with INTERSECTION_STATS, apart from the build info
+    BuildInfo m_build_info;
+    QueryStats m_last_stats;  // last query or batch
+    QueryStats m_total_stats; // since reset_stats()
+
+    // the traversals count into the record of the calling thread
+    void begin_query()
+    {
+        INTERSECTION_STAT(thread_query_stats() = QueryStats());
+    }
+
+    void end_query([[maybe_unused]] std::size_t hits)
+    {
+#ifdef INTERSECTION_STATS
+        m_last_stats = thread_query_stats();
+        m_last_stats.queries = 1;
+        m_last_stats.hits = hits;
+        m_total_stats.merge(m_last_stats);
+#endif
+    }
+
+public:
+    const BuildInfo& last_build_info() const { return m_build_info; }
+    const QueryStats& last_query_stats() const { return m_last_stats; }
+    const QueryStats& total_query_stats() const { return m_total_stats; }
+
+    void reset_stats()
+    {
+        m_last_stats = QueryStats();
+        m_total_stats = QueryStats();
+    }
+
+    void clear() { m_index_ptr = make_index(m_index_type, m_dynamic); }
+
+    // a dynamic index is a forest of indexes of the given type
+    static std::unique_ptr<SpatialIndex> make_index(IndexType type, bool dynamic = false)
+    {
+        if (dynamic) 
+            return std::make_unique<DynamicIndex>([type] { return make_index(type); });
+
+        switch (type)
+        {
+        case IndexType::bvh: return std::make_unique<BVH>();
+        case IndexType::grid: return std::make_unique<Grid>();
+        case IndexType::compact_kdtree: return std::make_unique<CompactKDTree>();
+        default: return std::make_unique<KDTree>();
+        }
+    }
+
+    // switching the structure drops the current index
+    void set_index_type(IndexType type)
+    {
+        m_index_type = type;
+        clear();
+    }
+
+    // with a dynamic index, circles can be inserted and erased after the
+    // build; switching drops the current index
+    void set_dynamic(bool dynamic)
+    {
+        m_dynamic = dynamic;
+        clear();
+    }
+
+    // the dynamic index, or nullptr
+    DynamicIndex* dynamic_index() { return dynamic_cast<DynamicIndex*>(m_index_ptr.get()); }
+
+    // returns the id of the circle, or RayHit::null if the index is not dynamic
+    std::uint32_t insert_circle(const Circle& circle)
+    {
+        DynamicIndex* index = dynamic_index();
+        return index ? index->insert(circle) : RayHit::null;
+    }
+
+    bool erase_circle(std::uint32_t id)
+    {
+        DynamicIndex* index = dynamic_index();
+        return index && index->erase(id);
+    }
+
+public:
+    // stops early when control is cancelled
+    void generate_random_circles(std::vector<Circle> &circles, 
+        const BBox& rect, double radius, std::size_t num_circles, JobControl* control = nullptr)
+    {
+        std::uniform_real_distribution<> distri_x(rect.bottom_left.x + radius, rect.top_right.x - radius);
+        std::uniform_real_distribution<> distri_y(rect.bottom_left.y + radius, rect.top_right.y - radius);
+
+        if (control) control->set_total(num_circles);
+        for (std::size_t i = 0; i < num_circles; ++i)
+        {
+            if (control && i % 4096 == 0 && i)
+            {
+                control->advance(4096);
+                if (control->cancelled()) return;
+            }
+            float x = distri_x(m_gen);
+            float y = distri_y(m_gen);
+            circles.emplace_back(Point(x, y), radius);
+        }
+    }
+
+    void generate_random_ray(Ray &ray, const BBox& viewer_rect)
+    {
+        std::uniform_real_distribution<> distri_x(viewer_rect.bottom_left.x,  viewer_rect.top_right.x);
+        std::uniform_real_distribution<> distri_y(viewer_rect.bottom_left.y,  viewer_rect.top_right.y);
+
+        std::vector<Point> edge_points = {
+            {distri_x(m_gen), viewer_rect.bottom_left.y}, // Bottom edge
+            {distri_x(m_gen), viewer_rect.top_right.y}, // Top edge
+            {viewer_rect.bottom_left.x, distri_y(m_gen)}, // Left edge
+            {viewer_rect.top_right.x, distri_y(m_gen)}  // Right edge
+        };
+
+        std::shuffle(edge_points.begin(), edge_points.end(), m_gen);
+
+        Point origin = edge_points[0];
+        Point destination = edge_points[1];
+        
+        Vector2d direction = destination - origin;
+        direction = direction.normalize();
+        
+        ray = Ray(origin, direction);
+        ray.plot_segment = Segment(origin, destination);
+    }
+
+    Ray generate_random_ray_screen(double viewer_w, double viewer_h)
+    {
+        std::uniform_real_distribution<> distri_x(0,  viewer_w);
+        std::uniform_real_distribution<> distri_y(0,  viewer_h);
+
+        std::vector<Point> edge_points = {
+            {distri_x(m_gen), viewer_h}, // Bottom edge
+            {distri_x(m_gen), 0}, // Top edge
+            {0, distri_y(m_gen)}, // Left edge
+            {viewer_w, distri_y(m_gen)}  // Right edge
+        };
+
+        std::shuffle(edge_points.begin(), edge_points.end(), m_gen);
+
+        Point origin = edge_points[0];
+        Point destination = edge_points[1];
+        
+        Vector2d direction = destination - origin;
+        direction = direction.normalize();
+        
+        Ray ray = Ray(origin, direction);
+        ray.plot_segment = Segment(origin, destination);
+
+        return ray;
+    }
+
+
+    // builds on the pool where the index supports it
+    BuildInfo build_index(const std::vector<Circle>& circles, BBox bbox, JobControl* control = nullptr)
+    {
+        m_build_info = m_index_ptr->build(circles, bbox, m_pool_ptr.get(), control);
+        return m_build_info;
+    }
+
+    // an empty index of the current type, to be built aside from the one in
+    // use, e.g. in the background, and put in its place with set_index
+    std::unique_ptr<SpatialIndex> create_index() const { return make_index(m_index_type, m_dynamic); }
+
+    void set_index(std::unique_ptr<SpatialIndex> index, const BuildInfo& info)
+    {
+        m_index_ptr = std::move(index);
+        m_build_info = info;
+    }
+
+    // returns the number of index nodes visited
+    std::size_t detect_intersection(const Ray& ray,
+         const std::vector<Circle>&, std::vector<Circle> &results)
+    {
+        return detect_intersection(RayRange(ray), results);
+    }
+
+    // circles hit by a segment or by a ray within [tmin, tmax]
+    std::size_t detect_intersection(const RayRange& range, std::vector<Circle> &results)
+    {
+        std::size_t before = results.size();
+        begin_query();
+        std::size_t visited = m_index_ptr->detect_intersection(range, results);
+        end_query(results.size() - before);
+        return visited;
+    }
+
+    // ids of the circles hit, as indices into the circles the index was built from
+    std::size_t detect_intersection(const RayRange& range, std::vector<std::uint32_t> &ids)
+    {
+        std::size_t before = ids.size();
+        begin_query();
+        std::size_t visited = m_index_ptr->detect_intersection(range, ids);
+        end_query(ids.size() - before);
+        return visited;
+    }
+
+    // ids of the hits into a buffer of the caller, up to capacity; returns the
+    // number of hits, which may be larger
+    std::size_t collect_intersections(const RayRange& range, std::uint32_t* ids, std::size_t capacity)
+    {
+        begin_query();
+        std::size_t count = m_index_ptr->collect_intersections(range, ids, capacity);
+        end_query(count);
+        return count;
+    }
+
+    std::size_t count_intersections(const RayRange& range)
+    {
+        begin_query();
+        std::size_t count = m_index_ptr->count_intersections(range);
+        end_query(count);
+        return count;
+    }
+
+    // stops at the first hit found
+    bool any_intersection(const RayRange& range)
+    {
+        begin_query();
+        bool hit = m_index_ptr->any_intersection(range);
+        end_query(hit ? 1 : 0);
+        return hit;
+    }
+
+    // first circle hit along the ray; returns the number of index nodes visited
+    std::size_t closest_hit(const RayRange& range, RayHit &hit)
+    {
+        begin_query();
+        std::size_t visited = m_index_ptr->closest_hit(range, hit);
+        end_query(hit.valid() ? 1 : 0);
+        return visited;
+    }
+
+    // the k circles nearest to the point within max_distance, nearest first;
+    // returns the number of index nodes visited
+    std::size_t nearest(const Point& point, std::size_t k, std::vector<Neighbor> &result,
+        double max_distance = std::numeric_limits<double>::infinity())
+    {
+        begin_query();
+        std::size_t visited = m_index_ptr->nearest(point, k, result, max_distance);
+        end_query(result.size());
+        return visited;
+    }
+
+    // hits of every ray as indices into the circles the index was built from.
+    // packets: traverse consecutive rays 8 at a time, for coherent rays
+    void detect_intersection_batch(const Ray* rays, std::size_t num_rays, BatchHits &results,
+        bool packets = false)
+    {
+#ifdef INTERSECTION_STATS
+        m_last_stats = QueryStats();
+        m_index_ptr->detect_intersection_batch(rays, num_rays, results, *m_pool_ptr, packets, &m_last_stats);
+        m_total_stats.merge(m_last_stats);
+#else
+        m_index_ptr->detect_intersection_batch(rays, num_rays, results, *m_pool_ptr, packets);
+#endif
+    }
+
+    void detect_intersection_batch(const std::vector<Ray>& rays, BatchHits &results,
+        bool packets = false)
+    {
+        detect_intersection_batch(rays.data(), rays.size(), results, packets);
+    }
+
+    // every pair of overlapping circles, once; circles are the ones the index
+    // was built from
+    void detect_overlaps(const std::vector<Circle>& circles, std::vector<OverlapPair> &pairs,
+        JobControl* control = nullptr)
+    {
+#ifdef INTERSECTION_STATS
+        m_last_stats = QueryStats();
+        m_index_ptr->detect_overlaps(circles, pairs, *m_pool_ptr, &m_last_stats, control);
+        m_total_stats.merge(m_last_stats);
+#else
+        m_index_ptr->detect_overlaps(circles, pairs, *m_pool_ptr, nullptr, control);
+#endif
+    }
+
+    // what a fan of rays from one point sees; circles are the ones the index
+    // was built from
+    std::size_t cast_fan(const RayFan &fan, const std::vector<Circle>& circles, VisibilityPolygon &polygon)
+    {
+#ifdef INTERSECTION_STATS
+        m_last_stats = QueryStats();
+        std::size_t visited = m_index_ptr->cast_fan(fan, circles, polygon, *m_pool_ptr, &m_last_stats);
+        m_total_stats.merge(m_last_stats);
+        return visited;
+#else
+        return m_index_ptr->cast_fan(fan, circles, polygon, *m_pool_ptr);
+#endif
+    }
+
+};
+
+#endif
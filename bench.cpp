@@ -0,0 +1,1378 @@
+// headless benchmark of the spatial indexes, without Qt or OpenGL
+//
+// sweeps circle count, radius, distribution, ray count, index and query and
+// reports build time, memory, serial queries/s with p50/p99 latency and the
+// queries/s of a batch on the thread pool. built with INTERSECTION_STATS, it
+// also reports the box and circle tests per ray, the deepest traversal stack
+// and the time of each build phase. the snapshot index is a kd-tree written
+// to a file and mapped back; its build time is the time to map and verify it.
+// the count and any queries go through the visitor and report no visited nodes.
+// the nearest query asks for the --k circles nearest to a point on each ray,
+// halfway across the bounds, and reports the neighbors found as hits. the
+// overlaps query joins the circles with themselves, a window query per circle,
+// once on one thread and once on the pool; its rays are the circles and its
+// hits the overlapping pairs. the tracked query turns a ray about the origin
+// of the first towards a point moving from corner to corner of the bounds, a
+// small step each ray as a mouse would, and follows it with a
+// CoherentRayQuery; its visited nodes are the gathers per ray, and its batch
+// is the same rays from scratch on the pool. the fan query casts --rays rays
+// in a full turn from the middle of the bounds for their closest hits, once
+// on one thread and once on the pool.
+// the chunked index is a kd-tree per --chunk-size circles. with --input the
+// circles are read from a file (see import.h) instead of generated, and the
+// rays start from the border of their bounding box. with --spill-dir as well,
+// the chunked index is built by streaming the file again and spilling every
+// chunk to a mapped snapshot in that directory; its build time includes the
+// reading.
+// with --churn n, each run goes through n ticks of --updates erases of a
+// random circle and as many inserts of a new uniform one before its queries.
+// the dynamic index is built over the first circles and takes the updates
+// one by one, each tick timed; the other indexes are built over the circles
+// left at the end, a tick for them being that rebuild. only the hits,
+// closest, count, any and nearest queries run after a churn.
+// with --verify, nothing is timed: every index is checked against brute-force
+// scans of the circles instead, on all of the queries and a window around
+// each nearest query point, and each index and query gets a line with the
+// queries checked and the mismatches, and the first one. the exit status is
+// 1 when there is any. floats make the compact kd-tree looser: it may report
+// circles within 1e-6 of the bounds of reaching a query, the others 1e-9.
+//
+// usage: intersection_bench [--circles 10000,100000] [--radius 5]
+//     [--distribution uniform,clustered,mixed] [--rays 10000] [--index kdtree,bvh,grid,compact,dynamic,snapshot,chunked]
+//     [--query hits,closest,count,any,nearest,overlaps,tracked,fan] [--threads n] [--seed n] [--format text|csv|json]
+//     [--snapshot-path file] [--chunk-size n] [--input file] [--spill-dir dir] [--k n]
+//     [--churn ticks] [--updates n] [--verify]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "algorithm.h"
+#include "snapshot.h"
+#include "import.h"
+
+namespace
+{
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Options
+{
+    std::vector<std::size_t> circles = {10000, 100000};
+    std::vector<double> radii = {5.0};
+    std::vector<std::string> distributions = {"uniform", "clustered"};
+    std::vector<std::size_t> rays = {10000};
+    std::vector<std::string> indexes = {"kdtree", "bvh", "grid"};
+    std::vector<std::string> queries = {"hits", "closest"};
+    std::size_t threads = std::thread::hardware_concurrency();
+    std::uint32_t seed = 1;
+    std::string format = "text";
+    std::string snapshot_path = "intersection_bench.snap";
+    std::size_t chunk_size = std::size_t(1) << 16;
+    std::string input;
+    std::string spill_dir;
+    std::size_t k = 8;
+    std::size_t churn = 0;
+    std::size_t updates = 300;
+    bool verify = false;
+};
+
+struct Result
+{
+    std::size_t circles;
+    double radius;
+    std::string distribution;
+    std::size_t rays;
+    std::string index;
+    std::string query;
+
+    BuildInfo build;
+    double build_ms;
+    double tick_ms, max_tick_ms; // of a churn
+    std::size_t memory_bytes;
+    double queries_per_second;       // serial
+    double batch_queries_per_second; // on the pool
+    double p50_us, p99_us;
+    double hits_per_ray;
+    double visited_per_ray;
+    QueryStats stats; // of the serial queries
+};
+
+std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    std::size_t first = 0;
+    while (first <= list.size())
+    {
+        std::size_t last = list.find(',', first);
+        if (last == std::string::npos) last = list.size();
+        if (last > first) items.push_back(list.substr(first, last - first));
+        first = last + 1;
+    }
+    return items;
+}
+
+std::vector<std::size_t> split_sizes(const std::string& list)
+{
+    std::vector<std::size_t> values;
+    for (const std::string& item : split(list)) values.push_back(std::strtoull(item.c_str(), nullptr, 10));
+    return values;
+}
+
+std::vector<double> split_doubles(const std::string& list)
+{
+    std::vector<double> values;
+    for (const std::string& item : split(list)) values.push_back(std::strtod(item.c_str(), nullptr));
+    return values;
+}
+
+void usage()
+{
+    std::fprintf(stderr,
+        "usage: intersection_bench [--circles n,...] [--radius r,...]\n"
+        "    [--distribution uniform,clustered,mixed] [--rays n,...] [--index kdtree,bvh,grid,compact,dynamic,snapshot,chunked]\n"
+        "    [--query hits,closest,count,any,nearest,overlaps,tracked,fan] [--threads n] [--seed n] [--format text|csv|json]\n"
+        "    [--snapshot-path file] [--chunk-size n] [--input file] [--spill-dir dir] [--k n]\n"
+        "    [--churn ticks] [--updates n] [--verify]\n");
+}
+
+bool parse(int argc, char** argv, Options& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string key = argv[i];
+        if (key == "--help" || key == "-h") return false;
+        if (key == "--verify")
+        {
+            options.verify = true;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            std::fprintf(stderr, "missing value for %s\n", key.c_str());
+            return false;
+        }
+        std::string value = argv[++i];
+
+        if (key == "--circles") options.circles = split_sizes(value);
+        else if (key == "--radius") options.radii = split_doubles(value);
+        else if (key == "--distribution") options.distributions = split(value);
+        else if (key == "--rays") options.rays = split_sizes(value);
+        else if (key == "--index") options.indexes = split(value);
+        else if (key == "--query") options.queries = split(value);
+        else if (key == "--threads") options.threads = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--seed") options.seed = static_cast<std::uint32_t>(std::strtoul(value.c_str(), nullptr, 10));
+        else if (key == "--format") options.format = value;
+        else if (key == "--snapshot-path") options.snapshot_path = value;
+        else if (key == "--chunk-size") options.chunk_size = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--input") options.input = value;
+        else if (key == "--spill-dir") options.spill_dir = value;
+        else if (key == "--k") options.k = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--churn") options.churn = std::strtoull(value.c_str(), nullptr, 10);
+        else if (key == "--updates") options.updates = std::strtoull(value.c_str(), nullptr, 10);
+        else
+        {
+            std::fprintf(stderr, "unknown option %s\n", key.c_str());
+            return false;
+        }
+    }
+
+    for (const std::string& name : options.indexes)
+    {
+        if (name != "kdtree" && name != "bvh" && name != "grid" && name != "compact" && name != "dynamic"
+            && name != "snapshot" && name != "chunked")
+        {
+            std::fprintf(stderr, "unknown index %s\n", name.c_str());
+            return false;
+        }
+    }
+    for (const std::string& name : options.distributions)
+    {
+        if (name != "uniform" && name != "clustered" && name != "mixed")
+        {
+            std::fprintf(stderr, "unknown distribution %s\n", name.c_str());
+            return false;
+        }
+    }
+    for (const std::string& name : options.queries)
+    {
+        if (name != "hits" && name != "closest" && name != "count" && name != "any" && name != "nearest"
+            && name != "overlaps" && name != "tracked" && name != "fan")
+        {
+            std::fprintf(stderr, "unknown query %s\n", name.c_str());
+            return false;
+        }
+        if (options.churn && (name == "overlaps" || name == "tracked" || name == "fan"))
+        {
+            std::fprintf(stderr, "the %s query does not run after a churn\n", name.c_str());
+            return false;
+        }
+    }
+    if (options.format != "text" && options.format != "csv" && options.format != "json")
+    {
+        std::fprintf(stderr, "unknown format %s\n", options.format.c_str());
+        return false;
+    }
+    return true;
+}
+
+// the circles crowd around a few centers, a normal distribution each
+void generate_clustered_circles(std::mt19937& gen, std::vector<Circle>& circles,
+    const BBox& rect, double radius, std::size_t num_circles)
+{
+    std::uniform_real_distribution<> distri_x(rect.bottom_left.x + radius, rect.top_right.x - radius);
+    std::uniform_real_distribution<> distri_y(rect.bottom_left.y + radius, rect.top_right.y - radius);
+    double spread = (rect.top_right.x - rect.bottom_left.x) / 50.0;
+    std::normal_distribution<> distri_offset(0.0, spread);
+
+    std::size_t num_clusters = std::max<std::size_t>(1, num_circles / 1000);
+    std::vector<Point> centers;
+    for (std::size_t i = 0; i < num_clusters; ++i) centers.emplace_back(distri_x(gen), distri_y(gen));
+
+    std::uniform_int_distribution<std::size_t> distri_cluster(0, num_clusters - 1);
+    for (std::size_t i = 0; i < num_circles; ++i)
+    {
+        const Point& center = centers[distri_cluster(gen)];
+        double x = std::min(std::max(center.x + distri_offset(gen), rect.bottom_left.x + radius), rect.top_right.x - radius);
+        double y = std::min(std::max(center.y + distri_offset(gen), rect.bottom_left.y + radius), rect.top_right.y - radius);
+        circles.emplace_back(Point(x, y), radius);
+    }
+}
+
+// the circles are spread uniformly, their radii too, from a quarter of radius
+// to twice it
+void generate_mixed_circles(std::mt19937& gen, std::vector<Circle>& circles,
+    const BBox& rect, double radius, std::size_t num_circles)
+{
+    std::uniform_real_distribution<> distri_x(rect.bottom_left.x + 2.0 * radius, rect.top_right.x - 2.0 * radius);
+    std::uniform_real_distribution<> distri_y(rect.bottom_left.y + 2.0 * radius, rect.top_right.y - 2.0 * radius);
+    std::uniform_real_distribution<> distri_radius(0.25 * radius, 2.0 * radius);
+    for (std::size_t i = 0; i < num_circles; ++i)
+    {
+        double x = distri_x(gen), y = distri_y(gen);
+        circles.emplace_back(Point(x, y), distri_radius(gen));
+    }
+}
+
+// the updates of a churn: each erases the live circle at a position, moving
+// the last one into its place, and appends a new one
+struct Churn
+{
+    std::vector<std::uint32_t> positions;
+    std::vector<Circle> inserted;
+    std::vector<Circle> circles; // live after all updates
+};
+
+Churn make_churn(const std::vector<Circle>& circles, const BBox& rect, double radius, const Options& options)
+{
+    Churn churn;
+    churn.circles = circles;
+    if (circles.empty()) return churn;
+
+    std::mt19937 gen(options.seed + 1);
+    std::uniform_int_distribution<std::size_t> distri_position(0, circles.size() - 1);
+    std::uniform_real_distribution<> distri_x(rect.bottom_left.x + radius, rect.top_right.x - radius);
+    std::uniform_real_distribution<> distri_y(rect.bottom_left.y + radius, rect.top_right.y - radius);
+
+    std::size_t n = options.churn * options.updates;
+    churn.positions.reserve(n);
+    churn.inserted.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        std::size_t position = distri_position(gen);
+        Circle circle(Point(distri_x(gen), distri_y(gen)), radius);
+        churn.positions.push_back(static_cast<std::uint32_t>(position));
+        churn.inserted.push_back(circle);
+        churn.circles[position] = churn.circles.back();
+        churn.circles.back() = circle;
+    }
+    return churn;
+}
+
+IndexType index_type(const std::string& name)
+{
+    if (name == "bvh") return IndexType::bvh;
+    if (name == "grid") return IndexType::grid;
+    if (name == "compact") return IndexType::compact_kdtree;
+    return IndexType::kdtree;
+}
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0.0;
+    std::size_t i = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// writes a kd-tree snapshot and maps it as the index of alg; returns the
+// build info of the tree and the time to map it in load_ms
+BuildInfo load_snapshot(Algorithm& alg, const std::vector<Circle>& circles, const BBox& rect, 
+    const std::string& path, double& load_ms)
+{
+    KDTree tree;
+    BuildInfo info = tree.build(circles, rect, alg.m_pool_ptr.get());
+    std::string error;
+    if (!save_snapshot(path, circles, tree, &error))
+    {
+        std::fprintf(stderr, "%s\n", error.c_str());
+        std::exit(1);
+    }
+
+    Clock::time_point start = Clock::now();
+    std::unique_ptr<Snapshot> snapshot = std::make_unique<Snapshot>();
+    if (!snapshot->open_file(path, true, &error))
+    {
+        std::fprintf(stderr, "%s\n", error.c_str());
+        std::exit(1);
+    }
+    alg.m_index_ptr = std::make_unique<SnapshotIndex>(std::move(snapshot));
+    load_ms = seconds_since(start) * 1e3;
+    std::remove(path.c_str()); // the mapping stays valid
+    return info;
+}
+
+// erases and inserts the circles of a churn on the dynamic index of alg, 
+// whose ids are the positions of the circles; times each tick. live ends up
+// with the id of the circle at each position of churn.circles.
+void run_churn(Algorithm& alg, const Churn& churn, std::size_t num_circles, const Options& options, 
+    Result& result, std::vector<std::uint32_t>& live)
+{
+    live.resize(num_circles);
+    for (std::size_t i = 0; i < live.size(); ++i) live[i] = static_cast<std::uint32_t>(i);
+
+    double total_ms = 0.0;
+    std::size_t i = 0;
+    for (std::size_t tick = 0; tick < options.churn && i < churn.positions.size(); ++tick)
+    {
+        Clock::time_point start = Clock::now();
+        for (std::size_t end = i + options.updates; i < end; ++i)
+        {
+            std::uint32_t position = churn.positions[i];
+            alg.erase_circle(live[position]);
+            live[position] = live.back();
+            live.back() = alg.insert_circle(churn.inserted[i]);
+        }
+        double ms = seconds_since(start) * 1e3;
+        total_ms += ms;
+        result.max_tick_ms = std::max(result.max_tick_ms, ms);
+    }
+    if (options.churn) result.tick_ms = total_ms / options.churn;
+}
+
+// builds the index of alg and fills in the build and churn columns of result.
+// with a churn, the dynamic index is built over the first circles and takes
+// the updates, live being the id of each circle of churn->circles in it; the
+// others are built over churn->circles.
+void prepare(Algorithm& alg, const std::vector<Circle>& first_circles, const Churn* churn, 
+    const BBox& rect, const std::string& index, const Options& options, Result& result, 
+    std::vector<std::uint32_t>& live)
+{
+    if (index == "dynamic")
+    {
+        alg.m_index_type = IndexType::kdtree;
+        alg.set_dynamic(true);
+    }
+    else
+    {
+        alg.set_dynamic(false);
+        alg.set_index_type(index_type(index));
+    }
+
+    // the dynamic index goes through the churn after its build
+    const std::vector<Circle>& circles = churn && index != "dynamic" ? churn->circles : first_circles;
+
+    Clock::time_point start = Clock::now();
+    if (index == "snapshot")
+    {
+        result.build = load_snapshot(alg, circles, rect, options.snapshot_path, result.build_ms);
+    }
+    else if (index == "chunked")
+    {
+        std::unique_ptr<ChunkedIndex> chunked = std::make_unique<ChunkedIndex>(
+            [] { return Algorithm::make_index(IndexType::kdtree); }, options.chunk_size);
+        if (!options.input.empty() && !options.spill_dir.empty())
+        {
+            ImportStats stats;
+            std::string error;
+            if (!import_chunked(options.input, *chunked, nullptr, options.spill_dir, alg.m_pool_ptr.get(), &stats, &error))
+                std::fprintf(stderr, "%s\n", error.c_str());
+            else
+                std::fprintf(stderr, "spilled %zu chunks to %s\n", stats.chunks, options.spill_dir.c_str());
+            alg.m_index_ptr = std::move(chunked);
+        }
+        else
+        {
+            alg.m_index_ptr = std::move(chunked);
+            result.build = alg.build_index(circles, rect);
+        }
+        result.build_ms = seconds_since(start) * 1e3;
+    }
+    else
+    {
+        result.build = alg.build_index(circles, rect);
+        result.build_ms = seconds_since(start) * 1e3;
+    }
+
+    if (churn && index == "dynamic") 
+    {
+        run_churn(alg, *churn, circles.size(), options, result, live);
+    }
+    else if (churn)
+    {
+        result.tick_ms = result.max_tick_ms = result.build_ms;
+    }
+    result.memory_bytes = alg.m_index_ptr->memory_bytes();
+}
+
+// rays of the tracked query: turning about the origin of the first random
+// ray towards a point moving from corner to corner of rect
+std::vector<Ray> swept_rays(const std::vector<Ray>& random_rays, const BBox& rect)
+{
+    std::vector<Ray> swept;
+    if (random_rays.empty()) return swept;
+    Point origin = random_rays.front().origin;
+    for (std::size_t i = 0; i < random_rays.size(); ++i)
+    {
+        double t = (i + 0.5) / random_rays.size();
+        Vector2d d(rect.bottom_left.x + t * rect.width() - origin.x, rect.bottom_left.y + t * rect.height() - origin.y);
+        double length = std::sqrt(d.x * d.x + d.y * d.y);
+        swept.push_back(Ray(origin, length > 0.0 ? Vector2d(d.x / length, d.y / length) : Vector2d(1.0, 0.0)));
+    }
+    return swept;
+}
+
+// query points of the nearest query, halfway across the bounds on each ray
+std::vector<Point> query_points(const std::vector<Ray>& rays, const BBox& rect)
+{
+    std::vector<Point> points;
+    points.reserve(rays.size());
+    for (const Ray& ray : rays)
+    {
+        double length = std::sqrt(ray.direction.x * ray.direction.x + ray.direction.y * ray.direction.y);
+        double t = length > 0.0 ? 0.5 * std::max(rect.width(), rect.height()) / length : 0.0;
+        points.push_back(Point(ray.origin.x + t * ray.direction.x, ray.origin.y + t * ray.direction.y));
+    }
+    return points;
+}
+
+// count rays in a full turn from the middle of rect
+RayFan make_fan(const BBox& rect, std::size_t count)
+{
+    RayFan fan;
+    fan.origin = Point(0.5 * (rect.bottom_left.x + rect.top_right.x), 0.5 * (rect.bottom_left.y + rect.top_right.y));
+    fan.count = count;
+    fan.to = 2.0 * std::acos(-1.0) * (1.0 - 1.0 / std::max<double>(1.0, fan.count));
+    return fan;
+}
+
+Result run(Algorithm& alg, const std::vector<Circle>& first_circles, const Churn* churn, 
+    const std::vector<Ray>& random_rays, const BBox& rect, const std::string& index, const std::string& query, 
+    const Options& options)
+{
+    Result result = Result();
+    result.index = index;
+    result.query = query;
+
+    std::vector<std::uint32_t> live;
+    prepare(alg, first_circles, churn, rect, index, options, result, live);
+    const std::vector<Circle>& circles = churn && index != "dynamic" ? churn->circles : first_circles;
+    Clock::time_point start;
+
+    if (query == "overlaps")
+    {
+        std::vector<OverlapPair> pairs;
+        ThreadPool serial(1);
+        start = Clock::now();
+        alg.m_index_ptr->detect_overlaps(circles, pairs, serial);
+        double serial_seconds = seconds_since(start);
+
+        alg.reset_stats();
+        start = Clock::now();
+        alg.detect_overlaps(circles, pairs);
+        double batch_seconds = seconds_since(start);
+        result.stats = alg.total_query_stats();
+
+        if (!circles.empty())
+        {
+            result.hits_per_ray = double(pairs.size()) / circles.size();
+            if (serial_seconds > 0.0) result.queries_per_second = circles.size() / serial_seconds;
+            if (batch_seconds > 0.0) result.batch_queries_per_second = circles.size() / batch_seconds;
+        }
+        return result;
+    }
+
+    if (query == "fan")
+    {
+        RayFan fan = make_fan(rect, random_rays.size());
+        VisibilityPolygon polygon;
+        ThreadPool serial(1);
+        start = Clock::now();
+        std::size_t visited = alg.m_index_ptr->cast_fan(fan, circles, polygon, serial);
+        double serial_seconds = seconds_since(start);
+
+        alg.reset_stats();
+        start = Clock::now();
+        alg.cast_fan(fan, circles, polygon);
+        double batch_seconds = seconds_since(start);
+        result.stats = alg.total_query_stats();
+
+        if (fan.count)
+        {
+            std::size_t hits = 0;
+            for (std::uint32_t id : polygon.ids) hits += id != RayHit::null;
+            result.hits_per_ray = double(hits) / fan.count;
+            result.visited_per_ray = double(visited) / fan.count;
+            if (serial_seconds > 0.0) result.queries_per_second = fan.count / serial_seconds;
+            if (batch_seconds > 0.0) result.batch_queries_per_second = fan.count / batch_seconds;
+        }
+        return result;
+    }
+
+    // the tracked query gathers candidates within half a percent of the
+    // bounds of its rays
+    std::vector<Ray> swept;
+    if (query == "tracked") swept = swept_rays(random_rays, rect);
+    const std::vector<Ray>& rays = query == "tracked" ? swept : random_rays;
+    CoherentRayQuery tracker;
+    double margin = 0.005 * std::max(rect.width(), rect.height());
+
+    std::vector<Point> points;
+    if (query == "nearest") points = query_points(rays, rect);
+
+    // serial queries, each one timed
+    std::vector<double> latencies(rays.size());
+    std::vector<std::uint32_t> ids;
+    std::vector<Neighbor> neighbors;
+    std::size_t hits = 0, visited = 0;
+    alg.reset_stats();
+    start = Clock::now();
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        Clock::time_point query_start = Clock::now();
+        if (query == "hits")
+        {
+            ids.clear();
+            visited += alg.detect_intersection(rays[i], ids);
+            hits += ids.size();
+        }
+        else if (query == "count")
+        {
+            hits += alg.count_intersections(rays[i]);
+        }
+        else if (query == "any")
+        {
+            hits += alg.any_intersection(rays[i]);
+        }
+        else if (query == "nearest")
+        {
+            visited += alg.nearest(points[i], options.k, neighbors);
+            hits += neighbors.size();
+        }
+        else if (query == "tracked")
+        {
+            ids.clear();
+            visited += tracker.query(*alg.m_index_ptr, circles, rays[i], margin, ids);
+            hits += ids.size();
+        }
+        else
+        {
+            RayHit hit;
+            visited += alg.closest_hit(rays[i], hit);
+            hits += hit.valid();
+        }
+        latencies[i] = seconds_since(query_start) * 1e6;
+    }
+    double serial_seconds = seconds_since(start);
+    result.stats = alg.total_query_stats();
+
+    std::sort(latencies.begin(), latencies.end());
+    result.p50_us = percentile(latencies, 0.50);
+    result.p99_us = percentile(latencies, 0.99);
+    if (!rays.empty())
+    {
+        result.queries_per_second = serial_seconds > 0.0 ? rays.size() / serial_seconds : 0.0;
+        result.hits_per_ray = double(hits) / rays.size();
+        result.visited_per_ray = double(visited) / rays.size();
+    }
+
+    // the same rays as one batch on the pool
+    start = Clock::now();
+    if (query == "hits" || query == "tracked")
+    {
+        BatchHits batch;
+        alg.detect_intersection_batch(rays, batch);
+    }
+    else if (query == "count" || query == "any")
+    {
+        std::vector<std::size_t> counts(rays.size());
+        alg.m_pool_ptr->parallel_for(0, rays.size(), 64, [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; ++i)
+            {
+                counts[i] = query == "count" ? alg.m_index_ptr->count_intersections(rays[i]) 
+                    : alg.m_index_ptr->any_intersection(rays[i]);
+            }
+        });
+    }
+    else if (query == "nearest")
+    {
+        alg.m_pool_ptr->parallel_for(0, points.size(), 64, [&](std::size_t first, std::size_t last) {
+            std::vector<Neighbor> found;
+            for (std::size_t i = first; i < last; ++i) alg.m_index_ptr->nearest(points[i], options.k, found);
+        });
+    }
+    else
+    {
+        std::vector<RayHit> closest(rays.size());
+        alg.m_pool_ptr->parallel_for(0, rays.size(), 64, [&](std::size_t first, std::size_t last) {
+            for (std::size_t i = first; i < last; ++i) alg.m_index_ptr->closest_hit(rays[i], closest[i]);
+        });
+    }
+    double batch_seconds = seconds_since(start);
+    if (batch_seconds > 0.0) result.batch_queries_per_second = rays.size() / batch_seconds;
+
+    return result;
+}
+
+// a circle found by a brute-force scan near a query of --verify, with its
+// slack: how far it is from reaching the query, negative when it does
+struct Near
+{
+    std::uint32_t id;
+    double slack;
+    double t; // of the first boundary crossing, for rays
+};
+
+// how far an index may be off in distance: float precision for the compact
+// kd-tree, rounding of the double arithmetic for the others
+double tolerance(const std::string& index, double scale)
+{
+    return (index == "compact" ? 1e-6 : 1e-9) * scale;
+}
+
+// the circles within reach of the ray over [0, inf), in id order
+void scan_ray(const std::vector<Circle>& circles, const Ray& ray, double reach, std::vector<Near>& found)
+{
+    for (std::size_t i = 0; i < circles.size(); ++i)
+    {
+        const Circle& circle = circles[i];
+        double x = circle.center.x - ray.origin.x, y = circle.center.y - ray.origin.y;
+        double proj = x * ray.direction.x + y * ray.direction.y;
+        double s = std::max(proj, 0.0);
+        double ex = x - s * ray.direction.x, ey = y - s * ray.direction.y;
+        double slack = std::sqrt(ex * ex + ey * ey) - circle.radius;
+        if (slack > reach) continue;
+        double h = std::sqrt(std::max(0.0, circle.radius * circle.radius - (x * x + y * y - proj * proj)));
+        found.push_back(Near{static_cast<std::uint32_t>(i), slack, proj - h >= 0.0 ? proj - h : proj + h});
+    }
+}
+
+// the circles within reach of the window, in id order
+void scan_window(const std::vector<Circle>& circles, const BBox& window, double reach, std::vector<Near>& found)
+{
+    for (std::size_t i = 0; i < circles.size(); ++i)
+    {
+        const Circle& circle = circles[i];
+        double x = circle.center.x - std::min(std::max(circle.center.x, window.bottom_left.x), window.top_right.x);
+        double y = circle.center.y - std::min(std::max(circle.center.y, window.bottom_left.y), window.top_right.y);
+        double slack = std::sqrt(x * x + y * y) - circle.radius;
+        if (slack <= reach) found.push_back(Near{static_cast<std::uint32_t>(i), slack, 0.0});
+    }
+}
+
+// the distances to the k circles nearest to the point, nearest first
+void scan_nearest(const std::vector<Circle>& circles, const Point& point, std::size_t k, 
+    std::vector<double>& found)
+{
+    found.resize(circles.size());
+    for (std::size_t i = 0; i < circles.size(); ++i)
+        found[i] = circle_distance(point, circles[i].center.x, circles[i].center.y, circles[i].radius);
+    k = std::min(k, found.size());
+    std::partial_sort(found.begin(), found.begin() + k, found.end());
+    found.resize(k);
+}
+
+// the pairs within reach of overlapping, first < second and sorted, by a
+// sweep over the circles sorted by x; a pair's query is its first circle
+void scan_overlaps(const std::vector<Circle>& circles, double reach, 
+    std::vector<std::pair<OverlapPair, double>>& found)
+{
+    std::vector<std::uint32_t> order(circles.size());
+    double max_radius = 0.0;
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = static_cast<std::uint32_t>(i);
+        max_radius = std::max(max_radius, circles[i].radius);
+    }
+    std::sort(order.begin(), order.end(), 
+        [&](std::uint32_t a, std::uint32_t b) { return circles[a].center.x < circles[b].center.x; });
+
+    for (std::size_t i = 0; i < order.size(); ++i)
+    {
+        const Circle& a = circles[order[i]];
+        for (std::size_t j = i + 1; j < order.size(); ++j)
+        {
+            const Circle& b = circles[order[j]];
+            if (b.center.x - a.center.x > 2.0 * max_radius + reach) break;
+            double x = b.center.x - a.center.x, y = b.center.y - a.center.y;
+            double slack = std::sqrt(x * x + y * y) - (a.radius + b.radius);
+            if (slack > reach) continue;
+            std::uint32_t first = std::min(order[i], order[j]), second = std::max(order[i], order[j]);
+            found.push_back(std::make_pair(OverlapPair{first, second}, slack));
+        }
+    }
+    std::sort(found.begin(), found.end(), 
+        [](const std::pair<OverlapPair, double>& a, const std::pair<OverlapPair, double>& b) {
+        return a.first.first != b.first.first ? a.first.first < b.first.first : a.first.second < b.first.second; });
+}
+
+// what --verify found for an index and a query
+struct Verdict
+{
+    std::string index, query;
+    std::size_t checked = 0, mismatches = 0;
+    std::string first; // the first mismatch, after the number of its query
+
+    void fail(std::size_t query, const char* what, std::uint32_t id)
+    {
+        if (mismatches++) return;
+        char buffer[128];
+        std::snprintf(buffer, sizeof(buffer), "%zu: %s %u", query, what, id);
+        first = buffer;
+    }
+};
+
+// the ids a query reported, as positions in the circles, against the circles
+// a scan found near it: the ones reaching it by more than the tolerance must
+// be there, and no other than the ones within it
+void check_ids(std::vector<std::uint32_t>& ids, const std::vector<Near>& near, double tolerance, 
+    std::size_t query, Verdict& verdict)
+{
+    ++verdict.checked;
+    std::sort(ids.begin(), ids.end());
+    std::vector<std::uint32_t>::iterator twice = std::adjacent_find(ids.begin(), ids.end());
+    if (twice != ids.end()) verdict.fail(query, "reported twice: circle", *twice);
+    for (const Near& n : near)
+    {
+        if (n.slack < -tolerance && !std::binary_search(ids.begin(), ids.end(), n.id)) 
+            verdict.fail(query, "missed circle", n.id);
+    }
+    for (std::uint32_t id : ids)
+    {
+        std::vector<Near>::const_iterator it = std::lower_bound(near.begin(), near.end(), id, 
+            [](const Near& n, std::uint32_t id) { return n.id < id; });
+        if (it == near.end() || it->id != id || it->slack > tolerance) 
+            verdict.fail(query, "reported a circle out of reach:", id);
+    }
+}
+
+// a closest hit at t of the circle at position id, or none for RayHit::null:
+// within the tolerance of the first crossing of the circles reaching the ray
+// by more than it, and of the ones within it. t is less certain than the
+// distance near a tangent, by up to the square root of twice the radius
+// times the tolerance.
+void check_closest(std::uint32_t id, double t, const std::vector<Near>& near, double tolerance, 
+    double max_radius, std::size_t query, Verdict& verdict)
+{
+    ++verdict.checked;
+    const double inf = std::numeric_limits<double>::infinity();
+    double lo = inf, hi = inf;
+    for (const Near& n : near)
+    {
+        if (n.slack <= tolerance) lo = std::min(lo, n.t);
+        if (n.slack < -tolerance) hi = std::min(hi, n.t);
+    }
+    if (id == RayHit::null)
+    {
+        if (hi < inf) verdict.fail(query, "no closest hit, missed circle", 0);
+        return;
+    }
+    std::vector<Near>::const_iterator it = std::lower_bound(near.begin(), near.end(), id, 
+        [](const Near& n, std::uint32_t id) { return n.id < id; });
+    if (it == near.end() || it->id != id || it->slack > tolerance)
+    {
+        verdict.fail(query, "closest hit out of reach: circle", id);
+        return;
+    }
+    double slack = tolerance + std::sqrt(2.0 * max_radius * tolerance);
+    if (t < lo - slack || t > hi + slack || std::abs(t - it->t) > slack)
+        verdict.fail(query, "closest hit at the wrong distance: circle", id);
+}
+
+// a fan of 32 rays 0.005 apart, one block of cast_fan, whose middle ray hits
+// a small circle at 1 and whose first ray a small circle at 1.99 just before
+// a large one: the block must gather the circles along its edge rays too.
+// its rays are checked like the other closest hits.
+Verdict verify_fan_edge(Algorithm& alg, const std::string& index, const Options& options)
+{
+    RayFan fan;
+    fan.count = 32;
+    fan.to = 31 * 0.005;
+    Ray middle = fan.ray(16), edge = fan.ray(0);
+    std::vector<Circle> circles = {Circle(middle.origin + middle.direction * 1.0, 0.001),
+        Circle(edge.origin + edge.direction * 1.99, 0.002), Circle(edge.origin + edge.direction * 2.19, 0.2)};
+    BBox rect = BBox::empty();
+    for (const Circle& circle : circles) rect.extend(BBox::of(circle));
+
+    Result result = Result();
+    std::vector<std::uint32_t> live;
+    prepare(alg, circles, nullptr, rect, index, options, result, live);
+
+    Verdict verdict;
+    verdict.index = index;
+    verdict.query = "fan-edge";
+    VisibilityPolygon polygon;
+    alg.m_index_ptr->cast_fan(fan, circles, polygon, *alg.m_pool_ptr);
+    double tol = tolerance(index, 3.0);
+    std::vector<Near> near;
+    for (std::size_t i = 0; i < fan.count; ++i)
+    {
+        near.clear();
+        scan_ray(circles, fan.ray(i), tolerance("compact", 3.0), near);
+        check_closest(polygon.ids[i], polygon.distances[i], near, tol, 0.2, i, verdict);
+    }
+    return verdict;
+}
+
+// a snapshot of the circles with a damaged tree, written and opened without
+// its checksum: a child or leaf past the end of its section, a leaf larger
+// than the kernels take, an id past the circles and a count whose size
+// overflows must each be refused, and the undamaged file opened
+Verdict verify_snapshot_damage(const std::vector<Circle>& circles, const BBox& rect, const Options& options)
+{
+    Verdict verdict;
+    verdict.index = "snapshot";
+    verdict.query = "damaged";
+    KDTree tree;
+    std::string error;
+    const std::string& path = options.snapshot_path;
+    std::vector<unsigned char> file;
+    tree.build(circles, rect);
+    if (save_snapshot(path, circles, tree, &error))
+    {
+        std::FILE* in = std::fopen(path.c_str(), "rb");
+        if (in)
+        {
+            unsigned char buffer[1 << 16];
+            for (std::size_t got; (got = std::fread(buffer, 1, sizeof(buffer), in)) > 0; )
+                file.insert(file.end(), buffer, buffer + got);
+            std::fclose(in);
+        }
+    }
+    SnapshotHeader header;
+    if (file.size() < sizeof(header) || circles.empty())
+    {
+        verdict.fail(0, "cannot write a snapshot of circles:", static_cast<std::uint32_t>(circles.size()));
+        std::remove(path.c_str());
+        return verdict;
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+
+    auto opens = [&](const std::vector<unsigned char>& bytes) {
+        std::FILE* out = std::fopen(path.c_str(), "wb");
+        if (!out) return false;
+        bool written = std::fwrite(bytes.data(), bytes.size(), 1, out) == 1;
+        written = std::fclose(out) == 0 && written;
+        Snapshot snapshot;
+        return written && snapshot.open_file(path, false);
+    };
+    auto node_at = [&](std::vector<unsigned char>& bytes, std::size_t i) {
+        return reinterpret_cast<KDNode*>(&bytes[header.offsets[SnapshotHeader::nodes]] + i * sizeof(KDNode));
+    };
+    std::size_t inner = header.num_nodes, leaf = header.num_nodes;
+    for (std::size_t i = 0; i < header.num_nodes; ++i)
+    {
+        if (node_at(file, i)->is_leaf()) leaf = std::min(leaf, i);
+        else inner = std::min(inner, i);
+    }
+
+    ++verdict.checked;
+    if (!opens(file)) verdict.fail(0, "undamaged snapshot refused, nodes:", static_cast<std::uint32_t>(header.num_nodes));
+    for (std::size_t k = 0; k < 5; ++k)
+    {
+        std::vector<unsigned char> damaged = file;
+        const char* what = nullptr;
+        if (k == 0 && inner < header.num_nodes)
+        {
+            node_at(damaged, inner)->index = static_cast<std::uint32_t>(header.num_nodes);
+            what = "child past the nodes opened at node";
+        }
+        else if (k == 1 && leaf < header.num_nodes)
+        {
+            node_at(damaged, leaf)->index = static_cast<std::uint32_t>(header.num_circles);
+            what = "leaf past the circles opened at node";
+        }
+        else if (k == 2 && leaf < header.num_nodes)
+        {
+            node_at(damaged, leaf)->flags = (KDTree::max_leaf_size + 1) << 1;
+            what = "leaf larger than max_leaf_size opened at node";
+        }
+        else if (k == 3)
+        {
+            std::uint32_t id = static_cast<std::uint32_t>(header.num_circles);
+            std::memcpy(&damaged[header.offsets[SnapshotHeader::ids]], &id, sizeof(id));
+            what = "id past the circles opened at position";
+        }
+        else if (k == 4)
+        {
+            SnapshotHeader wrapped = header;
+            wrapped.num_circles = (std::uint64_t(1) << 61) + header.num_circles;
+            std::memcpy(damaged.data(), &wrapped, sizeof(wrapped));
+            what = "overflowing count of circles opened, low word";
+        }
+        if (!what) continue;
+        ++verdict.checked;
+        std::uint32_t where[] = {static_cast<std::uint32_t>(inner), static_cast<std::uint32_t>(leaf), 
+            static_cast<std::uint32_t>(leaf), 0, static_cast<std::uint32_t>(header.num_circles)};
+        if (opens(damaged)) verdict.fail(k, what, where[k]);
+    }
+    std::remove(path.c_str());
+    return verdict;
+}
+
+// checks every index against brute-force scans of the circles: the circles
+// as it stores them, the hits, count, any and closest hit of the rays, a
+// window around the nearest query point of each ray, its k nearest circles,
+// the overlapping pairs, the fan and the tracked rays. the scans are run once, on the pool, and shared by
+// the indexes. each index first casts the fan of verify_fan_edge(), and the
+// snapshot index is opened damaged by verify_snapshot_damage(). with a
+// churn, the circles are those left by it, and the dynamic index is not
+// asked for the overlaps, fan and tracked rays, which take the circles by id.
+std::vector<Verdict> verify(Algorithm& alg, const std::vector<Circle>& first_circles, const Churn* churn, 
+    const std::vector<Ray>& random_rays, const BBox& rect, const Options& options)
+{
+    const std::vector<Circle>& circles = churn ? churn->circles : first_circles;
+    double scale = std::max({std::abs(rect.bottom_left.x), std::abs(rect.bottom_left.y), 
+        std::abs(rect.top_right.x), std::abs(rect.top_right.y), rect.width(), rect.height()});
+    double max_radius = 0.0;
+    for (const Circle& circle : circles) max_radius = std::max(max_radius, circle.radius);
+    double reach = tolerance("compact", scale);
+
+    std::vector<Ray> swept = swept_rays(random_rays, rect);
+    std::vector<Point> points = query_points(random_rays, rect);
+    double half = 0.01 * std::max(rect.width(), rect.height());
+    RayFan fan = make_fan(rect, random_rays.size());
+    double margin = 0.005 * std::max(rect.width(), rect.height());
+
+    std::size_t n = random_rays.size();
+    std::vector<std::vector<Near>> near_rays(n), near_swept(n), near_fan(n), near_windows(n);
+    std::vector<std::vector<double>> nearest(n);
+    alg.m_pool_ptr->parallel_for(0, n, 16, [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; ++i)
+        {
+            scan_ray(circles, random_rays[i], reach, near_rays[i]);
+            scan_ray(circles, swept[i], reach, near_swept[i]);
+            scan_ray(circles, fan.ray(i), reach, near_fan[i]);
+            BBox window(Point(points[i].x - half, points[i].y - half), Point(points[i].x + half, points[i].y + half));
+            scan_window(circles, window, reach, near_windows[i]);
+            scan_nearest(circles, points[i], options.k, nearest[i]);
+        }
+    });
+    std::vector<std::pair<OverlapPair, double>> near_pairs;
+    scan_overlaps(circles, reach, near_pairs);
+
+    std::vector<Verdict> verdicts;
+    verdicts.reserve(12 * options.indexes.size()); // add() hands out references
+    for (const std::string& index : options.indexes)
+    {
+        verdicts.push_back(verify_fan_edge(alg, index, options));
+        if (index == "snapshot") verdicts.push_back(verify_snapshot_damage(circles, rect, options));
+
+        Result result = Result();
+        std::vector<std::uint32_t> live;
+        prepare(alg, first_circles, churn, rect, index, options, result, live);
+        const SpatialIndex& searched = *alg.m_index_ptr;
+        double tol = tolerance(index, scale);
+
+        // ids of the index as positions in the circles, null for none
+        std::vector<std::uint32_t> position_of;
+        for (std::size_t p = 0; p < live.size(); ++p)
+        {
+            if (live[p] >= position_of.size()) position_of.resize(live[p] + 1, RayHit::null);
+            position_of[live[p]] = static_cast<std::uint32_t>(p);
+        }
+        auto position = [&](std::uint32_t id) -> std::uint32_t {
+            if (live.empty()) return id < circles.size() ? id : RayHit::null;
+            return id < position_of.size() ? position_of[id] : RayHit::null;
+        };
+        auto add = [&](const char* query) -> Verdict& {
+            verdicts.push_back(Verdict());
+            verdicts.back().index = index;
+            verdicts.back().query = query;
+            return verdicts.back();
+        };
+
+        // every circle as the index stores it, from a capsule over all of
+        // them: each once, and its disc holding the exact one, which the
+        // compact kd-tree's rounding outwards must keep
+        Verdict& stored = add("stored");
+        struct Stored : CircleVisitor
+        {
+            std::vector<Circle> found;
+            std::vector<std::uint32_t> ids;
+
+            bool on_circle(std::uint32_t id, double cx, double cy, double radius) override
+            {
+                ids.push_back(id);
+                found.push_back(Circle(Point(cx, cy), radius));
+                return true;
+            }
+        } all;
+        searched.query_capsule(Segment(rect.bottom_left, rect.top_right), 
+            scale + max_radius, circles, all);
+        std::vector<bool> seen(circles.size(), false);
+        for (std::size_t j = 0; j < all.ids.size(); ++j)
+        {
+            std::uint32_t p = position(all.ids[j]);
+            ++stored.checked;
+            if (p == RayHit::null || seen[p])
+            {
+                stored.fail(j, "stored twice or unknown: circle", all.ids[j]);
+                continue;
+            }
+            seen[p] = true;
+            const Circle& exact = circles[p];
+            const Circle& found = all.found[j];
+            double x = found.center.x - exact.center.x, y = found.center.y - exact.center.y;
+            if (std::sqrt(x * x + y * y) + exact.radius > found.radius + 1e-12 * scale)
+                stored.fail(j, "stored disc does not hold circle", p);
+        }
+        if (all.ids.size() != circles.size()) 
+            stored.fail(all.ids.size(), "circles stored:", static_cast<std::uint32_t>(all.ids.size()));
+
+        std::vector<std::uint32_t> ids;
+        Verdict& hits = add("hits");
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ids.clear();
+            searched.detect_intersection(random_rays[i], ids);
+            for (std::uint32_t& id : ids) id = position(id);
+            check_ids(ids, near_rays[i], tol, i, hits);
+        }
+
+        Verdict& count = add("count");
+        Verdict& any = add("any");
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            std::size_t must = 0, may = 0;
+            for (const Near& near : near_rays[i])
+            {
+                must += near.slack < -tol;
+                may += near.slack <= tol;
+            }
+            std::size_t counted = searched.count_intersections(random_rays[i]);
+            ++count.checked;
+            if (counted < must || counted > may) 
+                count.fail(i, "counted hits:", static_cast<std::uint32_t>(counted));
+            bool found = searched.any_intersection(random_rays[i]);
+            ++any.checked;
+            if (found ? may == 0 : must > 0) any.fail(i, "any hit:", found);
+        }
+
+        Verdict& closest = add("closest");
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            RayHit hit;
+            searched.closest_hit(random_rays[i], hit);
+            check_closest(hit.valid() ? position(hit.id) : RayHit::null, hit.t, near_rays[i], tol, 
+                max_radius, i, closest);
+        }
+
+        Verdict& window = add("window");
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ids.clear();
+            BBox box(Point(points[i].x - half, points[i].y - half), Point(points[i].x + half, points[i].y + half));
+            searched.collect_window(box, ids);
+            for (std::uint32_t& id : ids) id = position(id);
+            check_ids(ids, near_windows[i], tol, i, window);
+        }
+
+        Verdict& knn = add("nearest");
+        std::vector<Neighbor> neighbors;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            searched.nearest(points[i], options.k, neighbors);
+            ++knn.checked;
+            if (neighbors.size() != nearest[i].size())
+            {
+                knn.fail(i, "neighbors found:", static_cast<std::uint32_t>(neighbors.size()));
+                continue;
+            }
+            ids.clear();
+            for (std::size_t j = 0; j < neighbors.size(); ++j)
+            {
+                std::uint32_t p = position(neighbors[j].id);
+                ids.push_back(p);
+                double distance = p == RayHit::null ? std::numeric_limits<double>::infinity() 
+                    : circle_distance(points[i], circles[p].center.x, circles[p].center.y, circles[p].radius);
+                if (std::abs(neighbors[j].distance - nearest[i][j]) > tol 
+                    || std::abs(distance - nearest[i][j]) > tol)
+                    knn.fail(i, "wrong neighbor: circle", p);
+            }
+            std::sort(ids.begin(), ids.end());
+            if (std::adjacent_find(ids.begin(), ids.end()) != ids.end()) knn.fail(i, "neighbor found twice", 0);
+        }
+
+        if (churn && index == "dynamic") continue;
+
+        Verdict& overlaps = add("overlaps");
+        std::vector<OverlapPair> pairs;
+        searched.detect_overlaps(circles, pairs, *alg.m_pool_ptr);
+        std::sort(pairs.begin(), pairs.end(), [](const OverlapPair& a, const OverlapPair& b) {
+            return a.first != b.first ? a.first < b.first : a.second < b.second; });
+        auto find_pair = [](const std::vector<OverlapPair>& pairs, const OverlapPair& pair) {
+            return std::binary_search(pairs.begin(), pairs.end(), pair, 
+                [](const OverlapPair& a, const OverlapPair& b) {
+                return a.first != b.first ? a.first < b.first : a.second < b.second; });
+        };
+        std::vector<OverlapPair> allowed;
+        for (const std::pair<OverlapPair, double>& near : near_pairs)
+        {
+            ++overlaps.checked;
+            if (near.second < -tol && !find_pair(pairs, near.first)) 
+                overlaps.fail(near.first.first, "missed pair with", near.first.second);
+            if (near.second <= tol) allowed.push_back(near.first);
+        }
+        for (std::size_t i = 0; i < pairs.size(); ++i)
+        {
+            if (pairs[i].first >= pairs[i].second || !find_pair(allowed, pairs[i])
+                || (i && pairs[i].first == pairs[i - 1].first && pairs[i].second == pairs[i - 1].second))
+                overlaps.fail(pairs[i].first, "wrong pair with", pairs[i].second);
+        }
+
+        Verdict& fan_hits = add("fan");
+        VisibilityPolygon polygon;
+        searched.cast_fan(fan, circles, polygon, *alg.m_pool_ptr);
+        for (std::size_t i = 0; i < n; ++i)
+            check_closest(polygon.ids[i], polygon.distances[i], near_fan[i], tol, max_radius, i, fan_hits);
+
+        Verdict& tracked = add("tracked");
+        CoherentRayQuery tracker;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            ids.clear();
+            tracker.query(searched, circles, swept[i], margin, ids);
+            check_ids(ids, near_swept[i], tol, i, tracked);
+        }
+    }
+    return verdicts;
+}
+
+double per_ray(std::uint64_t count, const Result& r)
+{
+    return r.rays ? double(count) / r.rays : 0.0;
+}
+
+// build phases as name=ms pairs joined by sep
+std::string phases(const Result& r, const char* sep)
+{
+    std::string text;
+    char buffer[64];
+    for (const BuildPhase& phase : r.build.phases)
+    {
+        std::snprintf(buffer, sizeof(buffer), "%s%s=%.4f", text.empty() ? "" : sep, phase.name, phase.ms);
+        text += buffer;
+    }
+    return text;
+}
+
+void print_text_header()
+{
+    std::printf("%10s %7s %-10s %8s %-8s %-8s %10s %9s %9s %6s %10s %8s %12s %12s %9s %9s %8s %9s",
+        "circles", "radius", "distrib", "rays", "index", "query", "build_ms", "tick_ms", "max_tick", "depth", "nodes", "mem_B/c",
+        "queries/s", "batch_q/s", "p50_us", "p99_us", "hits", "visited");
+    if (query_stats_enabled)
+        std::printf(" %9s %9s %6s  %s", "bboxes", "circles", "stack", "phases_ms");
+    std::printf("\n");
+}
+
+void print_text(const Result& r)
+{
+    std::printf("%10zu %7.3g %-10s %8zu %-8s %-8s %10.2f %9.2f %9.2f %6zu %10zu %8.1f %12.0f %12.0f %9.2f %9.2f %8.2f %9.1f",
+        r.circles, r.radius, r.distribution.c_str(), r.rays, r.index.c_str(), r.query.c_str(),
+        r.build_ms, r.tick_ms, r.max_tick_ms, r.build.depth, r.build.nodes, r.circles ? double(r.memory_bytes) / r.circles : 0.0,
+        r.queries_per_second, r.batch_queries_per_second, r.p50_us, r.p99_us, r.hits_per_ray, r.visited_per_ray);
+    if (query_stats_enabled)
+        std::printf(" %9.1f %9.1f %6u  %s", per_ray(r.stats.bbox_tests, r), per_ray(r.stats.circle_tests, r),
+            r.stats.max_stack_depth, phases(r, " ").c_str());
+    std::printf("\n");
+}
+
+void print_csv_header()
+{
+    std::printf("circles,radius,distribution,rays,index,query,build_ms,tick_ms,max_tick_ms,depth,nodes,memory_bytes,"
+        "queries_per_second,batch_queries_per_second,p50_us,p99_us,hits_per_ray,visited_per_ray");
+    if (query_stats_enabled)
+        std::printf(",bbox_tests_per_ray,circle_tests_per_ray,max_stack_depth,build_phases_ms");
+    std::printf("\n");
+}
+
+void print_csv(const Result& r)
+{
+    std::printf("%zu,%g,%s,%zu,%s,%s,%.4f,%.4f,%.4f,%zu,%zu,%zu,%.1f,%.1f,%.4f,%.4f,%.4f,%.4f",
+        r.circles, r.radius, r.distribution.c_str(), r.rays, r.index.c_str(), r.query.c_str(),
+        r.build_ms, r.tick_ms, r.max_tick_ms, r.build.depth, r.build.nodes, r.memory_bytes,
+        r.queries_per_second, r.batch_queries_per_second, r.p50_us, r.p99_us, r.hits_per_ray, r.visited_per_ray);
+    if (query_stats_enabled)
+        std::printf(",%.4f,%.4f,%u,%s", per_ray(r.stats.bbox_tests, r), per_ray(r.stats.circle_tests, r),
+            r.stats.max_stack_depth, phases(r, ";").c_str());
+    std::printf("\n");
+}
+
+void print_json(const Result& r, bool first)
+{
+    std::printf("%s\n  {\"circles\": %zu, \"radius\": %g, \"distribution\": \"%s\", \"rays\": %zu, "
+        "\"index\": \"%s\", \"query\": \"%s\", \"build_ms\": %.4f, \"tick_ms\": %.4f, \"max_tick_ms\": %.4f, "
+        "\"depth\": %zu, \"nodes\": %zu, "
+        "\"memory_bytes\": %zu, \"queries_per_second\": %.1f, \"batch_queries_per_second\": %.1f, "
+        "\"p50_us\": %.4f, \"p99_us\": %.4f, \"hits_per_ray\": %.4f, \"visited_per_ray\": %.4f",
+        first ? "" : ",",
+        r.circles, r.radius, r.distribution.c_str(), r.rays, r.index.c_str(), r.query.c_str(),
+        r.build_ms, r.tick_ms, r.max_tick_ms, r.build.depth, r.build.nodes, r.memory_bytes,
+        r.queries_per_second, r.batch_queries_per_second, r.p50_us, r.p99_us, r.hits_per_ray, r.visited_per_ray);
+    if (query_stats_enabled)
+    {
+        std::printf(", \"bbox_tests_per_ray\": %.4f, \"circle_tests_per_ray\": %.4f, \"max_stack_depth\": %u, "
+            "\"build_phases_ms\": {", per_ray(r.stats.bbox_tests, r), per_ray(r.stats.circle_tests, r), 
+            r.stats.max_stack_depth);
+        for (std::size_t i = 0; i < r.build.phases.size(); ++i)
+            std::printf("%s\"%s\": %.4f", i ? ", " : "", r.build.phases[i].name, r.build.phases[i].ms);
+        std::printf("}");
+    }
+    std::printf("}");
+}
+
+void print_verify_header()
+{
+    std::printf("%10s %7s %-10s %8s %-8s %-8s %10s %10s  %s\n",
+        "circles", "radius", "distrib", "rays", "index", "query", "checked", "mismatch", "first");
+}
+
+void print_verify(std::size_t circles, double radius, const std::string& distribution, std::size_t rays, 
+    const Verdict& v)
+{
+    std::printf("%10zu %7.3g %-10s %8zu %-8s %-8s %10zu %10zu  %s\n", circles, radius, distribution.c_str(), rays,
+        v.index.c_str(), v.query.c_str(), v.checked, v.mismatches, v.first.c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse(argc, argv, options))
+    {
+        usage();
+        return 1;
+    }
+
+    // the scene of the viewer: 1000-by-1000, rays from the border of a
+    // slightly larger rect
+    const BBox rect(Point(0.0, 0.0), Point(1000.0, 1000.0));
+    const BBox viewer_rect(Point(-100.0, -100.0), Point(1100.0, 1100.0));
+
+    Algorithm alg;
+    alg.m_pool_ptr = std::make_unique<ThreadPool>(std::max<std::size_t>(1, options.threads));
+
+    if (options.verify) print_verify_header();
+    else if (options.format == "text") print_text_header();
+    else if (options.format == "csv") print_csv_header();
+    else std::printf("[");
+
+    bool first = true;
+    bool mismatched = false;
+    auto run_all = [&](const std::vector<Circle>& circles, const BBox& rect, const BBox& viewer_rect,
+        double radius, const std::string& distribution)
+    {
+        Churn churn;
+        if (options.churn) churn = make_churn(circles, rect, radius, options);
+
+        for (std::size_t num_rays : options.rays)
+        {
+            std::vector<Ray> rays(num_rays);
+            for (Ray& ray : rays) alg.generate_random_ray(ray, viewer_rect);
+
+            if (options.verify)
+            {
+                for (const Verdict& verdict : verify(alg, circles, options.churn ? &churn : nullptr, rays, rect, options))
+                {
+                    print_verify(circles.size(), radius, distribution, num_rays, verdict);
+                    mismatched = mismatched || verdict.mismatches;
+                }
+                std::fflush(stdout);
+                continue;
+            }
+
+            for (const std::string& index : options.indexes)
+            for (const std::string& query : options.queries)
+            {
+                Result result = run(alg, circles, options.churn ? &churn : nullptr, rays, rect, index, query, options);
+                result.circles = circles.size();
+                result.radius = radius;
+                result.distribution = distribution;
+                result.rays = query == "overlaps" ? circles.size() : num_rays;
+
+                if (options.format == "text") print_text(result);
+                else if (options.format == "csv") print_csv(result);
+                else print_json(result, first);
+                std::fflush(stdout);
+                first = false;
+            }
+        }
+    };
+
+    if (!options.input.empty())
+    {
+        std::vector<Circle> circles;
+        ImportStats stats;
+        std::string error;
+        Clock::time_point start = Clock::now();
+        if (!import_circles(options.input, circles, alg.m_pool_ptr.get(), &stats, &error))
+        {
+            std::fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+        double seconds = seconds_since(start);
+        std::fprintf(stderr, "imported %zu circles, skipped %zu, in %.1f ms (%.1f MB/s)\n", stats.circles, 
+            stats.skipped, seconds * 1e3, seconds > 0.0 ? stats.bytes / seconds / 1e6 : 0.0);
+
+        BBox bounds = circles.empty() ? BBox() : BBox::empty();
+        double radius = 0.0;
+        for (const Circle& circle : circles)
+        {
+            bounds.extend(BBox::of(circle));
+            radius = std::max(radius, circle.radius);
+        }
+        Vector2d margin = (bounds.top_right - bounds.bottom_left) * 0.1;
+        alg.seed(options.seed);
+        run_all(circles, bounds, BBox(bounds.bottom_left - margin, bounds.top_right + margin), radius, "file");
+    }
+    else
+    {
+        for (std::size_t num_circles : options.circles)
+        for (double radius : options.radii)
+        for (const std::string& distribution : options.distributions)
+        {
+            std::vector<Circle> circles;
+            circles.reserve(num_circles);
+            alg.seed(options.seed);
+            std::mt19937 gen(options.seed);
+            if (distribution == "uniform") alg.generate_random_circles(circles, rect, radius, num_circles);
+            else if (distribution == "mixed") generate_mixed_circles(gen, circles, rect, radius, num_circles);
+            else generate_clustered_circles(gen, circles, rect, radius, num_circles);
+            run_all(circles, rect, viewer_rect, radius, distribution);
+        }
+    }
+
+    if (options.format == "json" && !options.verify) std::printf("\n]\n");
+    return mismatched ? 1 : 0;
+}
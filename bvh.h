@@ -0,0 +1,446 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "geometric.h"
+
+// bounding volume hierarchy
+// built top-down with a binned surface area heuristic; in 2D the chance of a
+// random line crossing a convex box is proportional to its perimeter, so the
+// cost of a split is the perimeter-weighted circle count of both halves.
+// nodes are stored in pre-order like the kd-tree, leaves reference buckets of
+// up to BVH::max_leaf_size circles.
+struct BVHNode
+{
+    BBox bbox;
+    std::uint32_t index; // inner node: right child, leaf: first circle
+    std::uint32_t count; // circle count of a leaf, zero for inner nodes
+
+    BVHNode() : bbox(), index(0), count(0) {}
+
+    bool is_leaf() const { return count != 0; }
+    std::uint32_t right() const { return index; }
+    std::uint32_t first() const { return index; }
+};
+
+class BVH : public SpatialIndex
+{
+public:
+    static constexpr std::size_t max_leaf_size = 16;
+    static constexpr int num_bins = 16;
+
+    // relative cost of stepping into a node and of testing one circle; the
+    // vector kernel tests several circles at once
+    static constexpr double traversal_cost = 1.0;
+    static constexpr double intersection_cost = 0.125;
+
+    // below this depth splits fall back to the object median, which bounds
+    // the height of the tree by 64
+    static constexpr std::size_t max_sah_depth = 32;
+
+private:
+    std::vector<BVHNode> m_nodes;
+    CircleBuckets m_circles;
+
+    struct BuildItem
+    {
+        BBox bbox;
+        Point center;
+        std::uint32_t id;
+    };
+
+    static double half_perimeter(const BBox &bbox)
+    {
+        return (bbox.top_right.x - bbox.bottom_left.x) + (bbox.top_right.y - bbox.bottom_left.y);
+    }
+
+    static double coordinate(const Point &point, int axis) { return axis == 0 ? point.x : point.y; }
+
+    // construct the subtree of items[first, last) at the end of m_nodes and
+    // return its number of node levels
+    std::size_t recursive_build(const std::vector<Circle>& circles, std::vector<BuildItem>& items, 
+        std::size_t first, std::size_t last, std::size_t depth, JobControl* control) 
+    {
+        if (control && control->cancelled()) return 0;
+        std::size_t node = m_nodes.size();
+        m_nodes.emplace_back();
+
+        BBox bbox = items[first].bbox;
+        BBox centers(items[first].center, items[first].center);
+        for (std::size_t i = first + 1; i < last; ++i)
+        {
+            bbox.extend(items[i].bbox);
+            centers.extend(BBox(items[i].center, items[i].center));
+        }
+        m_nodes[node].bbox = bbox;
+
+        std::size_t count = last - first;
+        int axis = (centers.top_right.x - centers.bottom_left.x) 
+            >= (centers.top_right.y - centers.bottom_left.y) ? 0 : 1;
+        double lo = coordinate(centers.bottom_left, axis);
+        double extent = coordinate(centers.top_right, axis) - lo;
+
+        std::size_t middle = first;
+        if (count > 1 && extent > 0.0 && depth < max_sah_depth)
+        {
+            // bin the centers and sweep the bin boundaries
+            std::size_t bin_count[num_bins] = {};
+            BBox bin_bbox[num_bins];
+            std::fill(bin_bbox, bin_bbox + num_bins, BBox::empty());
+            double scale = num_bins / extent;
+            for (std::size_t i = first; i < last; ++i)
+            {
+                int b = std::min(num_bins - 1, int((coordinate(items[i].center, axis) - lo) * scale));
+                bin_count[b]++;
+                bin_bbox[b].extend(items[i].bbox);
+            }
+
+            // cost of the bins right of each boundary
+            double right_cost[num_bins] = {};
+            BBox acc = BBox::empty();
+            std::size_t acc_count = 0;
+            for (int b = num_bins - 1; b > 0; --b)
+            {
+                acc.extend(bin_bbox[b]);
+                acc_count += bin_count[b];
+                right_cost[b] = acc_count ? half_perimeter(acc) * acc_count : 0.0;
+            }
+
+            int best_split = -1;
+            double best_cost = std::numeric_limits<double>::infinity();
+            acc = BBox::empty();
+            acc_count = 0;
+            for (int b = 0; b + 1 < num_bins; ++b)
+            {
+                acc.extend(bin_bbox[b]);
+                acc_count += bin_count[b];
+                if (acc_count == 0 || acc_count == count) continue;
+                double cost = half_perimeter(acc) * acc_count + right_cost[b + 1];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_split = b;
+                }
+            }
+
+            double split_cost = traversal_cost 
+                + intersection_cost * best_cost / std::max(half_perimeter(bbox), 1e-300);
+            double leaf_cost = intersection_cost * count;
+            if (count <= max_leaf_size && leaf_cost <= split_cost) best_split = -1;
+
+            if (best_split >= 0)
+            {
+                auto it = std::partition(items.begin() + first, items.begin() + last, 
+                    [&](const BuildItem& item) {
+                    int b = std::min(num_bins - 1, int((coordinate(item.center, axis) - lo) * scale));
+                    return b <= best_split;
+                    });
+                middle = it - items.begin();
+            }
+        }
+
+        if (middle == first && count > max_leaf_size)
+        {
+            // no useful split: object median along the axis
+            middle = first + count / 2;
+            std::nth_element(items.begin() + first, items.begin() + middle, items.begin() + last, 
+                [axis](const BuildItem& a, const BuildItem& b) {
+                double ca = coordinate(a.center, axis), cb = coordinate(b.center, axis);
+                if (ca != cb) return ca < cb;
+                return a.id < b.id;}
+                );
+        }
+
+        if (middle == first)
+        {
+            for (std::size_t i = first; i < last; ++i)
+                m_circles.set(i, circles[items[i].id], items[i].id);
+            m_nodes[node].index = static_cast<std::uint32_t>(first);
+            m_nodes[node].count = static_cast<std::uint32_t>(count);
+            if (control) control->advance(count);
+            return 1;
+        }
+
+        std::size_t left_depth = recursive_build(circles, items, first, middle, depth + 1, control);
+        m_nodes[node].index = static_cast<std::uint32_t>(m_nodes.size());
+        std::size_t right_depth = recursive_build(circles, items, middle, last, depth + 1, control);
+        return 1 + std::max(left_depth, right_depth);
+    }
+
+public:
+    BVH() {}
+
+    const char* name() const override { return "bvh"; }
+
+    void clear() override
+    {
+        m_nodes.clear();
+        m_circles.clear();
+    }
+
+    std::size_t size() const override { return m_circles.size(); }
+    std::size_t node_count() const { return m_nodes.size(); }
+
+    std::size_t memory_bytes() const override
+    {
+        return m_nodes.capacity() * sizeof(BVHNode) + m_circles.memory_bytes();
+    }
+
+    // the build is serial
+    BuildInfo build(const std::vector<Circle>& circles, BBox, ThreadPool* = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        if (circles.empty()) return BuildInfo();
+
+        BuildInfo info;
+        PhaseTimer timer(info.phases);
+
+        std::size_t n = circles.size();
+        m_circles.resize(n);
+        m_nodes.reserve(n / 2 + 1);
+
+        std::vector<BuildItem> items(n);
+        for (std::size_t i = 0; i < n; ++i)
+            items[i] = BuildItem{BBox::of(circles[i]), circles[i].center, static_cast<std::uint32_t>(i)};
+
+        timer.lap("items");
+
+        info.depth = recursive_build(circles, items, 0, n, 0, control);
+        if (control && control->cancelled())
+        {
+            clear();
+            return BuildInfo();
+        }
+        m_nodes.shrink_to_fit();
+        timer.lap("sah");
+
+        info.nodes = m_nodes.size();
+        return info;
+    }
+
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const 
+    {
+        std::size_t visited = 0;
+        if (m_nodes.empty()) return visited;
+
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+
+        while (true)
+        {
+            const BVHNode& n = m_nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            double tnear, tfar;
+            if (ray_bbox_interval(range, n.bbox, range.tmin, range.tmax, tnear, tfar)) 
+            {
+                if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    INTERSECTION_STAT(thread_query_stats().push(top));
+                    node = node + 1;
+                    continue;
+                }
+
+                std::uint32_t mask = m_circles.intersect(range, n.first(), n.count);
+                while (mask)
+                {
+                    int i = lowest_bit(mask);
+                    mask &= mask - 1;
+                    if (!call_on_hit(on_hit, n.first() + i)) return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+
+        return visited;
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { results.push_back(m_circles.circle(index)); });
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { ids.push_back(m_circles.ids[index]); });
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { return visitor.on_hit(m_circles.ids[index]); });
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        std::size_t visited = 0;
+        if (m_nodes.empty()) return visited;
+
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+
+        while (true)
+        {
+            const BVHNode& n = m_nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (n.bbox.overlaps(window))
+            {
+                if (n.bbox.width() < detail && n.bbox.height() < detail)
+                {
+                    // the leaves of a subtree are consecutive in leaf order
+                    std::uint32_t left = node, right = node;
+                    while (!m_nodes[left].is_leaf()) left = left + 1;
+                    while (!m_nodes[right].is_leaf()) right = m_nodes[right].right();
+                    std::size_t count = m_nodes[right].first() + m_nodes[right].count - m_nodes[left].first();
+                    if (!visitor.on_cluster(n.bbox, count)) return visited;
+                }
+                else if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    node = node + 1;
+                    continue;
+                }
+                else
+                {
+                    for (std::uint32_t i = n.first(); i < n.first() + n.count; ++i)
+                    {
+                        if (window.overlaps_circle(m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]) 
+                            && !visitor.on_circle(m_circles.ids[i])) 
+                            return visited;
+                    }
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+        return visited;
+    }
+
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        std::size_t visited = 0;
+        if (m_nodes.empty()) return visited;
+
+        RayRange range(segment);
+        Capsule capsule(segment, margin);
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        double tnear, tfar;
+
+        while (true)
+        {
+            const BVHNode& n = m_nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (ray_bbox_interval(range, n.bbox.expanded(margin), range.tmin, range.tmax, tnear, tfar))
+            {
+                if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    node = node + 1;
+                    continue;
+                }
+                for (std::uint32_t i = n.first(); i < n.first() + n.count; ++i)
+                {
+                    if (capsule.reaches(m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]) 
+                        && !visitor.on_circle(m_circles.ids[i], m_circles.cx[i], m_circles.cy[i], m_circles.radius[i])) 
+                        return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+        return visited;
+    }
+
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        if (m_nodes.empty()) return 0;
+        return best_first_search(point, 0, m_nodes[0].bbox, heap, [&](std::uint32_t node, const BBox &, auto &&push) {
+            const BVHNode& n = m_nodes[node];
+            if (n.is_leaf())
+            {
+                for (std::uint32_t i = n.first(); i < n.first() + n.count; ++i)
+                    heap.offer_circle(m_circles.ids[i], point, m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]);
+                return;
+            }
+            push(node + 1, m_nodes[node + 1].bbox);
+            push(n.right(), m_nodes[n.right()].bbox);
+        });
+    }
+
+    // closest hit; children are ordered by the parameter at which the ray
+    // enters their boxes
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        const Ray& ray = range.ray;
+        hit = RayHit();
+        std::size_t visited = 0;
+        if (m_nodes.empty()) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            double tnear;
+        };
+        Entry stack[64];
+        int top = 0;
+
+        double best = range.tmax;
+        double tnear, tfar;
+        if (!ray_bbox_interval(range, m_nodes[0].bbox, range.tmin, best, tnear, tfar)) 
+            return visited;
+        stack[top++] = Entry{0, tnear};
+
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.tnear > best) continue;
+
+            const BVHNode& n = m_nodes[entry.node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (n.is_leaf())
+            {
+                m_circles.closest_in_leaf(range, n.first(), n.count, best, hit);
+                continue;
+            }
+
+            Entry left{entry.node + 1, 0.0}, right{n.right(), 0.0};
+            bool left_hit = ray_bbox_interval(range, m_nodes[left.node].bbox, range.tmin, best, left.tnear, tfar);
+            bool right_hit = ray_bbox_interval(range, m_nodes[right.node].bbox, range.tmin, best, right.tnear, tfar);
+            if (left_hit && right_hit)
+            {
+                if (left.tnear < right.tnear) std::swap(left, right);
+                stack[top++] = left;
+                stack[top++] = right;
+            }
+            else if (left_hit) stack[top++] = left;
+            else if (right_hit) stack[top++] = right;
+            INTERSECTION_STAT(thread_query_stats().push(top));
+        }
+
+        if (hit.valid())
+        {
+            hit.t = best;
+            hit.point = ray.origin + ray.direction * best;
+        }
+        return visited;
+    }
+};
+
+#endif
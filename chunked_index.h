@@ -0,0 +1,225 @@
+#ifndef CHUNKED_INDEX_H
+#define CHUNKED_INDEX_H
+
+#include <functional>
+
+#include "geometric.h"
+
+// static index over consecutive chunks of circles, one sub-index each
+// a set too large to index at once is indexed a chunk at a time, and a chunk
+// can be dropped from memory once its sub-index is built. the sub-indexes
+// are queried one after the other; ids are offset by the first id of the chunk.
+class ChunkedIndex : public SpatialIndex
+{
+public:
+    typedef std::function<std::unique_ptr<SpatialIndex>()> Factory;
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<SpatialIndex> index;
+        std::uint32_t first; // id of the first circle
+    };
+
+    Factory m_factory;
+    std::size_t m_chunk_size;
+    std::vector<Chunk> m_chunks;
+    std::size_t m_size = 0;
+
+public:
+    ChunkedIndex(Factory factory, std::size_t chunk_size) 
+        : m_factory(factory), m_chunk_size(std::max<std::size_t>(1, chunk_size)) {}
+
+    const char* name() const override { return "chunked"; }
+
+    void clear() override
+    {
+        m_chunks.clear();
+        m_size = 0;
+    }
+
+    std::size_t size() const override { return m_size; }
+    std::size_t chunk_count() const { return m_chunks.size(); }
+    std::size_t chunk_size() const { return m_chunk_size; }
+
+    std::size_t memory_bytes() const override
+    {
+        std::size_t bytes = m_chunks.capacity() * sizeof(Chunk);
+        for (const Chunk& chunk : m_chunks) bytes += chunk.index->memory_bytes();
+        return bytes;
+    }
+
+    // indexes the next circles, which get the ids size() to size() + n - 1.
+    // the index need not come from the factory, e.g. a mapped snapshot.
+    BuildInfo append(std::unique_ptr<SpatialIndex> index, std::size_t n)
+    {
+        m_chunks.push_back(Chunk{std::move(index), static_cast<std::uint32_t>(m_size)});
+        m_size += n;
+        return BuildInfo();
+    }
+
+    BuildInfo append(const std::vector<Circle>& circles, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr)
+    {
+        std::unique_ptr<SpatialIndex> index = m_factory();
+        BuildInfo info = index->build(circles, BBox(), pool, control);
+        m_chunks.push_back(Chunk{std::move(index), static_cast<std::uint32_t>(m_size)});
+        m_size += circles.size();
+        return info;
+    }
+
+    // the circles are split into chunks of chunk_size(); nodes add up over
+    // the chunks and depth is that of the deepest
+    BuildInfo build(const std::vector<Circle>& circles, BBox, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        BuildInfo info;
+        std::vector<Circle> chunk;
+        for (std::size_t first = 0; first < circles.size(); first += m_chunk_size)
+        {
+            std::size_t last = std::min(circles.size(), first + m_chunk_size);
+            chunk.assign(circles.begin() + first, circles.begin() + last);
+            BuildInfo chunk_info = append(chunk, pool, control);
+            if (control && control->cancelled())
+            {
+                clear();
+                return BuildInfo();
+            }
+            info.nodes += chunk_info.nodes;
+            info.depth = std::max(info.depth, chunk_info.depth);
+            info.phases.insert(info.phases.end(), chunk_info.phases.begin(), chunk_info.phases.end());
+        }
+        return info;
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        std::size_t visited = 0;
+        for (const Chunk& chunk : m_chunks) visited += chunk.index->detect_intersection(range, results);
+        return visited;
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        std::size_t visited = 0;
+        for (const Chunk& chunk : m_chunks)
+        {
+            std::size_t before = ids.size();
+            visited += chunk.index->detect_intersection(range, ids);
+            for (std::size_t i = before; i < ids.size(); ++i) ids[i] += chunk.first;
+        }
+        return visited;
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        std::size_t visited = 0;
+        bool stopped = false;
+        for (const Chunk& chunk : m_chunks)
+        {
+            visited += chunk.index->for_each_intersection(range, [&](std::uint32_t id) {
+                stopped = !visitor.on_hit(id + chunk.first);
+                return !stopped;
+            });
+            if (stopped) break;
+        }
+        return visited;
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        // offsets the ids of a chunk
+        struct ChunkVisitor : WindowVisitor
+        {
+            std::uint32_t first;
+            WindowVisitor &visitor;
+            bool stopped = false;
+            ChunkVisitor(std::uint32_t first, WindowVisitor &visitor) : first(first), visitor(visitor) {}
+            bool on_circle(std::uint32_t id) override 
+            { 
+                stopped = !visitor.on_circle(first + id);
+                return !stopped;
+            }
+            bool on_cluster(const BBox &box, std::size_t count) override 
+            { 
+                stopped = !visitor.on_cluster(box, count);
+                return !stopped;
+            }
+        };
+
+        std::size_t visited = 0;
+        for (const Chunk& chunk : m_chunks)
+        {
+            ChunkVisitor chunk_visitor(chunk.first, visitor);
+            visited += chunk.index->query_window(window, chunk_visitor, detail);
+            if (chunk_visitor.stopped) break;
+        }
+        return visited;
+    }
+
+    // the chunk indexes traverse circles of their own
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        // offsets the ids of a chunk
+        struct ChunkVisitor : CircleVisitor
+        {
+            std::uint32_t first;
+            CircleVisitor &visitor;
+            bool stopped = false;
+            ChunkVisitor(std::uint32_t first, CircleVisitor &visitor) : first(first), visitor(visitor) {}
+            bool on_circle(std::uint32_t id, double cx, double cy, double radius) override 
+            { 
+                stopped = !visitor.on_circle(first + id, cx, cy, radius);
+                return !stopped;
+            }
+        };
+
+        std::size_t visited = 0;
+        const std::vector<Circle> none;
+        for (const Chunk& chunk : m_chunks)
+        {
+            ChunkVisitor chunk_visitor(chunk.first, visitor);
+            visited += chunk.index->query_capsule(segment, margin, none, chunk_visitor);
+            if (chunk_visitor.stopped) break;
+        }
+        return visited;
+    }
+
+    // each chunk is searched within the bound left by the chunks before it
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        std::size_t visited = 0;
+        std::vector<Neighbor> found;
+        for (const Chunk& chunk : m_chunks)
+        {
+            NeighborHeap chunk_heap(heap.k(), heap.bound());
+            visited += chunk.index->search_nearest(point, chunk_heap);
+            chunk_heap.take(found);
+            for (const Neighbor& neighbor : found) heap.offer(neighbor.id + chunk.first, neighbor.distance);
+        }
+        return visited;
+    }
+
+    // each chunk is searched up to the best hit of the chunks before it
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        hit = RayHit();
+        std::size_t visited = 0;
+        for (const Chunk& chunk : m_chunks)
+        {
+            RayHit chunk_hit;
+            visited += chunk.index->closest_hit(RayRange(range.ray, range.tmin, hit.valid() ? hit.t : range.tmax), 
+                chunk_hit);
+            if (chunk_hit.valid() && (!hit.valid() || chunk_hit.t < hit.t))
+            {
+                hit = chunk_hit;
+                hit.id += chunk.first;
+            }
+        }
+        return visited;
+    }
+};
+
+#endif
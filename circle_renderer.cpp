@@ -0,0 +1,266 @@
+#include <cmath>
+#include <algorithm>
+
+#include <QOpenGLContext>
+
+#include "circle_renderer.h"
+
+namespace
+{
+	const char* vertex_shader =
+		"#version 120\n"
+		"attribute vec2 unit;\n"
+		"attribute vec4 instance;\n" // center x, y, radius, hit
+		"uniform vec3 boundary_color;\n"
+		"uniform vec3 hit_color;\n"
+		"varying vec3 color;\n"
+		"void main()\n"
+		"{\n"
+		"	vec2 p = instance.xy + instance.z * unit;\n"
+		"	gl_Position = gl_ModelViewProjectionMatrix * vec4(p, 0.0, 1.0);\n"
+		"	color = mix(boundary_color, hit_color, instance.w);\n"
+		"}\n";
+
+	const char* fragment_shader =
+		"#version 120\n"
+		"varying vec3 color;\n"
+		"void main()\n"
+		"{\n"
+		"	gl_FragColor = vec4(color, 1.0);\n"
+		"}\n";
+
+	const int unit_location = 0;
+	const int instance_location = 1;
+}
+
+CircleRenderer::CircleRenderer()
+	: m_initialized(false), m_instanced(false), 
+	m_draw_arrays_instanced(nullptr), m_vertex_attrib_divisor(nullptr),
+	m_unit_buffer(QOpenGLBuffer::VertexBuffer), m_instance_buffer(QOpenGLBuffer::VertexBuffer),
+	m_num_hits(0), m_version(~std::uint64_t(0))
+{
+	set_colors(0.1f, 0.0f, 0.0f, 0.1f, 0.0f, 0.0f);
+
+	// the center, then the ring with its first point repeated to close it
+	m_unit.push_back(0.0f);
+	m_unit.push_back(0.0f);
+	for (int i = 0; i <= num_segments; ++i)
+	{
+		double angle = 2.0 * M_PI * (i % num_segments) / num_segments;
+		m_unit.push_back(float(std::cos(angle)));
+		m_unit.push_back(float(std::sin(angle)));
+	}
+}
+
+void CircleRenderer::set_colors(float boundary_r, float boundary_g, float boundary_b, 
+	float hit_r, float hit_g, float hit_b)
+{
+	m_boundary_color[0] = boundary_r;
+	m_boundary_color[1] = boundary_g;
+	m_boundary_color[2] = boundary_b;
+	m_hit_color[0] = hit_r;
+	m_hit_color[1] = hit_g;
+	m_hit_color[2] = hit_b;
+}
+
+void CircleRenderer::initialize()
+{
+	m_initialized = true;
+	QOpenGLContext* context = QOpenGLContext::currentContext();
+	if (!context)
+		return;
+
+	// instanced arrays are core in 3.3; earlier contexts, like llvmpipe in a
+	// compatibility profile, may have them as ARB extensions
+	bool core = context->format().version() >= qMakePair(3, 3);
+	bool extensions = context->hasExtension("GL_ARB_instanced_arrays") 
+		&& context->hasExtension("GL_ARB_draw_instanced");
+	if (!core && !extensions)
+		return;
+
+	m_draw_arrays_instanced = reinterpret_cast<DrawArraysInstanced>(
+		context->getProcAddress(core ? "glDrawArraysInstanced" : "glDrawArraysInstancedARB"));
+	m_vertex_attrib_divisor = reinterpret_cast<VertexAttribDivisor>(
+		context->getProcAddress(core ? "glVertexAttribDivisor" : "glVertexAttribDivisorARB"));
+	if (!m_draw_arrays_instanced || !m_vertex_attrib_divisor)
+		return;
+
+	if (!m_program.addShaderFromSourceCode(QOpenGLShader::Vertex, vertex_shader)
+		|| !m_program.addShaderFromSourceCode(QOpenGLShader::Fragment, fragment_shader))
+		return;
+	m_program.bindAttributeLocation("unit", unit_location);
+	m_program.bindAttributeLocation("instance", instance_location);
+	if (!m_program.link())
+		return;
+
+	if (!m_unit_buffer.create() || !m_instance_buffer.create())
+		return;
+	m_unit_buffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
+	m_unit_buffer.bind();
+	m_unit_buffer.allocate(m_unit.data(), int(m_unit.size() * sizeof(float)));
+	m_unit_buffer.release();
+	m_instance_buffer.setUsagePattern(QOpenGLBuffer::DynamicDraw);
+
+	m_instanced = true;
+}
+
+void CircleRenderer::update(const std::vector<Circle>& circles, const std::vector<std::uint32_t>* ids,
+	const std::vector<std::uint32_t>& hit_ids, std::uint64_t version)
+{
+	if (!m_initialized)
+		initialize();
+	if (version == m_version)
+		return;
+	m_version = version;
+
+	// hits first, then the others in their order
+	if (m_hit.size() < circles.size())
+		m_hit.resize(circles.size(), 0);
+	for (std::uint32_t id : hit_ids)
+	{
+		if (id < circles.size())
+			m_hit[id] = 1;
+	}
+
+	m_instances.clear();
+	m_others.clear();
+	std::size_t count = ids ? ids->size() : circles.size();
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		std::uint32_t id = ids ? (*ids)[i] : std::uint32_t(i);
+		const Circle& circle = circles[id];
+		if (m_hit[id])
+			m_instances.push_back(Instance{float(circle.center.x), float(circle.center.y), float(circle.radius), 1.0f});
+		else
+			m_others.push_back(Instance{float(circle.center.x), float(circle.center.y), float(circle.radius), 0.0f});
+	}
+	m_num_hits = m_instances.size();
+	m_instances.insert(m_instances.end(), m_others.begin(), m_others.end());
+
+	for (std::uint32_t id : hit_ids)
+	{
+		if (id < circles.size())
+			m_hit[id] = 0;
+	}
+
+	if (!m_instanced)
+		return;
+	m_instance_buffer.bind();
+	m_instance_buffer.allocate(m_instances.data(), int(m_instances.size() * sizeof(Instance)));
+	m_instance_buffer.release();
+}
+
+void CircleRenderer::render_boundaries()
+{
+	draw(GL_LINE_STRIP, 1, num_segments + 1, m_instances.size());
+}
+
+void CircleRenderer::render_hits()
+{
+	draw(GL_TRIANGLE_FAN, 0, num_segments + 2, m_num_hits);
+}
+
+void CircleRenderer::render_outlines(const std::vector<Circle>& circles, const std::vector<std::uint32_t>& ids,
+	float r, float g, float b, float width)
+{
+	if (ids.empty())
+		return;
+	if (!m_initialized)
+		initialize();
+
+	GLfloat line_width = 1.0f;
+	glGetFloatv(GL_LINE_WIDTH, &line_width);
+	glColor3f(r, g, b);
+	glLineWidth(width);
+	for (std::uint32_t id : ids)
+	{
+		if (id >= circles.size())
+			continue;
+		const Circle& circle = circles[id];
+		glBegin(GL_LINE_STRIP);
+		for (int k = 1; k < num_segments + 2; ++k)
+		{
+			glVertex2f(float(circle.center.x + circle.radius * m_unit[2 * k]), 
+				float(circle.center.y + circle.radius * m_unit[2 * k + 1]));
+		}
+		glEnd();
+	}
+	glLineWidth(line_width);
+}
+
+void CircleRenderer::draw(GLenum mode, int first_vertex, int num_vertices, std::size_t num_instances)
+{
+	if (!num_instances)
+		return;
+	if (!m_instanced)
+	{
+		draw_immediate(mode, first_vertex, num_vertices, num_instances);
+		return;
+	}
+
+	m_program.bind();
+	m_program.setUniformValue("boundary_color", m_boundary_color[0], m_boundary_color[1], m_boundary_color[2]);
+	m_program.setUniformValue("hit_color", m_hit_color[0], m_hit_color[1], m_hit_color[2]);
+
+	m_unit_buffer.bind();
+	m_program.enableAttributeArray(unit_location);
+	m_program.setAttributeBuffer(unit_location, GL_FLOAT, 0, 2);
+
+	m_instance_buffer.bind();
+	m_program.enableAttributeArray(instance_location);
+	m_program.setAttributeBuffer(instance_location, GL_FLOAT, 0, 4, sizeof(Instance));
+	m_vertex_attrib_divisor(instance_location, 1);
+
+	m_draw_arrays_instanced(mode, first_vertex, num_vertices, GLsizei(num_instances));
+
+	// leave the state as the immediate mode drawing of the scene expects it
+	m_vertex_attrib_divisor(instance_location, 0);
+	m_program.disableAttributeArray(instance_location);
+	m_program.disableAttributeArray(unit_location);
+	m_instance_buffer.release();
+	m_program.release();
+}
+
+void CircleRenderer::render_points(const std::vector<float>& points)
+{
+	if (points.empty())
+		return;
+	glColor3f(m_boundary_color[0], m_boundary_color[1], m_boundary_color[2]);
+	glPointSize(1.0f);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, points.data());
+	glDrawArrays(GL_POINTS, 0, GLsizei(points.size() / 2));
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+void CircleRenderer::render_boxes(const std::vector<float>& corners, const std::vector<float>& colors)
+{
+	if (corners.empty())
+		return;
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(2, GL_FLOAT, 0, corners.data());
+	glColorPointer(4, GL_FLOAT, 0, colors.data());
+	glDrawArrays(GL_QUADS, 0, GLsizei(corners.size() / 2));
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// without instancing: the same geometry from the unit circle table, so at
+// least no sine or cosine is evaluated per frame
+void CircleRenderer::draw_immediate(GLenum mode, int first_vertex, int num_vertices, std::size_t num_instances)
+{
+	for (std::size_t i = 0; i < num_instances; ++i)
+	{
+		const Instance& instance = m_instances[i];
+		const float* color = instance.hit > 0.5f ? m_hit_color : m_boundary_color;
+		glColor3f(color[0], color[1], color[2]);
+		glBegin(mode);
+		for (int k = first_vertex; k < first_vertex + num_vertices; ++k)
+		{
+			glVertex2f(instance.x + instance.radius * m_unit[2 * k], 
+				instance.y + instance.radius * m_unit[2 * k + 1]);
+		}
+		glEnd();
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef _CIRCLE_RENDERER_
+#define _CIRCLE_RENDERER_
+
+// std
+#include <vector>
+#include <cstdint>
+// Qt
+#include <QOpenGLBuffer>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+
+#include "geometric.h"
+
+
+// retained-mode drawing of the circles. a unit circle is kept in one vertex
+// buffer and every circle is an instance of it: center, radius and hit flag
+// in a second buffer, uploaded again only when the drawn circles or the hits
+// change.
+// the hit circles come first in the instance buffer, so the filled pass draws
+// a prefix of it. needs GLSL 1.20 and instanced arrays (GL 3.3 or
+// ARB_instanced_arrays with ARB_draw_instanced), which Mesa's llvmpipe has;
+// without them the circles are drawn in immediate mode from the unit circle table.
+// all calls need the GL context of the viewer to be current.
+class CircleRenderer
+{
+public:
+    static const int num_segments = 64;
+
+private:
+    struct Instance
+    {
+        float x, y, radius, hit;
+    };
+
+    typedef void (QOPENGLF_APIENTRY *DrawArraysInstanced)(GLenum mode, GLint first, GLsizei count, GLsizei instances);
+    typedef void (QOPENGLF_APIENTRY *VertexAttribDivisor)(GLuint index, GLuint divisor);
+
+    bool m_initialized;
+    bool m_instanced; // false: immediate mode fallback
+    DrawArraysInstanced m_draw_arrays_instanced;
+    VertexAttribDivisor m_vertex_attrib_divisor;
+
+    QOpenGLShaderProgram m_program;
+    QOpenGLBuffer m_unit_buffer;     // center, then the ring closed on itself
+    QOpenGLBuffer m_instance_buffer;
+    std::vector<float> m_unit;       // x, y pairs, as in m_unit_buffer
+    std::vector<Instance> m_instances;
+    std::vector<Instance> m_others;  // scratch: the circles not hit
+    std::vector<std::uint8_t> m_hit; // scratch: by circle, cleared after use
+    std::size_t m_num_hits;
+    float m_boundary_color[3], m_hit_color[3];
+
+    std::uint64_t m_version; // of the data in the instance buffer
+
+public:
+    CircleRenderer();
+
+    // refills the instance buffer from the circles with the given ids, or from
+    // all circles when ids is null, if version differs from the last call
+    void update(const std::vector<Circle>& circles, const std::vector<std::uint32_t>* ids,
+        const std::vector<std::uint32_t>& hit_ids, std::uint64_t version);
+
+    // the boundaries of the hit circles are drawn in the hit color
+    void set_colors(float boundary_r, float boundary_g, float boundary_b, 
+        float hit_r, float hit_g, float hit_b);
+
+    void render_boundaries();
+    void render_hits(); // filled
+
+    // outlines of a few circles in a color of their own, e.g. the ones under
+    // the mouse; drawn in immediate mode from the unit circle table
+    void render_outlines(const std::vector<Circle>& circles, const std::vector<std::uint32_t>& ids,
+        float r, float g, float b, float width);
+
+    // from client memory: points as x, y pairs in the boundary color, and
+    // boxes as quads of four x, y corners with an RGBA color per corner
+    void render_points(const std::vector<float>& points);
+    void render_boxes(const std::vector<float>& corners, const std::vector<float>& colors);
+
+private:
+    void initialize();
+    void draw(GLenum mode, int first_vertex, int num_vertices, std::size_t num_instances);
+    void draw_immediate(GLenum mode, int first_vertex, int num_vertices, std::size_t num_instances);
+};
+
+#endif // _CIRCLE_RENDERER_
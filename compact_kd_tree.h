@@ -0,0 +1,474 @@
+#ifndef COMPACT_KD_TREE_H
+#define COMPACT_KD_TREE_H
+
+#include "kd_tree.h"
+
+// compact kd-tree
+// the kd-tree in about a third of the memory. the nodes keep the pre-order
+// layout, but each box is stored as 8-bit offsets into the box of its parent,
+// rounded outwards, so a decoded box always contains the exact one and no hit
+// is lost. boxes are decoded on the way down. the circles are stored as
+// float32, the radius rounded up to cover the rounding of the center, so a
+// float circle contains the exact one; a ray that passes within float
+// precision of a circle may report it as a hit. when all circles have the
+// same radius, it is stored once: the largest of the rounded-up radii.
+class CompactKDTree : public SpatialIndex
+{
+public:
+    static constexpr std::size_t max_leaf_size = KDTree::max_leaf_size;
+    static constexpr int steps = 255;
+
+private:
+    BBox m_bounds;
+    // nodes, structure of arrays in pre-order
+    std::vector<std::uint8_t> m_boxes;   // 4 per node: x0, y0, x1, y1
+    std::vector<std::uint32_t> m_index;  // inner node: right child, leaf: first circle
+    std::vector<std::uint8_t> m_count;   // circles of a leaf, 0 for an inner node
+    // circles in leaf order
+    std::vector<float> m_cx, m_cy, m_radius; // m_radius is empty when shared
+    std::vector<std::uint32_t> m_ids;
+    float m_shared_radius = 0.0f;
+
+    RayCircleKernel m_kernel = ray_circle_kernel();
+
+    // coordinate of step q of [lo, hi]; the last step is hi itself, so the
+    // decoded boxes stay inside the parent
+    static double decode(double lo, double hi, int q)
+    {
+        return q == steps ? hi : lo + (hi - lo) * q / steps;
+    }
+
+    // the largest step at or below value, and the smallest at or above
+    static std::uint8_t encode_down(double lo, double hi, double value)
+    {
+        int q = hi > lo ? static_cast<int>(std::floor((value - lo) / (hi - lo) * steps)) : 0;
+        q = std::min(std::max(q, 0), steps);
+        while (q > 0 && decode(lo, hi, q) > value) --q;
+        return static_cast<std::uint8_t>(q);
+    }
+
+    static std::uint8_t encode_up(double lo, double hi, double value)
+    {
+        int q = hi > lo ? static_cast<int>(std::ceil((value - lo) / (hi - lo) * steps)) : steps;
+        q = std::min(std::max(q, 0), steps);
+        while (q < steps && decode(lo, hi, q) < value) ++q;
+        return static_cast<std::uint8_t>(q);
+    }
+
+    BBox decode_box(std::uint32_t node, const BBox &parent) const
+    {
+        const std::uint8_t* q = &m_boxes[4 * std::size_t(node)];
+        return BBox(
+            Point(decode(parent.bottom_left.x, parent.top_right.x, q[0]), 
+                decode(parent.bottom_left.y, parent.top_right.y, q[1])),
+            Point(decode(parent.bottom_left.x, parent.top_right.x, q[2]), 
+                decode(parent.bottom_left.y, parent.top_right.y, q[3])));
+    }
+
+    // quantizes the subtree of the exact tree at node inside the decoded
+    // parent box
+    void encode_subtree(const std::vector<KDNode> &nodes, std::uint32_t node, const BBox &parent)
+    {
+        const KDNode& n = nodes[node];
+        std::uint8_t* q = &m_boxes[4 * std::size_t(node)];
+        q[0] = encode_down(parent.bottom_left.x, parent.top_right.x, n.bbox.bottom_left.x);
+        q[1] = encode_down(parent.bottom_left.y, parent.top_right.y, n.bbox.bottom_left.y);
+        q[2] = encode_up(parent.bottom_left.x, parent.top_right.x, n.bbox.top_right.x);
+        q[3] = encode_up(parent.bottom_left.y, parent.top_right.y, n.bbox.top_right.y);
+        m_index[node] = n.index;
+        m_count[node] = static_cast<std::uint8_t>(n.count());
+        if (n.is_leaf()) return;
+
+        BBox box = decode_box(node, parent);
+        encode_subtree(nodes, node + 1, box);
+        encode_subtree(nodes, n.right(), box);
+    }
+
+    // the circles of a leaf as padded doubles for the kernels
+    struct Leaf
+    {
+        double cx[max_leaf_size + 3], cy[max_leaf_size + 3], r2[max_leaf_size + 3];
+    };
+
+    void load_leaf(std::uint32_t first, std::uint32_t count, Leaf &leaf) const
+    {
+        for (std::uint32_t i = 0; i < count; ++i)
+        {
+            leaf.cx[i] = m_cx[first + i];
+            leaf.cy[i] = m_cy[first + i];
+            double r = radius(first + i);
+            leaf.r2[i] = r * r;
+        }
+        for (std::uint32_t i = count; i < count + 3; ++i)
+        {
+            leaf.cx[i] = leaf.cy[i] = 0.0;
+            leaf.r2[i] = -1.0;
+        }
+    }
+
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const 
+    {
+        std::size_t visited = 0;
+        if (m_index.empty()) return visited;
+
+        // pending right children with the box of their parent
+        struct Entry
+        {
+            std::uint32_t node;
+            BBox parent;
+        };
+        Entry stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        BBox parent = m_bounds;
+        Leaf leaf;
+
+        while (true)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            BBox box = decode_box(node, parent);
+            double tnear, tfar;
+            if (ray_bbox_interval(range, box, range.tmin, range.tmax, tnear, tfar)) 
+            {
+                std::uint32_t count = m_count[node];
+                if (!count)
+                {
+                    stack[top++] = Entry{m_index[node], box};
+                    INTERSECTION_STAT(thread_query_stats().push(top));
+                    node = node + 1;
+                    parent = box;
+                    continue;
+                }
+
+                std::uint32_t first = m_index[node];
+                load_leaf(first, count, leaf);
+                std::uint32_t mask = CircleBuckets::intersect(m_kernel, leaf.cx, leaf.cy, leaf.r2, count, range);
+                while (mask)
+                {
+                    int i = lowest_bit(mask);
+                    mask &= mask - 1;
+                    if (!call_on_hit(on_hit, first + i)) return visited;
+                }
+            }
+
+            if (top == 0) break;
+            --top;
+            node = stack[top].node;
+            parent = stack[top].parent;
+        }
+
+        return visited;
+    }
+
+public:
+    CompactKDTree() {}
+
+    const char* name() const override { return "compact kd-tree"; }
+
+    void clear() override
+    {
+        m_bounds = BBox();
+        m_boxes.clear();
+        m_index.clear();
+        m_count.clear();
+        m_cx.clear();
+        m_cy.clear();
+        m_radius.clear();
+        m_ids.clear();
+        m_shared_radius = 0.0f;
+    }
+
+    std::size_t size() const override { return m_ids.size(); }
+    std::size_t node_count() const { return m_index.size(); }
+
+    std::size_t memory_bytes() const override
+    {
+        return m_boxes.capacity() + m_count.capacity() 
+            + (m_index.capacity() + m_ids.capacity()) * sizeof(std::uint32_t)
+            + (m_cx.capacity() + m_cy.capacity() + m_radius.capacity()) * sizeof(float);
+    }
+
+    // builds the exact kd-tree, on the pool when one is given, and compresses it
+    BuildInfo build(const std::vector<Circle>& circles, BBox bbox, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        if (circles.empty()) return BuildInfo();
+
+        KDTree tree;
+        BuildInfo info = tree.build(circles, bbox, pool, control);
+        if (control && control->cancelled()) return BuildInfo();
+        PhaseTimer timer(info.phases);
+
+        const std::vector<KDNode>& nodes = tree.nodes();
+        const CircleBuckets& buckets = tree.buckets();
+        std::size_t n = buckets.size();
+
+        m_bounds = tree.bounds();
+        m_boxes.resize(4 * nodes.size());
+        m_index.resize(nodes.size());
+        m_count.resize(nodes.size());
+        encode_subtree(nodes, 0, m_bounds);
+
+        bool shared = std::all_of(buckets.radius.begin(), buckets.radius.begin() + n, 
+            [&](double r) { return r == buckets.radius[0]; });
+        m_cx.resize(n);
+        m_cy.resize(n);
+        m_radius.resize(shared ? 0 : n);
+        m_ids.assign(buckets.ids.begin(), buckets.ids.end());
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            float x = static_cast<float>(buckets.cx[i]);
+            float y = static_cast<float>(buckets.cy[i]);
+            double error = std::sqrt((x - buckets.cx[i]) * (x - buckets.cx[i]) 
+                + (y - buckets.cy[i]) * (y - buckets.cy[i]));
+            double radius = buckets.radius[i] + error;
+            float r = static_cast<float>(radius);
+            if (r < radius) r = std::nextafter(r, std::numeric_limits<float>::infinity());
+            m_cx[i] = x;
+            m_cy[i] = y;
+            if (shared) m_shared_radius = std::max(m_shared_radius, r);
+            else m_radius[i] = r;
+        }
+        timer.lap("compress");
+
+        return info;
+    }
+
+    float radius(std::uint32_t index) const 
+    { 
+        return m_radius.empty() ? m_shared_radius : m_radius[index]; 
+    }
+
+    // the float circle stored at a position of the leaf order
+    Circle circle(std::uint32_t index) const 
+    { 
+        return Circle(Point(m_cx[index], m_cy[index]), radius(index)); 
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { results.push_back(circle(index)); });
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { ids.push_back(m_ids[index]); });
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { return visitor.on_hit(m_ids[index]); });
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        std::size_t visited = 0;
+        if (m_index.empty()) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            BBox parent;
+        };
+        Entry stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        BBox parent = m_bounds;
+
+        while (true)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            BBox box = decode_box(node, parent);
+            if (box.overlaps(window))
+            {
+                std::uint32_t count = m_count[node];
+                if (box.width() < detail && box.height() < detail)
+                {
+                    // the leaves of a subtree are consecutive in leaf order
+                    std::uint32_t left = node, right = node;
+                    while (!m_count[left]) left = left + 1;
+                    while (!m_count[right]) right = m_index[right];
+                    if (!visitor.on_cluster(box, m_index[right] + m_count[right] - m_index[left])) return visited;
+                }
+                else if (!count)
+                {
+                    stack[top++] = Entry{m_index[node], box};
+                    node = node + 1;
+                    parent = box;
+                    continue;
+                }
+                else
+                {
+                    std::uint32_t first = m_index[node];
+                    for (std::uint32_t i = first; i < first + count; ++i)
+                        if (window.overlaps_circle(m_cx[i], m_cy[i], radius(i)) && !visitor.on_circle(m_ids[i])) 
+                            return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[top - 1].node;
+            parent = stack[top - 1].parent;
+            --top;
+        }
+        return visited;
+    }
+
+    // circles are tested with their stored single precision geometry
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        std::size_t visited = 0;
+        if (m_index.empty()) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            BBox parent;
+        };
+        RayRange range(segment);
+        Capsule capsule(segment, margin);
+        Entry stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        BBox parent = m_bounds;
+        double tnear, tfar;
+
+        while (true)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            BBox box = decode_box(node, parent);
+            if (ray_bbox_interval(range, box.expanded(margin), range.tmin, range.tmax, tnear, tfar))
+            {
+                std::uint32_t count = m_count[node];
+                if (!count)
+                {
+                    stack[top++] = Entry{m_index[node], box};
+                    node = node + 1;
+                    parent = box;
+                    continue;
+                }
+                std::uint32_t first = m_index[node];
+                for (std::uint32_t i = first; i < first + count; ++i)
+                    if (capsule.reaches(m_cx[i], m_cy[i], radius(i)) && !visitor.on_circle(m_ids[i], m_cx[i], m_cy[i], radius(i))) 
+                        return visited;
+            }
+
+            if (top == 0) break;
+            node = stack[top - 1].node;
+            parent = stack[top - 1].parent;
+            --top;
+        }
+        return visited;
+    }
+
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        if (m_index.empty()) return 0;
+        return best_first_search(point, 0, decode_box(0, m_bounds), heap, 
+            [&](std::uint32_t node, const BBox &box, auto &&push) {
+            std::uint32_t count = m_count[node];
+            if (count)
+            {
+                std::uint32_t first = m_index[node];
+                for (std::uint32_t i = first; i < first + count; ++i)
+                    heap.offer_circle(m_ids[i], point, m_cx[i], m_cy[i], radius(i));
+                return;
+            }
+            push(node + 1, decode_box(node + 1, box));
+            push(m_index[node], decode_box(m_index[node], box));
+        });
+    }
+
+    // closest hit, near child first as in KDTree::closest_hit(); the split
+    // axis alternates with the depth
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        const Ray& ray = range.ray;
+        hit = RayHit();
+        std::size_t visited = 0;
+        if (m_index.empty()) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            std::uint32_t depth;
+            double tnear;
+            BBox box;
+        };
+        Entry stack[64];
+        int top = 0;
+
+        double best = range.tmax;
+        double tnear, tfar;
+        BBox root = decode_box(0, m_bounds);
+        if (!ray_bbox_interval(range, root, range.tmin, best, tnear, tfar)) 
+            return visited;
+        stack[top++] = Entry{0, 0, tnear, root};
+        Leaf leaf;
+
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.tnear > best) continue;
+
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            std::uint32_t count = m_count[entry.node];
+            if (count)
+            {
+                std::uint32_t first = m_index[entry.node];
+                load_leaf(first, count, leaf);
+                std::uint32_t mask = CircleBuckets::intersect(m_kernel, leaf.cx, leaf.cy, leaf.r2, count, range);
+                while (mask)
+                {
+                    int i = lowest_bit(mask);
+                    mask &= mask - 1;
+                    double t = CircleBuckets::hit_parameter(leaf.cx[i], leaf.cy[i], leaf.r2[i], ray, range.tmin);
+                    if (t <= best && (t < best || !hit.valid()))
+                    {
+                        best = t;
+                        hit.id = m_ids[first + i];
+                    }
+                }
+                continue;
+            }
+
+            std::uint32_t near_child = entry.node + 1, far_child = m_index[entry.node];
+            double direction = entry.depth % 2 == 0 ? ray.direction.x : ray.direction.y;
+            if (direction < 0.0) std::swap(near_child, far_child);
+
+            BBox near_box = decode_box(near_child, entry.box), far_box = decode_box(far_child, entry.box);
+            double near_tnear, far_tnear;
+            bool near_hit = ray_bbox_interval(range, near_box, range.tmin, best, near_tnear, tfar);
+            bool far_hit = ray_bbox_interval(range, far_box, range.tmin, best, far_tnear, tfar);
+            if (near_hit && far_hit && far_tnear < near_tnear)
+            {
+                std::swap(near_child, far_child);
+                std::swap(near_box, far_box);
+                std::swap(near_tnear, far_tnear);
+            }
+            if (far_hit) stack[top++] = Entry{far_child, entry.depth + 1, far_tnear, far_box};
+            if (near_hit) stack[top++] = Entry{near_child, entry.depth + 1, near_tnear, near_box};
+            INTERSECTION_STAT(thread_query_stats().push(top));
+        }
+
+        if (hit.valid())
+        {
+            hit.t = best;
+            hit.point = ray.origin + ray.direction * best;
+        }
+        return visited;
+    }
+};
+
+#endif
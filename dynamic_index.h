@@ -0,0 +1,816 @@
+#ifndef DYNAMIC_INDEX_H
+#define DYNAMIC_INDEX_H
+
+#include <functional>
+
+#include "geometric.h"
+
+// spatial index that supports insert and erase
+// the circles live in blocks, each a static index from the factory. most of
+// them are in parts: a kd partition of the centers into cells of at most
+// part_size circles, each part with the box of its circles, so a query skips
+// the parts it does not reach like the subtrees of one tree. new circles go
+// to a small buffer that is tested directly, then down max_levels levels,
+// level k holding at most buffer_size * level_ratio^(k + 1) circles: a full
+// buffer is merged into the first level with room for it and the levels
+// above, and what the last level cannot hold is spilled to the parts. the
+// spilled circles are handed to the parts whose cells hold their centers and
+// stay in a spill block until their part is rebuilt, one part every few
+// updates, so no update rebuilds more than a part or a level. a part that
+// grows past twice part_size is split in two.
+// erased circles are skipped by the queries until their block is rebuilt,
+// once a quarter of it is dead: a block reports a circle only while it owns it.
+// the id of an erased circle is reused once no block holds the circle.
+class DynamicIndex : public SpatialIndex
+{
+public:
+    typedef std::function<std::unique_ptr<SpatialIndex>()> Factory;
+
+    static constexpr std::uint32_t buffer_size = 32;
+    static constexpr std::size_t level_ratio = 8;
+    static constexpr std::uint32_t max_levels = 3;
+    static constexpr std::size_t part_size = std::size_t(1) << 15;
+
+private:
+    struct Block
+    {
+        std::unique_ptr<SpatialIndex> index;
+        std::vector<std::uint32_t> ids;  // local index -> id, ascending
+        std::vector<std::uint8_t> gone; // by local index: erased or moved on
+        std::size_t dead = 0;           // gone circles
+        BBox bounds = BBox::empty();    // of its circles
+        BBox cell;                      // of a part: where the centers it takes in lie
+        std::vector<std::uint32_t> pending; // of a part: spilled ids to take in
+    };
+
+    // boxes of the parts as structure of arrays, which a ray is tested
+    // against in one loop; an empty part has an inverted box
+    struct PartBoxes
+    {
+        std::vector<double> x0, y0, x1, y1;
+    };
+
+    // owners of the ids besides the blocks
+    static constexpr std::uint32_t erased = 0xffffffff;
+    static constexpr std::uint32_t in_buffer = 0xfffffffe;
+
+    // the blocks are the levels, the spill and then the parts
+    static constexpr std::uint32_t spill_block = max_levels;
+    static constexpr std::uint32_t first_part = max_levels + 1;
+
+    Factory m_factory;
+    std::vector<Circle> m_circles;      // by id
+    std::vector<std::uint32_t> m_owner; // by id: block, in_buffer or erased
+    std::vector<std::uint32_t> m_free;  // erased ids no block holds
+    std::vector<Block> m_blocks;
+    PartBoxes m_part_boxes;
+    std::vector<std::uint32_t> m_draining; // parts with pending ids
+    std::size_t m_drain_interval = 1, m_until_drain = 0; // in updates
+    CircleBuckets m_buffer;
+    std::uint32_t m_buffer_count = 0;
+    std::size_t m_size = 0;
+
+    static std::size_t level_capacity(std::uint32_t k)
+    {
+        std::size_t capacity = buffer_size;
+        for (std::uint32_t i = 0; i <= k; ++i) capacity *= level_ratio;
+        return capacity;
+    }
+
+    BuildInfo build_block(std::uint32_t b, std::vector<std::uint32_t>& ids, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr)
+    {
+        Block& block = m_blocks[b];
+        block.dead = 0;
+        block.ids.swap(ids);
+        std::sort(block.ids.begin(), block.ids.end());
+        block.gone.assign(block.ids.size(), 0);
+        block.bounds = BBox::empty();
+        if (block.ids.empty())
+        {
+            block.index.reset();
+            set_part_box(b);
+            return BuildInfo();
+        }
+
+        std::vector<Circle> circles;
+        circles.reserve(block.ids.size());
+        for (std::uint32_t id : block.ids)
+        {
+            circles.push_back(m_circles[id]);
+            block.bounds.extend(BBox::of(m_circles[id]));
+            m_owner[id] = b;
+        }
+        set_part_box(b);
+        if (!block.index) block.index = m_factory();
+        return block.index->build(circles, BBox(), pool, control);
+    }
+
+    void set_part_box(std::uint32_t b)
+    {
+        if (b < first_part) return;
+        const BBox& bounds = m_blocks[b].bounds;
+        m_part_boxes.x0[b - first_part] = bounds.bottom_left.x;
+        m_part_boxes.y0[b - first_part] = bounds.bottom_left.y;
+        m_part_boxes.x1[b - first_part] = bounds.top_right.x;
+        m_part_boxes.y1[b - first_part] = bounds.top_right.y;
+    }
+
+    // appends the ids a level or part owns and empties it; frees its
+    // erased ids
+    void take_block(std::uint32_t b, std::vector<std::uint32_t>& ids)
+    {
+        Block& block = m_blocks[b];
+        ids.reserve(ids.size() + block.ids.size() - block.dead);
+        for (std::uint32_t i = 0; i < block.ids.size(); ++i)
+        {
+            if (!block.gone[i]) ids.push_back(block.ids[i]);
+            else m_free.push_back(block.ids[i]);
+        }
+        drop_block(b);
+    }
+
+    // marks a circle of a block as gone
+    void mark_gone(std::uint32_t b, std::uint32_t id)
+    {
+        Block& block = m_blocks[b];
+        block.gone[std::lower_bound(block.ids.begin(), block.ids.end(), id) - block.ids.begin()] = 1;
+        block.dead++;
+    }
+
+    void drop_block(std::uint32_t b)
+    {
+        Block& block = m_blocks[b];
+        block.dead = 0;
+        std::vector<std::uint32_t>().swap(block.ids);
+        std::vector<std::uint8_t>().swap(block.gone);
+        block.index.reset();
+        block.bounds = BBox::empty();
+        set_part_box(b);
+    }
+
+    std::uint32_t add_part(const BBox& cell)
+    {
+        m_blocks.emplace_back();
+        m_blocks.back().cell = cell;
+        const BBox none = BBox::empty();
+        m_part_boxes.x0.push_back(none.bottom_left.x);
+        m_part_boxes.y0.push_back(none.bottom_left.y);
+        m_part_boxes.x1.push_back(none.top_right.x);
+        m_part_boxes.y1.push_back(none.top_right.y);
+        return static_cast<std::uint32_t>(m_blocks.size() - 1);
+    }
+
+    // the part whose cell holds a point
+    std::uint32_t part_of(const Point& p) const
+    {
+        for (std::uint32_t b = first_part; b < m_blocks.size(); ++b)
+        {
+            const BBox& cell = m_blocks[b].cell;
+            if (p.x >= cell.bottom_left.x && p.x < cell.top_right.x
+                && p.y >= cell.bottom_left.y && p.y < cell.top_right.y)
+                return b;
+        }
+        return first_part;
+    }
+
+    // partitions ids[first, last) at the median of their centers along the
+    // wider side of the box of those centers; returns the middle and splits
+    // the cell into the cells of both halves
+    std::size_t split_cell(std::vector<std::uint32_t>& ids, std::size_t first, std::size_t last,
+        const BBox& cell, BBox& low, BBox& high) const
+    {
+        BBox centers = BBox::empty();
+        for (std::size_t i = first; i < last; ++i)
+            centers.extend(BBox(m_circles[ids[i]].center, m_circles[ids[i]].center));
+        int axis = centers.width() >= centers.height() ? 0 : 1;
+        auto coordinate = [&](std::uint32_t id) { return axis ? m_circles[id].center.y : m_circles[id].center.x; };
+
+        std::size_t middle = first + (last - first) / 2;
+        std::nth_element(ids.begin() + first, ids.begin() + middle, ids.begin() + last,
+            [&](std::uint32_t a, std::uint32_t b) { return coordinate(a) < coordinate(b); });
+        double at = coordinate(ids[middle]);
+
+        low = high = cell;
+        if (axis == 0) low.top_right.x = high.bottom_left.x = at;
+        else low.top_right.y = high.bottom_left.y = at;
+        return middle;
+    }
+
+    // splits ids[first, last) into cells of at most part_size circles and
+    // appends the parts, not built yet, with their ranges
+    void partition(std::vector<std::uint32_t>& ids, std::size_t first, std::size_t last, const BBox& cell,
+        std::vector<std::size_t>& ranges, JobControl* control = nullptr)
+    {
+        if (control && control->cancelled()) return;
+        if (last - first <= part_size)
+        {
+            add_part(cell);
+            ranges.push_back(first);
+            ranges.push_back(last);
+            return;
+        }
+        BBox low, high;
+        std::size_t middle = split_cell(ids, first, last, cell, low, high);
+        partition(ids, first, middle, low, ranges, control);
+        partition(ids, middle, last, high, ranges, control);
+    }
+
+    // rebuilds a part with the ids it owns and the ones pending for it
+    void rebuild_part(std::uint32_t p)
+    {
+        std::vector<std::uint32_t> ids, pending;
+        pending.swap(m_blocks[p].pending);
+        ids.reserve(m_blocks[p].ids.size() - m_blocks[p].dead + pending.size());
+        take_block(p, ids);
+        for (std::uint32_t id : pending)
+        {
+            if (m_owner[id] == spill_block)
+            {
+                ids.push_back(id);
+                mark_gone(spill_block, id);
+            }
+            else
+            {
+                m_free.push_back(id); // erased while spilled
+            }
+        }
+
+        if (ids.size() <= 2 * part_size)
+        {
+            build_block(p, ids);
+            return;
+        }
+
+        BBox low, high;
+        std::size_t middle = split_cell(ids, 0, ids.size(), m_blocks[p].cell, low, high);
+        std::vector<std::uint32_t> upper(ids.begin() + middle, ids.end());
+        ids.resize(middle);
+        m_blocks[p].cell = low;
+        build_block(p, ids);
+        build_block(add_part(high), upper);
+    }
+
+    // rebuilds the next part with pending ids; the spill is dropped once
+    // no part waits for it
+    void drain_part()
+    {
+        while (!m_draining.empty())
+        {
+            std::uint32_t p = m_draining.back();
+            m_draining.pop_back();
+            if (m_blocks[p].pending.empty()) continue; // rebuilt since
+            rebuild_part(p);
+            break;
+        }
+        if (m_draining.empty()) drop_block(spill_block);
+    }
+
+    // counts an update, draining a part every m_drain_interval of them
+    void step_drain()
+    {
+        if (m_draining.empty() || --m_until_drain) return;
+        drain_part();
+        m_until_drain = m_drain_interval;
+    }
+
+    // hands ids to the parts; they stay queryable in the spill block. the
+    // parts are rebuilt within three quarters of the updates it takes to fill
+    // the last level again.
+    void spill(std::vector<std::uint32_t>& ids)
+    {
+        while (!m_draining.empty()) drain_part();
+
+        if (m_blocks.size() == first_part)
+        {
+            const double inf = std::numeric_limits<double>::infinity();
+            add_part(BBox(Point(-inf, -inf), Point(inf, inf)));
+        }
+        for (std::uint32_t id : ids)
+        {
+            std::uint32_t p = part_of(m_circles[id].center);
+            if (m_blocks[p].pending.empty()) m_draining.push_back(p);
+            m_blocks[p].pending.push_back(id);
+        }
+        build_block(spill_block, ids);
+
+        m_drain_interval = std::max<std::size_t>(1, 3 * level_capacity(max_levels - 1) / (4 * m_draining.size()));
+        m_until_drain = m_drain_interval;
+    }
+
+    void merge_buffer()
+    {
+        std::vector<std::uint32_t> ids(m_buffer.ids.begin(), m_buffer.ids.begin() + m_buffer_count);
+        m_buffer_count = 0;
+
+        for (std::uint32_t k = 0; k < max_levels; ++k)
+        {
+            take_block(k, ids);
+            if (ids.size() <= level_capacity(k))
+            {
+                build_block(k, ids);
+                return;
+            }
+        }
+        spill(ids);
+    }
+
+    // rebuilds a block a quarter of which is dead
+    void collect(std::uint32_t b)
+    {
+        if (b >= first_part)
+        {
+            rebuild_part(b);
+        }
+        else if (b != spill_block)
+        {
+            std::vector<std::uint32_t> ids;
+            take_block(b, ids);
+            build_block(b, ids);
+        }
+    }
+
+    // calls f(b, tnear) for the blocks whose boxes the ray reaches within its
+    // range, the parts first, with the parameter where it enters them; stops
+    // when f returns false
+    template <class F>
+    void for_each_reached(const RayRange &range, F &&f) const
+    {
+        const Ray& ray = range.ray;
+        const PartBoxes& boxes = m_part_boxes;
+        double tnear, tfar;
+        if (ray.direction.x != 0.0 && ray.direction.y != 0.0)
+        {
+            for (std::size_t i = 0; i < boxes.x0.size(); ++i)
+            {
+                double tx0 = (boxes.x0[i] - ray.origin.x) * range.inv_direction.x;
+                double tx1 = (boxes.x1[i] - ray.origin.x) * range.inv_direction.x;
+                double ty0 = (boxes.y0[i] - ray.origin.y) * range.inv_direction.y;
+                double ty1 = (boxes.y1[i] - ray.origin.y) * range.inv_direction.y;
+                tnear = std::max(std::max(range.tmin, std::min(tx0, tx1)), std::min(ty0, ty1));
+                tfar = std::min(std::min(range.tmax, std::max(tx0, tx1)), std::max(ty0, ty1));
+                if (tnear <= tfar && boxes.x0[i] <= boxes.x1[i] 
+                    && !f(static_cast<std::uint32_t>(first_part + i), tnear)) 
+                    return;
+            }
+        }
+        else
+        {
+            for (std::uint32_t b = first_part; b < m_blocks.size(); ++b)
+            {
+                if (!m_blocks[b].ids.empty() 
+                    && ray_bbox_interval(range, m_blocks[b].bounds, range.tmin, range.tmax, tnear, tfar)
+                    && !f(b, tnear))
+                    return;
+            }
+        }
+
+        for (std::uint32_t b = 0; b < first_part; ++b)
+        {
+            if (!m_blocks[b].ids.empty() 
+                && ray_bbox_interval(range, m_blocks[b].bounds, range.tmin, range.tmax, tnear, tfar)
+                && !f(b, tnear))
+                return;
+        }
+    }
+
+    // ray parameter of the first boundary crossing at or after tmin
+    static double hit_parameter(const RayRange &range, const Circle &circle)
+    {
+        const Ray& ray = range.ray;
+        Vector2d oc = circle.center - ray.origin;
+        double proj = oc.dot(ray.direction);
+        double d2 = oc.dot(oc) - proj * proj;
+        double h = std::sqrt(std::max(0.0, circle.radius * circle.radius - d2));
+        return proj - h >= range.tmin ? proj - h : proj + h;
+    }
+
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const
+    {
+        std::size_t visited = 0;
+        bool stopped = false;
+        for_each_reached(range, [&](std::uint32_t b, double) {
+            const Block& block = m_blocks[b];
+            visited += block.index->for_each_intersection(range, [&](std::uint32_t i) {
+                stopped = !block.gone[i] && !call_on_hit(on_hit, block.ids[i]);
+                return !stopped;
+            });
+            return !stopped;
+        });
+        if (stopped) return visited;
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            for (std::uint32_t mask = m_buffer.intersect(range, 0, m_buffer_count); mask; mask &= mask - 1)
+                if (!call_on_hit(on_hit, m_buffer.ids[lowest_bit(mask)])) break;
+        }
+        return visited;
+    }
+
+public:
+    explicit DynamicIndex(Factory factory) : m_factory(factory) { clear(); }
+
+    const char* name() const override { return "dynamic"; }
+
+    void clear() override
+    {
+        m_circles.clear();
+        m_owner.clear();
+        m_free.clear();
+        m_blocks.clear();
+        m_blocks.resize(first_part);
+        m_part_boxes = PartBoxes();
+        m_draining.clear();
+        m_buffer.resize(buffer_size);
+        m_buffer_count = 0;
+        m_size = 0;
+    }
+
+    // live circles
+    std::size_t size() const override { return m_size; }
+    std::size_t part_count() const { return m_blocks.size() - first_part; }
+
+    std::size_t memory_bytes() const override
+    {
+        std::size_t bytes = m_circles.capacity() * sizeof(Circle)
+            + (m_owner.capacity() + m_free.capacity() + m_draining.capacity()) * sizeof(std::uint32_t)
+            + m_blocks.capacity() * sizeof(Block) + m_part_boxes.x0.capacity() * 4 * sizeof(double) 
+            + m_buffer.memory_bytes();
+        for (const Block& block : m_blocks)
+        {
+            bytes += (block.ids.capacity() + block.pending.capacity()) * sizeof(std::uint32_t) + block.gone.capacity();
+            if (block.index) bytes += block.index->memory_bytes();
+        }
+        return bytes;
+    }
+
+    // the circles get the ids 0 to n - 1 and go to the parts, which are
+    // built on the pool
+    BuildInfo build(const std::vector<Circle>& circles, BBox, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        if (circles.empty()) return BuildInfo();
+
+        m_circles = circles;
+        m_owner.assign(circles.size(), erased);
+        m_size = circles.size();
+
+        std::vector<std::uint32_t> ids(circles.size());
+        for (std::size_t i = 0; i < ids.size(); ++i) ids[i] = static_cast<std::uint32_t>(i);
+        const double inf = std::numeric_limits<double>::infinity();
+        std::vector<std::size_t> ranges;
+        partition(ids, 0, ids.size(), BBox(Point(-inf, -inf), Point(inf, inf)), ranges, control);
+        if (control && control->cancelled())
+        {
+            clear();
+            return BuildInfo();
+        }
+
+        // parts as tasks when there are enough of them, else each on the pool
+        std::size_t num_parts = ranges.size() / 2;
+        std::vector<BuildInfo> infos(num_parts);
+        auto build_part = [&](std::size_t i, ThreadPool* part_pool) {
+            if (control && control->cancelled()) return;
+            std::vector<std::uint32_t> part(ids.begin() + ranges[2 * i], ids.begin() + ranges[2 * i + 1]);
+            infos[i] = build_block(static_cast<std::uint32_t>(first_part + i), part, part_pool, control);
+        };
+        if (pool && num_parts >= pool->size())
+        {
+            pool->parallel_for(0, num_parts, 1, [&](std::size_t first, std::size_t last) {
+                for (std::size_t i = first; i < last; ++i) build_part(i, nullptr);
+            });
+        }
+        else
+        {
+            for (std::size_t i = 0; i < num_parts; ++i) build_part(i, pool);
+        }
+        if (control && control->cancelled())
+        {
+            clear();
+            return BuildInfo();
+        }
+
+        BuildInfo info;
+        for (const BuildInfo& part : infos)
+        {
+            info.nodes += part.nodes;
+            info.depth = std::max(info.depth, part.depth);
+        }
+        return info;
+    }
+
+    // returns the id of the new circle
+    std::uint32_t insert(const Circle &circle)
+    {
+        std::uint32_t id;
+        if (!m_free.empty())
+        {
+            id = m_free.back();
+            m_free.pop_back();
+            m_circles[id] = circle;
+        }
+        else
+        {
+            // grows by an eighth rather than doubling
+            if (m_circles.size() == m_circles.capacity())
+            {
+                std::size_t capacity = m_circles.size() + m_circles.size() / 8 + buffer_size;
+                m_circles.reserve(capacity);
+                m_owner.reserve(capacity);
+            }
+            id = static_cast<std::uint32_t>(m_circles.size());
+            m_circles.push_back(circle);
+            m_owner.push_back(erased);
+        }
+        m_owner[id] = in_buffer;
+        m_size++;
+
+        if (m_buffer_count == buffer_size) merge_buffer();
+        m_buffer.set(m_buffer_count++, circle, id);
+        step_drain();
+        return id;
+    }
+
+    // returns false if the id is unknown or already erased
+    bool erase(std::uint32_t id)
+    {
+        if (id >= m_circles.size() || m_owner[id] == erased) return false;
+        std::uint32_t b = m_owner[id];
+        m_owner[id] = erased;
+        m_size--;
+
+        if (b == in_buffer)
+        {
+            // the buffer holds live circles only
+            std::uint32_t i = 0;
+            while (m_buffer.ids[i] != id) ++i;
+            std::uint32_t last = --m_buffer_count;
+            m_buffer.set(i, m_buffer.circle(last), m_buffer.ids[last]);
+            m_buffer.r2[last] = -1.0;
+            m_free.push_back(id);
+        }
+        else
+        {
+            mark_gone(b, id);
+            if (4 * m_blocks[b].dead > m_blocks[b].ids.size()) collect(b);
+        }
+        step_drain();
+        return true;
+    }
+
+    Circle circle(std::uint32_t id) const { return m_circles[id]; }
+    bool alive(std::uint32_t id) const { return id < m_owner.size() && m_owner[id] != erased; }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        return traverse(range, [&](std::uint32_t id) { results.push_back(m_circles[id]); });
+    }
+
+    // each block fills a list of local indexes, which are then mapped
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        thread_local std::vector<std::uint32_t> local;
+        std::size_t visited = 0;
+        for_each_reached(range, [&](std::uint32_t b, double) {
+            const Block& block = m_blocks[b];
+            local.clear();
+            visited += block.index->detect_intersection(range, local);
+            for (std::uint32_t i : local)
+                if (!block.gone[i]) ids.push_back(block.ids[i]);
+            return true;
+        });
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            for (std::uint32_t mask = m_buffer.intersect(range, 0, m_buffer_count); mask; mask &= mask - 1)
+                ids.push_back(m_buffer.ids[lowest_bit(mask)]);
+        }
+        return visited;
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        return traverse(range, [&](std::uint32_t id) { return visitor.on_hit(id); });
+    }
+
+    // cluster counts may include erased circles
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        // maps the local ids of a block to ids
+        struct BlockVisitor : WindowVisitor
+        {
+            const Block &block;
+            WindowVisitor &visitor;
+            bool stopped = false;
+            BlockVisitor(const Block &block, WindowVisitor &visitor) : block(block), visitor(visitor) {}
+            bool on_circle(std::uint32_t i) override
+            {
+                stopped = !block.gone[i] && !visitor.on_circle(block.ids[i]);
+                return !stopped;
+            }
+            bool on_cluster(const BBox &box, std::size_t count) override
+            {
+                stopped = !visitor.on_cluster(box, count);
+                return !stopped;
+            }
+        };
+
+        std::size_t visited = 0;
+        bool stopped = false;
+        for (const Block& block : m_blocks)
+        {
+            if (block.ids.empty() || !block.bounds.overlaps(window)) continue;
+            BlockVisitor block_visitor(block, visitor);
+            visited += block.index->query_window(window, block_visitor, detail);
+            if (block_visitor.stopped) return visited;
+        }
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            for (std::uint32_t i = 0; i < m_buffer_count && !stopped; ++i)
+            {
+                if (window.overlaps_circle(m_buffer.cx[i], m_buffer.cy[i], m_buffer.radius[i]))
+                    stopped = !visitor.on_circle(m_buffer.ids[i]);
+            }
+        }
+        return visited;
+    }
+
+    // the indexes of the blocks traverse circles of their own
+    std::size_t query_capsule(const Segment &segment, double margin,
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        // maps the local ids of a block to ids
+        struct BlockVisitor : CircleVisitor
+        {
+            const Block &block;
+            CircleVisitor &visitor;
+            bool stopped = false;
+            BlockVisitor(const Block &block, CircleVisitor &visitor) : block(block), visitor(visitor) {}
+            bool on_circle(std::uint32_t i, double cx, double cy, double radius) override
+            {
+                stopped = !block.gone[i] && !visitor.on_circle(block.ids[i], cx, cy, radius);
+                return !stopped;
+            }
+        };
+
+        BBox reach(Point(std::min(segment.origin.x, segment.destination.x), std::min(segment.origin.y, segment.destination.y)),
+            Point(std::max(segment.origin.x, segment.destination.x), std::max(segment.origin.y, segment.destination.y)));
+        reach = reach.expanded(margin);
+
+        std::size_t visited = 0;
+        const std::vector<Circle> none;
+        for (const Block& block : m_blocks)
+        {
+            if (block.ids.empty() || !block.bounds.overlaps(reach)) continue;
+            BlockVisitor block_visitor(block, visitor);
+            visited += block.index->query_capsule(segment, margin, none, block_visitor);
+            if (block_visitor.stopped) return visited;
+        }
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            Capsule capsule(segment, margin);
+            for (std::uint32_t i = 0; i < m_buffer_count; ++i)
+            {
+                if (capsule.reaches(m_buffer.cx[i], m_buffer.cy[i], m_buffer.radius[i])
+                    && !visitor.on_circle(m_buffer.ids[i], m_buffer.cx[i], m_buffer.cy[i], m_buffer.radius[i]))
+                    break;
+            }
+        }
+        return visited;
+    }
+
+    // the parts nearest first, then the levels and the spill, each searched
+    // for circles it owns within the bound of the ones found so far
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        struct Owned : NeighborFilter
+        {
+            const Block &block;
+            explicit Owned(const Block &block) : block(block) {}
+            bool accepts(std::uint32_t i) const override { return !block.gone[i]; }
+        };
+
+        thread_local std::vector<std::pair<double, std::uint32_t>> order;
+        order.clear();
+        for (std::uint32_t b = first_part; b < m_blocks.size(); ++b)
+            if (!m_blocks[b].ids.empty()) order.emplace_back(m_blocks[b].bounds.distance(point), b);
+        std::sort(order.begin(), order.end());
+        for (std::uint32_t b = 0; b < first_part; ++b)
+            if (!m_blocks[b].ids.empty()) order.emplace_back(m_blocks[b].bounds.distance(point), b);
+
+        std::size_t visited = 0;
+        std::vector<Neighbor> found;
+        for (const auto& entry : order)
+        {
+            if (entry.first > heap.bound()) continue;
+            const Block& block = m_blocks[entry.second];
+            Owned owned(block);
+            NeighborHeap block_heap(heap.k(), heap.bound(), block.dead ? &owned : nullptr);
+            visited += block.index->search_nearest(point, block_heap);
+            block_heap.take(found);
+            for (const Neighbor& neighbor : found) heap.offer(block.ids[neighbor.id], neighbor.distance);
+        }
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            for (std::uint32_t i = 0; i < m_buffer_count; ++i)
+                heap.offer_circle(m_buffer.ids[i], point, m_buffer.cx[i], m_buffer.cy[i], m_buffer.radius[i]);
+        }
+        return visited;
+    }
+
+    // closest hit over the blocks the ray reaches: the parts in the order it
+    // enters their boxes, then the levels and the spill. when the closest hit
+    // of a block is a circle it no longer owns, the hits of that block up to
+    // the best hit of the others are searched instead, after those.
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        hit = RayHit();
+        double best = range.tmax;
+        std::size_t visited = 0;
+
+        thread_local std::vector<std::pair<double, std::uint32_t>> order;
+        order.clear();
+        std::size_t num_parts = 0;
+        for_each_reached(range, [&](std::uint32_t b, double tnear) {
+            order.emplace_back(tnear, b);
+            num_parts += b >= first_part;
+            return true;
+        });
+        std::sort(order.begin(), order.begin() + num_parts);
+
+        RayRange bounded = range;
+        std::size_t num_disowned = 0;
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            if (order[i].first > best) continue;
+            std::uint32_t b = order[i].second;
+            const Block& block = m_blocks[b];
+            RayHit block_hit;
+            bounded.tmax = best;
+            visited += block.index->closest_hit(bounded, block_hit);
+            if (!block_hit.valid()) continue;
+
+            if (block.gone[block_hit.id])
+            {
+                order[num_disowned++].second = b; // behind i, so not read again
+            }
+            else if (block_hit.t < best || !hit.valid())
+            {
+                best = block_hit.t;
+                hit.id = block.ids[block_hit.id];
+            }
+        }
+
+        std::vector<std::uint32_t> local;
+        for (std::size_t i = 0; i < num_disowned; ++i)
+        {
+            std::uint32_t b = order[i].second;
+            const Block& block = m_blocks[b];
+            local.clear();
+            bounded.tmax = best;
+            visited += block.index->detect_intersection(bounded, local);
+            for (std::uint32_t j : local)
+            {
+                if (block.gone[j]) continue;
+                std::uint32_t id = block.ids[j];
+                double t = hit_parameter(range, m_circles[id]);
+                if (t <= best && (t < best || !hit.valid()))
+                {
+                    best = t;
+                    hit.id = id;
+                }
+            }
+        }
+
+        if (m_buffer_count)
+        {
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            m_buffer.closest_in_leaf(range, 0, m_buffer_count, best, hit);
+        }
+
+        if (hit.valid())
+        {
+            hit.t = best;
+            hit.point = range.ray.origin + range.ray.direction * best;
+        }
+        return visited;
+    }
+};
+
+#endif
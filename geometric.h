@@ -1,8 +1,18 @@
 #ifndef GEOMETRIC_H
 #define GEOMETRIC_H
 
-#include <random>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <type_traits>
+#include <chrono>
+
+#include "thread_pool.h"
+#include "ray_kernel.h"
 
 // forward declaration
 struct Vector2d;
@@ -103,6 +113,54 @@ struct Ray
 
 };
 
+// a ray restricted to the parameter range [tmin, tmax], with its inverse
+// direction precomputed for the slab tests. a segment becomes the range
+// [0, length] of the ray from its origin towards its destination.
+struct RayRange
+{
+    Ray ray;
+    Vector2d inv_direction;
+    double tmin, tmax;
+
+    RayRange(const Ray &ray, double tmin = 0.0, 
+        double tmax = std::numeric_limits<double>::infinity()) 
+        : ray(ray), inv_direction(1.0 / ray.direction.x, 1.0 / ray.direction.y), tmin(tmin), tmax(tmax) {}
+
+    RayRange(const Segment &segment) 
+        : RayRange(Ray(segment.origin, (segment.destination - segment.origin).normalize()),
+            0.0, (segment.destination - segment.origin).length()) {}
+
+    bool bounded() const { return tmax < std::numeric_limits<double>::infinity(); }
+};
+
+// up to 8 rays stored as structure of arrays, traversed together
+struct RayPacket
+{
+    static constexpr std::size_t max_size = 8;
+
+    double ox[max_size], oy[max_size];
+    double dx[max_size], dy[max_size];
+    double inv_dx[max_size], inv_dy[max_size];
+    std::size_t size;
+
+    // unused lanes repeat the first ray and are left out of active_mask()
+    RayPacket(const Ray *rays, std::size_t count) : size(std::min(count, max_size))
+    {
+        for (std::size_t i = 0; i < max_size; ++i)
+        {
+            const Ray& ray = rays[i < size ? i : 0];
+            ox[i] = ray.origin.x;
+            oy[i] = ray.origin.y;
+            dx[i] = ray.direction.x;
+            dy[i] = ray.direction.y;
+            inv_dx[i] = 1.0 / (ray.direction.x != 0.0 ? ray.direction.x : 1e-300);
+            inv_dy[i] = 1.0 / (ray.direction.y != 0.0 ? ray.direction.y : 1e-300);
+        }
+    }
+
+    std::uint32_t active_mask() const { return (1u << size) - 1; }
+};
+
 struct Circle
 {
     Point center;
@@ -118,252 +176,1014 @@ struct BBox
 
     BBox() : bottom_left(Point(-1.0, -1.0)), top_right(Point(1.0, 1.0)) {}
     BBox(const Point &bottom_left, const Point &top_right) : bottom_left(bottom_left), top_right(top_right) {}
+
+    // box that extend() turns into the other box
+    static BBox empty()
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        return BBox(Point(inf, inf), Point(-inf, -inf));
+    }
+
+    // tight box of a circle
+    static BBox of(const Circle &circle)
+    {
+        Vector2d offset(circle.radius, circle.radius);
+        return BBox(circle.center - offset, circle.center + offset);
+    }
+
+    void extend(const BBox &other)
+    {
+        bottom_left.x = std::min(bottom_left.x, other.bottom_left.x);
+        bottom_left.y = std::min(bottom_left.y, other.bottom_left.y);
+        top_right.x = std::max(top_right.x, other.top_right.x);
+        top_right.y = std::max(top_right.y, other.top_right.y);
+    }
+
+    BBox expanded(double margin) const
+    {
+        return BBox(Point(bottom_left.x - margin, bottom_left.y - margin), 
+            Point(top_right.x + margin, top_right.y + margin));
+    }
+
+    double width() const { return top_right.x - bottom_left.x; }
+    double height() const { return top_right.y - bottom_left.y; }
+
+    bool overlaps(const BBox &other) const
+    {
+        return bottom_left.x <= other.top_right.x && other.bottom_left.x <= top_right.x
+            && bottom_left.y <= other.top_right.y && other.bottom_left.y <= top_right.y;
+    }
+
+    // distance from a point to the box, 0 inside
+    double distance(const Point &point) const
+    {
+        double x = std::max(std::max(bottom_left.x - point.x, point.x - top_right.x), 0.0);
+        double y = std::max(std::max(bottom_left.y - point.y, point.y - top_right.y), 0.0);
+        return std::sqrt(x * x + y * y);
+    }
+
+    // whether the circle reaches into the box
+    bool overlaps_circle(double cx, double cy, double radius) const
+    {
+        double x = cx - std::min(std::max(cx, bottom_left.x), top_right.x);
+        double y = cy - std::min(std::max(cy, bottom_left.y), top_right.y);
+        return x * x + y * y <= radius * radius;
+    }
 };
    
 
-// kd-tree
-struct KDNode 
-{
-    Circle circle;
-    BBox bbox;
-    std::unique_ptr<KDNode> left, right;
-    
-    KDNode() : circle(), bbox(), left(nullptr), right(nullptr) {}
-    KDNode(const Circle& circle, const BBox& bbox) 
-        : circle(circle), bbox(bbox), left(nullptr), right(nullptr) {}
-    
+// closest intersection of a ray with the circles: the first point where the
+// ray crosses a circle boundary
+struct RayHit
+{
+    static constexpr std::uint32_t null = 0xffffffffu;
+
+    std::uint32_t id; // index of the circle in the build input
+    double t;         // ray parameter of the hit point
+    Point point;
+
+    RayHit() : id(null), t(0.0), point() {}
+
+    bool valid() const { return id != null; }
 };
 
-class KDTree 
+// hits of a batch of rays in compressed sparse row layout: the indices of the
+// circles hit by ray i are hits[offsets[i], offsets[i + 1])
+struct BatchHits
 {
-private:
-    std::unique_ptr<KDNode> m_root;
+    std::vector<std::size_t> offsets;
+    std::vector<std::uint32_t> hits;
 
-public:
-    KDTree() : m_root(nullptr) {}
+    std::size_t num_rays() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+};
 
-    void clear() { m_root.reset(); }
+// two circles whose discs overlap, first < second
+struct OverlapPair
+{
+    std::uint32_t first, second;
+};
+
+// rays from one point, count of them spread evenly over the angles from
+// from to to in radians, both ends included
+struct RayFan
+{
+    Point origin;
+    double from = 0.0, to = 0.0;
+    std::size_t count = 0;
+    double max_distance = std::numeric_limits<double>::infinity(); // seen when nothing is hit
+
+    double angle(std::size_t i) const 
+    { 
+        return count > 1 ? from + (to - from) * double(i) / double(count - 1) : from; 
+    }
 
-    // construct kd tree
-    std::unique_ptr<KDNode> recursive_build(std::vector<Circle>& circles, BBox bbox, std::size_t& depth) 
+    Ray ray(std::size_t i) const
     {
-        if (circles.empty()) {
-            return nullptr;
-        }
+        double a = angle(i);
+        return Ray(origin, Vector2d(std::cos(a), std::sin(a)));
+    }
+};
 
-        int cd = depth % 2;
+// what a fan of rays sees: by ray, the distance to the first circle hit and
+// its id, or max_distance and RayHit::null when none is. the vertices at
+// those distances, in ray order, bound the visibility polygon around the
+// origin, a closed one when the fan turns all the way around.
+struct VisibilityPolygon
+{
+    Point origin;
+    std::vector<double> distances;
+    std::vector<std::uint32_t> ids;
+    std::vector<Point> vertices;
+};
 
-        if (cd == 0) 
-        {
-            std::sort(circles.begin(), circles.end(), [](const Circle& a, const Circle& b) {
-                if (a.center.x == b.center.x) return a.center.y < b.center.y;
-                return a.center.x < b.center.x;}
-                );
-        } 
-        else 
-        {
-            std::sort(circles.begin(), circles.end(), [](const Circle& a, const Circle& b) {
-                if (a.center.y == b.center.y) return a.center.x < b.center.x;    
-                return a.center.y < b.center.y;}
-                );
-        }
+// distance from a point to a disc, 0 inside
+inline double circle_distance(const Point &point, double cx, double cy, double radius)
+{
+    double x = cx - point.x, y = cy - point.y;
+    return std::max(0.0, std::sqrt(x * x + y * y) - radius);
+}
+
+// distance from a point to a segment
+inline double segment_distance(const Point &point, const Segment &segment)
+{
+    Vector2d d = segment.destination - segment.origin;
+    Vector2d p = point - segment.origin;
+    double len2 = d.dot(d);
+    double t = len2 > 0.0 ? std::min(1.0, std::max(0.0, p.dot(d) / len2)) : 0.0;
+    return (p - d * t).length();
+}
 
-        size_t median_index = circles.size() / 2;
-        Point bottom_left = bbox.bottom_left;
-        Point top_right = bbox.top_right;
+// a segment widened by a margin on every side, to test many circles against:
+// a circle reaches into it when its disc comes within margin of the segment
+struct Capsule
+{
+    Point origin;
+    Vector2d direction; // to the other end
+    double inv_length2, margin;
 
-        if (cd == 0) 
-        {
-            top_right.x = circles[median_index].center.x;
-        } else {
-            top_right.y = circles[median_index].center.y;
-        }
+    Capsule(const Segment &segment, double margin) 
+        : origin(segment.origin), direction(segment.destination - segment.origin), margin(margin) 
+    {
+        double length2 = direction.dot(direction);
+        inv_length2 = length2 > 0.0 ? 1.0 / length2 : 0.0;
+    }
+
+    bool reaches(double cx, double cy, double radius) const
+    {
+        double px = cx - origin.x, py = cy - origin.y;
+        double t = std::min(1.0, std::max(0.0, (px * direction.x + py * direction.y) * inv_length2));
+        double ex = px - t * direction.x, ey = py - t * direction.y;
+        double reach = margin + radius;
+        return ex * ex + ey * ey <= reach * reach;
+    }
+};
+
+// a circle found by a nearest neighbor query
+struct Neighbor
+{
+    std::uint32_t id;
+    double distance; // from the query point to the disc, 0 inside
 
-        // using radius to enlarge the bbox for safety
-        const double& radius = circles[median_index].radius;
-        Vector2d offset = Point(radius, radius) - Point(.0, .0);
-        BBox left_bbox = BBox(bbox.bottom_left - offset, top_right + offset);
-        BBox right_bbox = BBox(bottom_left - offset, bbox.top_right + offset);
-        
+    bool operator<(const Neighbor &other) const { return distance < other.distance; }
+};
 
-        std::unique_ptr<KDNode> node = std::make_unique<KDNode>(circles[median_index], BBox());
+// decides which circles a NeighborHeap takes
+struct NeighborFilter
+{
+    virtual ~NeighborFilter() {}
+    virtual bool accepts(std::uint32_t id) const = 0;
+};
 
-        std::vector<Circle> left_circles(circles.begin(), circles.begin() + median_index);
-        std::vector<Circle> right_circles(circles.begin() + median_index + 1, circles.end());
+// the k nearest circles found so far within a distance, as a max-heap, so
+// the k-th nearest is on top and is the bound the search prunes with
+class NeighborHeap
+{
+private:
+    std::vector<Neighbor> m_items;
+    std::size_t m_k;
+    double m_max_distance;
+    const NeighborFilter* m_filter;
 
-        depth++;
-        node->left = recursive_build(left_circles, left_bbox, depth);
-        node->right = recursive_build(right_circles, right_bbox, depth);
+public:
+    explicit NeighborHeap(std::size_t k, double max_distance = std::numeric_limits<double>::infinity(),
+        const NeighborFilter* filter = nullptr)
+        : m_k(k), m_max_distance(max_distance), m_filter(filter) {}
+
+    std::size_t k() const { return m_k; }
+    std::size_t size() const { return m_items.size(); }
+
+    // circles farther than this cannot be among the k nearest
+    double bound() const 
+    { 
+        if (m_k == 0) return -1.0;
+        return m_items.size() < m_k ? m_max_distance : m_items.front().distance; 
+    }
+
+    void offer(std::uint32_t id, double distance)
+    {
+        if (distance > bound() || (m_items.size() == m_k && distance == bound())) return;
+        if (m_filter && !m_filter->accepts(id)) return;
+        if (m_items.size() == m_k)
+        {
+            std::pop_heap(m_items.begin(), m_items.end());
+            m_items.back() = Neighbor{id, distance};
+        }
+        else
+        {
+            m_items.push_back(Neighbor{id, distance});
+        }
+        std::push_heap(m_items.begin(), m_items.end());
+    }
 
-        return node;
+    // offers a circle, skipping the square root for centers beyond reach
+    void offer_circle(std::uint32_t id, const Point &point, double cx, double cy, double radius)
+    {
+        double x = cx - point.x, y = cy - point.y;
+        double reach = bound() + radius;
+        if (reach < 0.0 || x * x + y * y > reach * reach) return;
+        offer(id, std::max(0.0, std::sqrt(x * x + y * y) - radius));
     }
 
-    std::size_t build(const std::vector<Circle>& circles, BBox bbox) 
+    // the neighbors into result, nearest first; empties the heap
+    void take(std::vector<Neighbor> &result)
     {
-        std::vector<Circle> circles_copy = circles;
-        std::size_t depth = 0;
-        m_root = recursive_build(circles_copy, bbox, depth);
+        std::sort_heap(m_items.begin(), m_items.end());
+        result.swap(m_items);
+        m_items.clear();
+    }
+};
 
-        return depth;
+// work done by queries, counted only when built with INTERSECTION_STATS.
+// the traversals add to a per-thread record through INTERSECTION_STAT, which
+// expands to nothing otherwise, so the default build pays nothing for it.
+struct QueryStats
+{
+    std::uint64_t queries = 0;
+    std::uint64_t nodes = 0;        // visited nodes or grid cells
+    std::uint64_t bbox_tests = 0;   // ray against box
+    std::uint64_t circle_tests = 0; // ray against circle, padding excluded
+    std::uint64_t hits = 0;
+    std::uint32_t max_stack_depth = 0;
+
+    void push(int depth)
+    {
+        max_stack_depth = std::max(max_stack_depth, static_cast<std::uint32_t>(depth));
     }
 
-    bool does_ray_intersect_bbox(const Ray &ray, const BBox &bbox) const 
+    void merge(const QueryStats &other)
     {
-        double txmin = (bbox.bottom_left.x - ray.origin.x) / ray.direction.x;
-        double txmax = (bbox.top_right.x - ray.origin.x) / ray.direction.x;
+        queries += other.queries;
+        nodes += other.nodes;
+        bbox_tests += other.bbox_tests;
+        circle_tests += other.circle_tests;
+        hits += other.hits;
+        max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+    }
+};
 
-        if (txmin > txmax) std::swap(txmin, txmax);
+#ifdef INTERSECTION_STATS
+constexpr bool query_stats_enabled = true;
 
-        double tymin = (bbox.bottom_left.y - ray.origin.y) / ray.direction.y;
-        double tymax = (bbox.top_right.y - ray.origin.y) / ray.direction.y;
+inline QueryStats& thread_query_stats()
+{
+    static thread_local QueryStats stats;
+    return stats;
+}
 
-        if (tymin > tymax) std::swap(tymin, tymax);
+#define INTERSECTION_STAT(expr) (expr)
+#else
+constexpr bool query_stats_enabled = false;
 
-        if ((txmin > tymax) || (tymin > txmax))
-            return false;
+#define INTERSECTION_STAT(expr) ((void)0)
+#endif
 
-        return true;
+// wall time of one step of a build
+struct BuildPhase
+{
+    const char* name;
+    double ms;
+};
+
+// appends the time since the previous lap to the phases; does nothing
+// without INTERSECTION_STATS
+class PhaseTimer
+{
+#ifdef INTERSECTION_STATS
+private:
+    std::vector<BuildPhase>& m_phases;
+    std::chrono::steady_clock::time_point m_last = std::chrono::steady_clock::now();
+
+public:
+    explicit PhaseTimer(std::vector<BuildPhase>& phases) : m_phases(phases) {}
+
+    void lap(const char* name)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        m_phases.push_back(BuildPhase{name, std::chrono::duration<double, std::milli>(now - m_last).count()});
+        m_last = now;
+    }
+#else
+public:
+    explicit PhaseTimer(std::vector<BuildPhase>&) {}
+
+    void lap(const char*) {}
+#endif
+};
+
+// parameter interval [tnear, tfar] of the ray inside the box, clipped to
+// [tmin, tmax]. a zero direction component makes the ray parallel to that
+// slab: it is either inside it for all t or misses the box.
+// returns false when the interval is empty.
+inline bool ray_bbox_interval(const RayRange &range, const BBox &bbox,
+    double tmin, double tmax, double &tnear, double &tfar)
+{
+    const Ray& ray = range.ray;
+    tnear = tmin;
+    tfar = tmax;
+    INTERSECTION_STAT(thread_query_stats().bbox_tests++);
+
+    if (ray.direction.x != 0.0)
+    {
+        double tx0 = (bbox.bottom_left.x - ray.origin.x) * range.inv_direction.x;
+        double tx1 = (bbox.top_right.x - ray.origin.x) * range.inv_direction.x;
+        tnear = std::max(tnear, std::min(tx0, tx1));
+        tfar = std::min(tfar, std::max(tx0, tx1));
+    }
+    else if (ray.origin.x < bbox.bottom_left.x || ray.origin.x > bbox.top_right.x) 
+    {
+        return false;
     }
 
-    bool does_ray_intersect_circle(const Ray &ray, const Circle &circle) const 
+    if (ray.direction.y != 0.0)
     {
-        Vector2d origin_to_center = circle.center - ray.origin;
-        assert(std::abs(ray.direction.length() - 1.0) < 1e-7);
-        double proj = origin_to_center.dot(ray.direction); 
-        double d_square = origin_to_center.dot(origin_to_center) - proj * proj; 
-        double radius_square = circle.radius * circle.radius; 
+        double ty0 = (bbox.bottom_left.y - ray.origin.y) * range.inv_direction.y;
+        double ty1 = (bbox.top_right.y - ray.origin.y) * range.inv_direction.y;
+        tnear = std::max(tnear, std::min(ty0, ty1));
+        tfar = std::min(tfar, std::max(ty0, ty1));
+    }
+    else if (ray.origin.y < bbox.bottom_left.y || ray.origin.y > bbox.top_right.y) 
+    {
+        return false;
+    }
 
-        if (d_square > radius_square) return false;
+    return tnear <= tfar;
+}
+
+// circles of a tree stored as structure of arrays in leaf order, so a leaf
+// references a range of them and a bucket is tested with one vector kernel.
+// the hot arrays are padded for the vector kernels, which may read 3 circles
+// past the last leaf; the padding has a negative squared radius and is never hit.
+struct CircleBuckets
+{
+    std::vector<double> cx, cy, r2;
+    std::vector<double> radius;
+    std::vector<std::uint32_t> ids; // index of each circle in the build input
 
-        double t = std::sqrt(radius_square - d_square); 
-        double t0 = proj - t;
-        double t1 = proj + t; 
+    RayCircleKernel kernel = ray_circle_kernel();
+
+    void clear()
+    {
+        cx.clear();
+        cy.clear();
+        r2.clear();
+        radius.clear();
+        ids.clear();
+    }
 
-        if (t0 > t1) std::swap(t0, t1);
+    void resize(std::size_t n)
+    {
+        cx.assign(n + 3, 0.0);
+        cy.assign(n + 3, 0.0);
+        r2.assign(n + 3, -1.0);
+        radius.resize(n);
+        ids.resize(n);
+    }
 
-        if (t0 > 0) return true;
+    std::size_t size() const { return ids.size(); }
 
-        return t1 > 0;
+    std::size_t memory_bytes() const
+    {
+        return (cx.capacity() + cy.capacity() + r2.capacity() + radius.capacity()) * sizeof(double)
+            + ids.capacity() * sizeof(std::uint32_t);
     }
 
-    void detect_intersection_recursive(const std::unique_ptr<KDNode> &node, 
-        const Ray &ray, std::vector<Circle> &results) const 
+    void set(std::size_t index, const Circle &circle, std::uint32_t id)
     {
-        if (!node) return;
+        cx[index] = circle.center.x;
+        cy[index] = circle.center.y;
+        r2[index] = circle.radius * circle.radius;
+        radius[index] = circle.radius;
+        ids[index] = id;
+    }
 
-        // Check if ray intersects the bounding box of the current node
-        if (!does_ray_intersect_bbox(ray, node->bbox)) return;
+    Circle circle(std::uint32_t index) const 
+    { 
+        return Circle(Point(cx[index], cy[index]), radius[index]); 
+    }
 
-        // Check if ray intersects the circle of the current node
-        if (does_ray_intersect_circle(ray, node->circle)) {
-            results.push_back(node->circle);
+    // bit mask of the circles in [first, first + count) whose chord with the
+    // ray overlaps (tmin, tmax]. the kernel tests the far end of the chord
+    // against tmin from the origin moved to tmin; the near end is checked
+    // against tmax for the few circles left.
+    std::uint32_t intersect(const RayRange &range, std::uint32_t first, std::uint32_t count) const
+    {
+        return intersect(kernel, &cx[first], &cy[first], &r2[first], count, range);
+    }
+
+    // the same on bare arrays, padded like the buckets
+    static std::uint32_t intersect(RayCircleKernel kernel, const double *cx, const double *cy, 
+        const double *r2, std::uint32_t count, const RayRange &range)
+    {
+        const Ray& ray = range.ray;
+        Point origin = range.tmin != 0.0 ? ray.origin + ray.direction * range.tmin : ray.origin;
+        INTERSECTION_STAT(thread_query_stats().circle_tests += count);
+        std::uint32_t mask = kernel(cx, cy, r2, count,
+            origin.x, origin.y, ray.direction.x, ray.direction.y);
+        if (!range.bounded()) return mask;
+
+        for (std::uint32_t bits = mask; bits; bits &= bits - 1)
+        {
+            int i = lowest_bit(bits);
+            double x = cx[i] - ray.origin.x;
+            double y = cy[i] - ray.origin.y;
+            double proj = x * ray.direction.x + y * ray.direction.y;
+            if (proj <= range.tmax) continue;
+            double d2 = x * x + y * y - proj * proj;
+            double ahead = proj - range.tmax;
+            if (ahead * ahead > r2[i] - d2) mask &= ~(1u << i);
         }
+        return mask;
+    }
 
-        // Recursively check the left and right children
-        detect_intersection_recursive(node->left, ray, results);
-        detect_intersection_recursive(node->right, ray, results);
+    // ray parameter of the first boundary crossing at or after tmin with a
+    // circle the ray hits
+    double hit_parameter(const Ray &ray, double tmin, std::uint32_t index) const
+    {
+        return hit_parameter(cx[index], cy[index], r2[index], ray, tmin);
     }
 
-    void detect_intersection(const Ray &ray, std::vector<Circle> &results) const 
+    static double hit_parameter(double cx, double cy, double r2, const Ray &ray, double tmin)
     {
-        detect_intersection_recursive(m_root, ray, results);
+        double x = cx - ray.origin.x;
+        double y = cy - ray.origin.y;
+        double proj = x * ray.direction.x + y * ray.direction.y;
+        double d2 = x * x + y * y - proj * proj;
+        double h = std::sqrt(std::max(0.0, r2 - d2));
+        return proj - h >= tmin ? proj - h : proj + h;
     }
 
+    // keeps the closest hit of the circles of a leaf in best and hit.id
+    void closest_in_leaf(const RayRange &range, std::uint32_t first, std::uint32_t count,
+        double &best, RayHit &hit) const
+    {
+        std::uint32_t mask = intersect(range, first, count);
+        while (mask)
+        {
+            std::uint32_t index = first + lowest_bit(mask);
+            mask &= mask - 1;
+            double t = hit_parameter(range.ray, range.tmin, index);
+            if (t <= best && (t < best || !hit.valid()))
+            {
+                best = t;
+                hit.id = ids[index];
+            }
+        }
+    }
 };
 
-class Algorithm
+// receives the ids of the circles hit by a query, in no particular order;
+// returning false ends the query
+class HitVisitor
 {
-private:
-    std::random_device m_rd;
-    std::mt19937 m_gen;
-
 public:
-    std::mt19937 random_generator() {return m_gen;}
+    virtual ~HitVisitor() {}
+    virtual bool on_hit(std::uint32_t id) = 0;
+};
 
+// receives what a window query finds; returning false ends the query
+class WindowVisitor
+{
 public:
-    std::unique_ptr<KDTree> m_kdtree_ptr 
-        = std::make_unique<KDTree>();
-    Algorithm() : m_gen(m_rd()) {}
+    virtual ~WindowVisitor() {}
+    virtual bool on_circle(std::uint32_t id) = 0;
 
-    void clear() { m_kdtree_ptr = std::make_unique<KDTree>(); }
+    // a subtree not opened because it is smaller than the detail size: the
+    // box its circles lie in, some possibly outside the window, and their count
+    virtual bool on_cluster(const BBox &, std::size_t) { return true; }
+};
 
+// receives circles with their geometry, as the index stores it
+class CircleVisitor
+{
 public:
-    void generate_random_circles(std::vector<Circle> &circles, 
-        const BBox& rect, double radius, std::size_t num_circles)
+    virtual ~CircleVisitor() {}
+    virtual bool on_circle(std::uint32_t id, double cx, double cy, double radius) = 0;
+};
+
+// best-first walk of a tree for a nearest neighbor query. the pending nodes
+// are kept in a min-heap on the distance from the point to their box, and the
+// walk ends when the nearest of them is beyond the bound of the heap of
+// circles. expand(node, box, push) offers the circles of a leaf to the heap,
+// or calls push(child, child_box) for the children of an inner node. returns
+// the number of visited nodes.
+template <class F>
+std::size_t best_first_search(const Point &point, std::uint32_t root, const BBox &root_box, 
+    NeighborHeap &heap, F &&expand)
+{
+    struct Entry
+    {
+        double distance;
+        std::uint32_t node;
+        BBox box;
+
+        bool operator<(const Entry &other) const { return distance > other.distance; }
+    };
+
+    std::size_t visited = 0;
+    std::vector<Entry> queue;
+    queue.reserve(64);
+    auto push = [&](std::uint32_t node, const BBox &box) {
+        double distance = box.distance(point);
+        if (distance > heap.bound()) return;
+        queue.push_back(Entry{distance, node, box});
+        std::push_heap(queue.begin(), queue.end());
+    };
+
+    push(root, root_box);
+    while (!queue.empty())
     {
-        std::uniform_real_distribution<> distri_x(rect.bottom_left.x + radius, rect.top_right.x - radius);
-        std::uniform_real_distribution<> distri_y(rect.bottom_left.y + radius, rect.top_right.y - radius);
+        std::pop_heap(queue.begin(), queue.end());
+        Entry entry = queue.back();
+        queue.pop_back();
+        if (entry.distance > heap.bound()) break;
+
+        visited++;
+        INTERSECTION_STAT(thread_query_stats().nodes++);
+        expand(entry.node, entry.box, push);
+    }
+    return visited;
+}
 
-        for (int i = 0; i < num_circles; ++i)
-        {
-            float x = distri_x(m_gen);
-            float y = distri_y(m_gen);
-            circles.emplace_back(Point(x, y), radius);
-        }
+// calls a hit callback of a traversal; a callback may return void, or bool
+// to end the traversal with false
+template <class F, class... Args>
+inline bool call_on_hit(F &on_hit, Args... args)
+{
+    if constexpr (std::is_void<decltype(on_hit(args...))>::value)
+    {
+        on_hit(args...);
+        return true;
     }
+    else
+    {
+        return on_hit(args...);
+    }
+}
+
+// result of building an index
+struct BuildInfo
+{
+    std::size_t nodes = 0; // nodes of a tree, cells of a grid
+    std::size_t depth = 0; // node levels on the longest root to leaf path
+    std::vector<BuildPhase> phases; // with INTERSECTION_STATS
+};
 
-    void generate_random_ray(Ray &ray, const BBox& viewer_rect)
+// common interface of the acceleration structures over a set of circles.
+// hits are reported as indices into the circles the structure was built from.
+class SpatialIndex
+{
+public:
+    virtual ~SpatialIndex() {}
+
+    virtual const char* name() const = 0;
+
+    // structures that build in parallel use the pool when one is given. a
+    // build given control advances it by the circles it has placed, the total
+    // being the caller's to set, and once it is cancelled stops early and
+    // leaves the index empty
+    virtual BuildInfo build(const std::vector<Circle>& circles, BBox bbox, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr) = 0;
+    virtual void clear() = 0;
+
+    // number of circles
+    virtual std::size_t size() const = 0;
+    virtual std::size_t memory_bytes() const = 0;
+
+    // append the circles hit by the ray within its range and return the
+    // number of visited nodes. a Ray is queried over [0, inf), a Segment
+    // over its length.
+    virtual std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const = 0;
+    virtual std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const = 0;
+
+    // first circle hit along the ray, returns the number of visited nodes
+    virtual std::size_t closest_hit(const RayRange &range, RayHit &hit) const = 0;
+
+    // passes the ids of the circles hit to the visitor until it returns false.
+    // nothing is allocated; returns the number of visited nodes.
+    virtual std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const = 0;
+
+    // circles that reach into the window, passed to the visitor until it
+    // returns false. with a detail size, the trees report a subtree whose box
+    // is smaller than it in both directions as one cluster instead of opening
+    // it; the grid reports every circle. returns the number of visited nodes.
+    virtual std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const = 0;
+
+    // circles whose disc comes within margin of the segment, each once, passed
+    // to the visitor until it returns false. circles are the ones the index was
+    // built from. this one runs window queries on boxes along the segment and
+    // looks the circles up by id; the indexes override it with a walk of their
+    // own circles, and ignore circles. returns the number of visited nodes.
+    virtual std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &circles, CircleVisitor &visitor) const
     {
-        std::uniform_real_distribution<> distri_x(viewer_rect.bottom_left.x,  viewer_rect.top_right.x);
-        std::uniform_real_distribution<> distri_y(viewer_rect.bottom_left.y,  viewer_rect.top_right.y);
+        static thread_local std::vector<std::uint32_t> marks;
+        static thread_local std::uint32_t stamp = 0;
+        if (marks.size() < circles.size()) marks.resize(circles.size(), 0);
+        if (++stamp == 0)
+        {
+            std::fill(marks.begin(), marks.end(), 0);
+            stamp = 1;
+        }
 
-        std::vector<Point> edge_points = {
-            {distri_x(m_gen), viewer_rect.bottom_left.y}, // Bottom edge
-            {distri_x(m_gen), viewer_rect.top_right.y}, // Top edge
-            {viewer_rect.bottom_left.x, distri_y(m_gen)}, // Left edge
-            {viewer_rect.top_right.x, distri_y(m_gen)}  // Right edge
-        };
+        struct Filter : WindowVisitor
+        {
+            Capsule capsule;
+            const std::vector<Circle>& circles;
+            CircleVisitor& visitor;
+            bool done = false;
+
+            Filter(const Capsule& capsule, const std::vector<Circle>& circles, CircleVisitor& visitor)
+                : capsule(capsule), circles(circles), visitor(visitor) {}
+
+            bool on_circle(std::uint32_t id) override
+            {
+                if (id >= circles.size() || marks[id] == stamp) return true;
+                marks[id] = stamp;
+                const Circle& circle = circles[id];
+                if (!capsule.reaches(circle.center.x, circle.center.y, circle.radius)) return true;
+                done = !visitor.on_circle(id, circle.center.x, circle.center.y, circle.radius);
+                return !done;
+            }
+        } filter(Capsule(segment, margin), circles, visitor);
+
+        std::size_t visited = 0;
+        Vector2d d = segment.destination - segment.origin;
+        std::size_t pieces = std::size_t(std::ceil(d.length() / std::max(2.0 * margin, 1e-9)));
+        pieces = std::max<std::size_t>(1, std::min<std::size_t>(1024, pieces));
+        for (std::size_t i = 0; i < pieces && !filter.done; ++i)
+        {
+            Point a = segment.origin + d * (double(i) / pieces);
+            Point b = segment.origin + d * (double(i + 1) / pieces);
+            BBox box(Point(std::min(a.x, b.x), std::min(a.y, b.y)), Point(std::max(a.x, b.x), std::max(a.y, b.y)));
+            visited += query_window(box.expanded(margin), filter);
+        }
+        return visited;
+    }
 
-        std::shuffle(edge_points.begin(), edge_points.end(), m_gen);
+    // offers the circles near the point to the heap, which keeps the nearest
+    // by distance to the disc; returns the number of visited nodes
+    virtual std::size_t search_nearest(const Point &point, NeighborHeap &heap) const = 0;
 
-        Point origin = edge_points[0];
-        Point destination = edge_points[1];
-        
-        Vector2d direction = destination - origin;
-        direction = direction.normalize();
-        
-        ray = Ray(origin, direction);
-        ray.plot_segment = Segment(origin, destination);
+    // the k circles nearest to the point within max_distance, nearest first
+    std::size_t nearest(const Point &point, std::size_t k, std::vector<Neighbor> &result, 
+        double max_distance = std::numeric_limits<double>::infinity()) const
+    {
+        NeighborHeap heap(k, max_distance);
+        std::size_t visited = search_nearest(point, heap);
+        heap.take(result);
+        return visited;
     }
 
-    Ray generate_random_ray_screen(double viewer_w, double viewer_h)
+    // appends the ids of the circles that reach into the window
+    std::size_t collect_window(const BBox &window, std::vector<std::uint32_t> &ids) const
     {
-        std::uniform_real_distribution<> distri_x(0,  viewer_w);
-        std::uniform_real_distribution<> distri_y(0,  viewer_h);
+        struct Visitor : WindowVisitor
+        {
+            std::vector<std::uint32_t> &ids;
+            explicit Visitor(std::vector<std::uint32_t> &ids) : ids(ids) {}
+            bool on_circle(std::uint32_t id) override { ids.push_back(id); return true; }
+        } visitor(ids);
+        return query_window(window, visitor);
+    }
 
-        std::vector<Point> edge_points = {
-            {distri_x(m_gen), viewer_h}, // Bottom edge
-            {distri_x(m_gen), 0}, // Top edge
-            {0, distri_y(m_gen)}, // Left edge
-            {viewer_w, distri_y(m_gen)}  // Right edge
-        };
+    // the same with a callable taking an id, returning void or bool
+    template <class F>
+    std::size_t for_each_intersection(const RayRange &range, F &&on_hit) const
+    {
+        struct Visitor : HitVisitor
+        {
+            F &f;
+            explicit Visitor(F &f) : f(f) {}
+            bool on_hit(std::uint32_t id) override { return call_on_hit(f, id); }
+        } visitor(on_hit);
+        return visit_intersections(range, visitor);
+    }
 
-        std::shuffle(edge_points.begin(), edge_points.end(), m_gen);
+    // writes the ids of the first capacity hits to ids, a buffer of the caller,
+    // and returns the number of hits, which may be larger
+    std::size_t collect_intersections(const RayRange &range, std::uint32_t *ids, std::size_t capacity) const
+    {
+        std::size_t count = 0;
+        for_each_intersection(range, [&](std::uint32_t id) {
+            if (count < capacity) ids[count] = id;
+            ++count;
+        });
+        return count;
+    }
 
-        Point origin = edge_points[0];
-        Point destination = edge_points[1];
-        
-        Vector2d direction = destination - origin;
-        direction = direction.normalize();
-        
-        Ray ray = Ray(origin, direction);
-        ray.plot_segment = Segment(origin, destination);
+    std::size_t count_intersections(const RayRange &range) const
+    {
+        std::size_t count = 0;
+        for_each_intersection(range, [&count](std::uint32_t) { ++count; });
+        return count;
+    }
 
-        return ray;
+    // whether the ray hits any circle; stops at the first hit found
+    bool any_intersection(const RayRange &range) const
+    {
+        bool hit = false;
+        for_each_intersection(range, [&hit](std::uint32_t) { hit = true; return false; });
+        return hit;
     }
 
+    // appends the hits of each ray of the packet to ids[ray]; structures
+    // without packet traversal query the rays one by one
+    virtual std::size_t detect_intersection_packet(const RayPacket &packet, std::vector<std::uint32_t> *ids) const
+    {
+        std::size_t visited = 0;
+        for (std::size_t i = 0; i < packet.size; ++i)
+        {
+            Ray ray(Point(packet.ox[i], packet.oy[i]), Vector2d(packet.dx[i], packet.dy[i]));
+            visited += detect_intersection(ray, ids[i]);
+        }
+        return visited;
+    }
 
-    std::size_t build_kdtree(const std::vector<Circle>& circles, BBox bbox)
+    // queries a batch of rays on the pool. rays are processed in fixed blocks
+    // and the per-ray hit lists are concatenated in ray order, so the result
+    // does not depend on the number of threads. with packets, consecutive rays
+    // are traversed in packets of 8, which pays off when they are coherent;
+    // the result is the same either way. with INTERSECTION_STATS, the work of
+    // the whole batch is added to stats when given.
+    void detect_intersection_batch(const Ray *rays, std::size_t num_rays, 
+        BatchHits &results, ThreadPool &pool, bool packets = false, [[maybe_unused]] QueryStats *stats = nullptr) const
     {
-        return m_kdtree_ptr->build(circles, bbox);
+        const std::size_t block_size = 64;
+        std::size_t num_blocks = (num_rays + block_size - 1) / block_size;
+        std::vector<std::vector<std::uint32_t>> block_hits(num_blocks);
+
+        results.offsets.assign(num_rays + 1, 0);
+
+#ifdef INTERSECTION_STATS
+        std::mutex stats_mutex;
+#endif
+        pool.parallel_for(0, num_blocks, 1, [&](std::size_t first, std::size_t last) {
+            INTERSECTION_STAT(thread_query_stats() = QueryStats());
+            for (std::size_t block = first; block < last; ++block)
+            {
+                std::vector<std::uint32_t>& hits = block_hits[block];
+                std::size_t end = std::min(num_rays, (block + 1) * block_size);
+                if (packets)
+                {
+                    std::vector<std::uint32_t> packet_hits[RayPacket::max_size];
+                    for (std::size_t i = block * block_size; i < end; i += RayPacket::max_size)
+                    {
+                        RayPacket packet(rays + i, end - i);
+                        detect_intersection_packet(packet, packet_hits);
+                        for (std::size_t k = 0; k < packet.size; ++k)
+                        {
+                            hits.insert(hits.end(), packet_hits[k].begin(), packet_hits[k].end());
+                            results.offsets[i + k + 1] = packet_hits[k].size();
+                            packet_hits[k].clear();
+                        }
+                    }
+                    continue;
+                }
+                for (std::size_t i = block * block_size; i < end; ++i)
+                {
+                    std::size_t before = hits.size();
+                    detect_intersection(rays[i], hits);
+                    results.offsets[i + 1] = hits.size() - before;
+                }
+            }
+#ifdef INTERSECTION_STATS
+            if (stats)
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats->merge(thread_query_stats());
+            }
+#endif
+        });
+
+        for (std::size_t i = 0; i < num_rays; ++i)
+            results.offsets[i + 1] += results.offsets[i];
+
+        results.hits.resize(results.offsets[num_rays]);
+#ifdef INTERSECTION_STATS
+        if (stats)
+        {
+            stats->queries += num_rays;
+            stats->hits += results.hits.size();
+        }
+#endif
+        pool.parallel_for(0, num_blocks, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t block = first; block < last; ++block)
+            {
+                std::copy(block_hits[block].begin(), block_hits[block].end(), 
+                    results.hits.begin() + results.offsets[block * block_size]);
+            }
+        });
     }
 
-    void detect_intersection(const Ray& ray,
-         const std::vector<Circle>& circles, std::vector<Circle> &results)
+    // every pair of circles whose discs overlap (touching is not enough),
+    // once, ordered by first. circles are the ones the index
+    // holds, by id. a window query on the box of each circle keeps the
+    // overlapping circles of larger id; blocks of circles fill buffers of their
+    // own on the pool, which are copied into pairs after a prefix sum. a
+    // cancelled control leaves the blocks not yet started empty.
+    void detect_overlaps(const std::vector<Circle> &circles, std::vector<OverlapPair> &pairs,
+        ThreadPool &pool, [[maybe_unused]] QueryStats *stats = nullptr, JobControl *control = nullptr) const
     {
-        m_kdtree_ptr->detect_intersection(ray, results);
+        struct OverlapVisitor : WindowVisitor
+        {
+            const std::vector<Circle>* circles;
+            std::vector<OverlapPair>* pairs;
+            std::uint32_t id;
+
+            bool on_circle(std::uint32_t other) override
+            {
+                if (other <= id || other >= circles->size()) return true;
+                const Circle& a = (*circles)[id];
+                const Circle& b = (*circles)[other];
+                double x = b.center.x - a.center.x, y = b.center.y - a.center.y;
+                double reach = a.radius + b.radius;
+                if (x * x + y * y < reach * reach) pairs->push_back(OverlapPair{id, other});
+                return true;
+            }
+        };
+
+        const std::size_t block_size = 256;
+        std::size_t num_circles = circles.size();
+        std::size_t num_blocks = (num_circles + block_size - 1) / block_size;
+        std::vector<std::vector<OverlapPair>> block_pairs(num_blocks);
+        if (control) control->set_total(num_blocks);
+
+#ifdef INTERSECTION_STATS
+        std::mutex stats_mutex;
+#endif
+        pool.parallel_for(0, num_blocks, 1, [&](std::size_t first, std::size_t last) {
+            INTERSECTION_STAT(thread_query_stats() = QueryStats());
+            OverlapVisitor visitor;
+            visitor.circles = &circles;
+            for (std::size_t block = first; block < last; ++block)
+            {
+                if (control)
+                {
+                    if (control->cancelled()) break;
+                    control->advance();
+                }
+                visitor.pairs = &block_pairs[block];
+                std::size_t end = std::min(num_circles, (block + 1) * block_size);
+                for (std::size_t i = block * block_size; i < end; ++i)
+                {
+                    visitor.id = std::uint32_t(i);
+                    query_window(BBox::of(circles[i]), visitor);
+                }
+            }
+#ifdef INTERSECTION_STATS
+            if (stats)
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats->merge(thread_query_stats());
+            }
+#endif
+        });
+
+        std::vector<std::size_t> offsets(num_blocks + 1, 0);
+        for (std::size_t block = 0; block < num_blocks; ++block)
+            offsets[block + 1] = offsets[block] + block_pairs[block].size();
+
+        pairs.resize(offsets[num_blocks]);
+#ifdef INTERSECTION_STATS
+        if (stats)
+        {
+            stats->queries += num_circles;
+            stats->hits += pairs.size();
+        }
+#endif
+        pool.parallel_for(0, num_blocks, 1, [&](std::size_t first, std::size_t last) {
+            for (std::size_t block = first; block < last; ++block)
+                std::copy(block_pairs[block].begin(), block_pairs[block].end(), pairs.begin() + offsets[block]);
+        });
     }
 
+    // the closest hit of every ray of the fan, on the pool in blocks of
+    // neighboring rays, which lie in a narrow wedge. the middle ray of a block
+    // is cast first; the circles within twice its distance of the origin that
+    // reach into the wedge are then gathered with one capsule query, and every
+    // ray of the block is tested against them alone. a ray that hits none of
+    // them within that distance is cast on its own. circles are the ones the
+    // index holds, by id. returns the number of visited nodes.
+    std::size_t cast_fan(const RayFan &fan, const std::vector<Circle> &circles, VisibilityPolygon &polygon,
+        ThreadPool &pool, [[maybe_unused]] QueryStats *stats = nullptr) const
+    {
+        struct Collector : CircleVisitor
+        {
+            std::vector<std::uint32_t> ids;
+            std::vector<Circle> found;
+
+            bool on_circle(std::uint32_t id, double cx, double cy, double radius) override 
+            { 
+                ids.push_back(id);
+                found.push_back(Circle(Point(cx, cy), radius));
+                return true; 
+            }
+        };
+
+        const std::size_t block_size = 32;
+        const double max_wedge = 0.25; // radians; wider blocks cast every ray on its own
+        std::size_t num_blocks = (fan.count + block_size - 1) / block_size;
+        std::vector<std::size_t> block_visited(num_blocks, 0);
+        polygon.origin = fan.origin;
+        polygon.distances.resize(fan.count);
+        polygon.ids.resize(fan.count);
+        polygon.vertices.resize(fan.count);
+
+#ifdef INTERSECTION_STATS
+        std::mutex stats_mutex;
+#endif
+        pool.parallel_for(0, num_blocks, 1, [&](std::size_t first, std::size_t last) {
+            INTERSECTION_STAT(thread_query_stats() = QueryStats());
+            Collector collector;
+            CircleBuckets candidates;
+            for (std::size_t block = first; block < last; ++block)
+            {
+                std::size_t begin = block * block_size;
+                std::size_t end = std::min(fan.count, begin + block_size);
+                std::size_t& visited = block_visited[block];
+
+                // the wedge of the block, up to twice the distance of its middle
+                // ray and as wide as the ray farthest from it
+                std::size_t mid = begin + (end - begin) / 2;
+                double reach = 0.0, half_wedge = std::max(std::abs(fan.angle(mid) - fan.angle(begin)), 
+                    std::abs(fan.angle(end - 1) - fan.angle(mid)));
+                Ray middle = fan.ray(mid);
+                RayHit probe;
+                if (end - begin > 2 && half_wedge <= 0.5 * max_wedge)
+                {
+                    visited += closest_hit(RayRange(middle, 0.0, fan.max_distance), probe);
+                    if (probe.valid()) reach = std::min(fan.max_distance, 2.0 * probe.t);
+                }
+                candidates.clear();
+                if (reach > 0.0)
+                {
+                    collector.ids.clear();
+                    collector.found.clear();
+                    Segment axis(middle.origin, middle.origin + middle.direction * reach);
+                    visited += query_capsule(axis, reach * std::sin(half_wedge), circles, collector);
+                    candidates.resize(collector.ids.size());
+                    for (std::size_t k = 0; k < collector.ids.size(); ++k)
+                        candidates.set(k, collector.found[k], collector.ids[k]);
+                }
+
+                std::uint32_t count = std::uint32_t(candidates.size());
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    Ray ray = fan.ray(i);
+                    RayRange range(ray, 0.0, reach);
+                    RayHit hit;
+                    double best = reach;
+                    for (std::uint32_t chunk = 0; chunk < count; chunk += 32)
+                        candidates.closest_in_leaf(range, chunk, std::min(32u, count - chunk), best, hit);
+                    if (hit.valid()) hit.t = best;
+                    else visited += closest_hit(RayRange(ray, 0.0, fan.max_distance), hit);
+
+                    double distance = hit.valid() ? hit.t : fan.max_distance;
+                    polygon.distances[i] = distance;
+                    polygon.ids[i] = hit.id;
+                    polygon.vertices[i] = ray.origin + ray.direction * distance;
+                }
+            }
+#ifdef INTERSECTION_STATS
+            if (stats)
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                stats->merge(thread_query_stats());
+            }
+#endif
+        });
+
+        std::size_t visited = 0;
+        for (std::size_t block = 0; block < num_blocks; ++block) visited += block_visited[block];
+#ifdef INTERSECTION_STATS
+        if (stats)
+        {
+            stats->queries += fan.count;
+            for (std::uint32_t id : polygon.ids) stats->hits += id != RayHit::null;
+        }
+#endif
+        return visited;
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
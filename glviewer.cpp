@@ -1,4 +1,5 @@
 #include <QtGui>
+#include <QScreen>
 #include "glviewer.h"
 
 GlViewer::GlViewer(QWidget *pParent)
@@ -9,6 +10,16 @@ GlViewer::GlViewer(QWidget *pParent)
 	m_scale = 0.5;
 
 	setAutoFillBackground(false);
+
+	// move events without a button pressed, for the hover queries
+	setMouseTracking(true);
+
+	// a frame of the display
+	qreal refresh_rate = QGuiApplication::primaryScreen() ? QGuiApplication::primaryScreen()->refreshRate() : 60.0;
+	m_frame_timer = new QTimer(this);
+	m_frame_timer->setInterval(int(1000.0 / std::max<qreal>(refresh_rate, 1.0)));
+	connect(m_frame_timer, SIGNAL(timeout()), this, SLOT(end_frame()));
+	m_hover_pending = false;
 }
 
 void GlViewer::set_scene(Scene *pScene)
@@ -44,6 +55,16 @@ void GlViewer::resizeGL(int w, int h)
 	
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
+
+	if (m_scene)
+		update_viewer_rect();
+}
+
+// half width and half height of the view at scale 1, as set up by resizeGL
+void GlViewer::view_extent(double& half_width, double& half_height)
+{
+	half_width = width() > height() ? double(width()) / double(height()) : 1.0;
+	half_height = width() > height() ? 1.0 : double(height()) / double(width());
 }
 
 void GlViewer::initializeGL()
@@ -78,25 +99,27 @@ void GlViewer::move_camera(const QPoint &p0, const QPoint &p1)
 
 void GlViewer::convert_to_world_space(const QPoint& qpoint, Point& ndc_point)
 {
-	double aspect_ratio = double(height()) / double(width());
+	double half_width, half_height;
+	view_extent(half_width, half_height);
 
 	double x = double(qpoint.x()) / double(width());
-	x = (2.0 * x - 1.0) / m_scale;
+	x = (2.0 * x - 1.0) * half_width / m_scale;
 	x += m_center_x;
 	ndc_point.x = x;
 
 	double y = 1.0 - double(qpoint.y()) / double(height());
-	y = (2.0 * y - 1.0) * aspect_ratio / m_scale;
+	y = (2.0 * y - 1.0) * half_height / m_scale;
 	y += m_center_y;
 	ndc_point.y=y;
 }
                
 void GlViewer::convert_to_screen_space(const Point& ndc_point, QPoint& qpoint)
 {
-	double aspect_ratio = double(height()) / double(width());
+	double half_width, half_height;
+	view_extent(half_width, half_height);
 
-    double x = (ndc_point.x - m_center_x) * m_scale;
-    double y = (ndc_point.y - m_center_y) * m_scale / aspect_ratio;
+    double x = (ndc_point.x - m_center_x) * m_scale / half_width;
+    double y = (ndc_point.y - m_center_y) * m_scale / half_height;
 
     x = (x + 1.0) / 2.0;
     y = (1.0 - y) / 2.0;
@@ -117,6 +140,7 @@ void GlViewer::update_viewer_rect()
 	convert_to_world_space(qviewer_top_right, viewer_top_right);
 
 	m_scene->set_viewer_rect(BBox(viewer_bottom_left, viewer_top_right));
+	m_scene->set_pixel_size((viewer_top_right.x - viewer_bottom_left.x) / double(std::max(1, width())));
 }
 
 void GlViewer::wheelEvent(QWheelEvent *event)
@@ -146,14 +170,51 @@ void GlViewer::mouseMoveEvent(QMouseEvent *event)
 		return;
 	}
     
+	// hover: the scene looks up the circles nearest to the mouse and follows
+	// it with the tracked ray, once a frame
+	if (event->buttons() == Qt::NoButton)
+	{
+		if (m_frame_timer->isActive())
+		{
+			m_hover_pos = event->pos();
+			m_hover_pending = true;
+			return;
+		}
+		hover(event->pos());
+		m_frame_timer->start();
+		return;
+	}
+
 	m_mouse_move = event->pos();
 
 	move_camera(m_mouse_click, m_mouse_move);
 	m_mouse_click = m_mouse_move;
+	update_viewer_rect();
 
 	updateGL();
 }
 
+void GlViewer::hover(const QPoint &point)
+{
+	sample_mouse_path(point);
+	updateGL();
+	emit hovered();
+}
+
+// the moves that came within the frame are handled by the last of them; with
+// none the timer stops, and the next move is handled at once
+void GlViewer::end_frame()
+{
+	if (!m_hover_pending)
+	{
+		m_frame_timer->stop();
+		return;
+	}
+	m_hover_pending = false;
+	if (m_scene)
+		hover(m_hover_pos);
+}
+
 void GlViewer::mousePressEvent(QMouseEvent *event)
 {
 	if (!m_scene)
@@ -3,6 +3,7 @@
 
 #include <QGLWidget>
 #include <QPaintEvent>
+#include <QTimer>
 #include "scene.h"
 
 
@@ -19,6 +20,12 @@ private:
 
     // mouse
     QPoint m_mouse_click, m_mouse_move;
+
+    // moves without a button are handled at most once a frame: the first at
+    // once, and the last of those that come within the frame when it ends
+    QTimer* m_frame_timer;
+    QPoint m_hover_pos;
+    bool m_hover_pending;
     
 
 public:
@@ -40,6 +47,8 @@ protected:
     void resizeGL(int width, int height);
 
     void move_camera(const QPoint& p0, const QPoint& p1);
+    void view_extent(double& half_width, double& half_height);
+    void hover(const QPoint& point);
     void convert_to_world_space(const QPoint& qpoint, Point& ndc_point);
     void convert_to_screen_space(const Point& ndc_point, QPoint& qpoint);
     void sample_mouse_path(const QPoint& point);
@@ -52,6 +61,13 @@ protected:
 
     // viewer port
     void update_viewer_rect();
+
+private slots:
+    void end_frame();
+
+signals:
+    // the scene has handled a move of the mouse
+    void hovered();
 };
 
 #endif
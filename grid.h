@@ -0,0 +1,424 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "geometric.h"
+
+// uniform grid
+// suits scenes of circles of similar radius spread over a bounded area. each
+// circle is referenced from every cell its box overlaps and the references
+// are counting-sorted by cell, so the build is linear. the circles of a cell
+// are stored contiguously as a bucket; a ray walks the cells it crosses in
+// order with a 2D DDA (Amanatides and Woo).
+class Grid : public SpatialIndex
+{
+public:
+    // aimed number of circle centers per cell
+    static constexpr double circles_per_cell = 4.0;
+
+private:
+    BBox m_bounds;
+    double m_cell_size = 1.0;
+    double m_inv_cell_size = 1.0;
+    std::uint32_t m_cells_x = 0, m_cells_y = 0;
+    std::vector<std::uint32_t> m_cell_start; // references of cell c: [m_cell_start[c], m_cell_start[c + 1])
+    CircleBuckets m_circles;                  // one entry per reference
+    std::size_t m_size = 0;
+
+    std::uint32_t cell_x(double x) const
+    {
+        double cx = std::floor((x - m_bounds.bottom_left.x) * m_inv_cell_size);
+        return static_cast<std::uint32_t>(std::min(std::max(cx, 0.0), double(m_cells_x - 1)));
+    }
+
+    std::uint32_t cell_y(double y) const
+    {
+        double cy = std::floor((y - m_bounds.bottom_left.y) * m_inv_cell_size);
+        return static_cast<std::uint32_t>(std::min(std::max(cy, 0.0), double(m_cells_y - 1)));
+    }
+
+    // a circle referenced from several cells must be reported once per query.
+    // every query takes a new stamp and marks the circles it reports with it;
+    // the marks are per thread, so concurrent queries do not interfere.
+    static std::uint32_t next_stamp(std::size_t num_circles)
+    {
+        std::vector<std::uint32_t>& marks = stamps();
+        std::uint32_t& stamp = current_stamp();
+        if (marks.size() < num_circles) marks.resize(num_circles, 0);
+        if (++stamp == 0)
+        {
+            std::fill(marks.begin(), marks.end(), 0);
+            stamp = 1;
+        }
+        return stamp;
+    }
+
+    static std::vector<std::uint32_t>& stamps()
+    {
+        static thread_local std::vector<std::uint32_t> marks;
+        return marks;
+    }
+
+    static std::uint32_t& current_stamp()
+    {
+        static thread_local std::uint32_t stamp = 0;
+        return stamp;
+    }
+
+    // walks the cells the ray crosses within its range, near to far. calls
+    // on_cell(first, count, texit) for each cell, with its references and the
+    // parameter where the ray leaves it; stops when on_cell returns false.
+    // returns the number of visited cells.
+    template <class F>
+    std::size_t walk(const RayRange &range, F &&on_cell) const
+    {
+        std::size_t visited = 0;
+        if (m_cell_start.empty()) return visited;
+
+        const Ray& ray = range.ray;
+        double t0, t1;
+        if (!ray_bbox_interval(range, m_bounds, range.tmin, range.tmax, t0, t1)) return visited;
+
+        Point start = ray.origin + ray.direction * t0;
+        std::uint32_t ix = cell_x(start.x), iy = cell_y(start.y);
+
+        const double inf = std::numeric_limits<double>::infinity();
+        int step_x = 0, step_y = 0;
+        double next_x = inf, next_y = inf, delta_x = inf, delta_y = inf;
+        if (ray.direction.x != 0.0)
+        {
+            step_x = ray.direction.x > 0.0 ? 1 : -1;
+            double boundary = m_bounds.bottom_left.x + (ix + (step_x > 0 ? 1 : 0)) * m_cell_size;
+            next_x = (boundary - ray.origin.x) * range.inv_direction.x;
+            delta_x = m_cell_size * std::abs(range.inv_direction.x);
+        }
+        if (ray.direction.y != 0.0)
+        {
+            step_y = ray.direction.y > 0.0 ? 1 : -1;
+            double boundary = m_bounds.bottom_left.y + (iy + (step_y > 0 ? 1 : 0)) * m_cell_size;
+            next_y = (boundary - ray.origin.y) * range.inv_direction.y;
+            delta_y = m_cell_size * std::abs(range.inv_direction.y);
+        }
+
+        while (true)
+        {
+            std::uint32_t cell = iy * m_cells_x + ix;
+            double texit = std::min(next_x, next_y);
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            std::uint32_t first = m_cell_start[cell];
+            std::uint32_t count = m_cell_start[cell + 1] - first;
+            if (count && !on_cell(first, count, texit)) break;
+            if (texit >= t1) break;
+
+            if (next_x < next_y)
+            {
+                if ((step_x < 0 && ix == 0) || (step_x > 0 && ix + 1 == m_cells_x)) break;
+                ix += step_x;
+                next_x += delta_x;
+            }
+            else
+            {
+                if ((step_y < 0 && iy == 0) || (step_y > 0 && iy + 1 == m_cells_y)) break;
+                iy += step_y;
+                next_y += delta_y;
+            }
+        }
+
+        return visited;
+    }
+
+    // calls on_hit(index) once for every circle hit by the ray within its range
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const
+    {
+        std::uint32_t stamp = next_stamp(m_size);
+        std::uint32_t* marks = stamps().data();
+
+        return walk(range, [&](std::uint32_t first, std::uint32_t count, double) {
+            // buckets are tested 32 circles at a time, the width of the mask
+            for (std::uint32_t chunk = first; chunk < first + count; chunk += 32)
+            {
+                std::uint32_t mask = m_circles.intersect(range, chunk, std::min(32u, first + count - chunk));
+                while (mask)
+                {
+                    std::uint32_t index = chunk + lowest_bit(mask);
+                    mask &= mask - 1;
+                    std::uint32_t id = m_circles.ids[index];
+                    if (marks[id] == stamp) continue;
+                    marks[id] = stamp;
+                    if (!call_on_hit(on_hit, index)) return false;
+                }
+            }
+            return true;
+        });
+    }
+
+public:
+    Grid() {}
+
+    const char* name() const override { return "grid"; }
+
+    void clear() override
+    {
+        m_cell_start.clear();
+        m_circles.clear();
+        m_cells_x = m_cells_y = 0;
+        m_size = 0;
+    }
+
+    std::size_t size() const override { return m_size; }
+    std::size_t cell_count() const { return m_cell_start.empty() ? 0 : m_cell_start.size() - 1; }
+    double cell_size() const { return m_cell_size; }
+
+    std::size_t memory_bytes() const override
+    {
+        return m_cell_start.capacity() * sizeof(std::uint32_t) + m_circles.memory_bytes();
+    }
+
+    // the cell size follows from the density: a square cell holds about
+    // circles_per_cell centers on average, but is never smaller than the
+    // largest diameter, so no circle is referenced from more than 4 cells.
+    // the build is serial.
+    BuildInfo build(const std::vector<Circle>& circles, BBox, ThreadPool* = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        if (circles.empty()) return BuildInfo();
+
+        BuildInfo info;
+        PhaseTimer timer(info.phases);
+
+        std::size_t n = circles.size();
+        m_size = n;
+
+        m_bounds = BBox::empty();
+        double max_radius = 0.0;
+        for (const Circle& circle : circles)
+        {
+            m_bounds.extend(BBox::of(circle));
+            max_radius = std::max(max_radius, circle.radius);
+        }
+
+        double width = m_bounds.top_right.x - m_bounds.bottom_left.x;
+        double height = m_bounds.top_right.y - m_bounds.bottom_left.y;
+        m_cell_size = std::max(std::sqrt(width * height * circles_per_cell / n), 2.0 * max_radius);
+        if (!(m_cell_size > 0.0)) m_cell_size = std::max({width, height, 1.0});
+        m_inv_cell_size = 1.0 / m_cell_size;
+        m_cells_x = static_cast<std::uint32_t>(std::max(1.0, std::ceil(width * m_inv_cell_size)));
+        m_cells_y = static_cast<std::uint32_t>(std::max(1.0, std::ceil(height * m_inv_cell_size)));
+
+        timer.lap("bounds");
+
+        // counting sort of the references by cell
+        std::size_t num_cells = std::size_t(m_cells_x) * m_cells_y;
+        m_cell_start.assign(num_cells + 1, 0);
+        for (const Circle& circle : circles)
+        {
+            BBox box = BBox::of(circle);
+            std::uint32_t x0 = cell_x(box.bottom_left.x), x1 = cell_x(box.top_right.x);
+            std::uint32_t y0 = cell_y(box.bottom_left.y), y1 = cell_y(box.top_right.y);
+            for (std::uint32_t y = y0; y <= y1; ++y)
+                for (std::uint32_t x = x0; x <= x1; ++x)
+                    m_cell_start[y * m_cells_x + x + 1]++;
+        }
+        for (std::size_t c = 0; c < num_cells; ++c)
+            m_cell_start[c + 1] += m_cell_start[c];
+        timer.lap("count");
+
+        m_circles.resize(m_cell_start[num_cells]);
+        std::vector<std::uint32_t> fill(m_cell_start.begin(), m_cell_start.end() - 1);
+        const std::size_t step = std::size_t(1) << 14; // circles between checks of control
+        for (std::size_t first = 0; first < n; first += step)
+        {
+            if (control && control->cancelled())
+            {
+                clear();
+                return BuildInfo();
+            }
+            std::size_t last = std::min(n, first + step);
+            for (std::size_t i = first; i < last; ++i)
+            {
+                BBox box = BBox::of(circles[i]);
+                std::uint32_t x0 = cell_x(box.bottom_left.x), x1 = cell_x(box.top_right.x);
+                std::uint32_t y0 = cell_y(box.bottom_left.y), y1 = cell_y(box.top_right.y);
+                for (std::uint32_t y = y0; y <= y1; ++y)
+                    for (std::uint32_t x = x0; x <= x1; ++x)
+                        m_circles.set(fill[y * m_cells_x + x]++, circles[i], static_cast<std::uint32_t>(i));
+            }
+            if (control) control->advance(last - first);
+        }
+        timer.lap("fill");
+
+        info.nodes = num_cells;
+        info.depth = 1;
+        return info;
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { results.push_back(m_circles.circle(index)); });
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { ids.push_back(m_circles.ids[index]); });
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { return visitor.on_hit(m_circles.ids[index]); });
+    }
+
+    // the cells the window covers, each circle reported once
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double = 0.0) const override
+    {
+        std::size_t visited = 0;
+        if (m_cell_start.empty() || !m_bounds.overlaps(window)) return visited;
+
+        std::uint32_t stamp = next_stamp(m_size);
+        std::uint32_t* marks = stamps().data();
+        std::uint32_t x0 = cell_x(window.bottom_left.x), x1 = cell_x(window.top_right.x);
+        std::uint32_t y0 = cell_y(window.bottom_left.y), y1 = cell_y(window.top_right.y);
+        for (std::uint32_t iy = y0; iy <= y1; ++iy)
+        for (std::uint32_t ix = x0; ix <= x1; ++ix)
+        {
+            std::uint32_t cell = iy * m_cells_x + ix;
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+            for (std::uint32_t i = m_cell_start[cell]; i < m_cell_start[cell + 1]; ++i)
+            {
+                std::uint32_t id = m_circles.ids[i];
+                if (marks[id] == stamp) continue;
+                marks[id] = stamp;
+                if (window.overlaps_circle(m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]) 
+                    && !visitor.on_circle(id))
+                    return visited;
+            }
+        }
+        return visited;
+    }
+
+    // the cells along the segment, a row at a time: the part of the segment
+    // within margin of the row spans an interval of x, widened by margin
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        std::size_t visited = 0;
+        const Point& a = segment.origin;
+        const Point& b = segment.destination;
+        BBox box = BBox(Point(std::min(a.x, b.x), std::min(a.y, b.y)), 
+            Point(std::max(a.x, b.x), std::max(a.y, b.y))).expanded(margin);
+        if (m_cell_start.empty() || !m_bounds.overlaps(box)) return visited;
+
+        Capsule capsule(segment, margin);
+        std::uint32_t stamp = next_stamp(m_size);
+        std::uint32_t* marks = stamps().data();
+        double dx = b.x - a.x, dy = b.y - a.y;
+        std::uint32_t y0 = cell_y(box.bottom_left.y), y1 = cell_y(box.top_right.y);
+        for (std::uint32_t iy = y0; iy <= y1; ++iy)
+        {
+            double low = m_bounds.bottom_left.y + iy * m_cell_size - margin;
+            double high = low + m_cell_size + 2.0 * margin;
+            double t0 = 0.0, t1 = 1.0;
+            if (dy != 0.0)
+            {
+                double ta = (low - a.y) / dy, tb = (high - a.y) / dy;
+                t0 = std::max(t0, std::min(ta, tb));
+                t1 = std::min(t1, std::max(ta, tb));
+                if (t0 > t1) continue;
+            }
+            else if (a.y < low || a.y > high) continue;
+
+            double xa = a.x + dx * t0, xb = a.x + dx * t1;
+            std::uint32_t x0 = cell_x(std::min(xa, xb) - margin), x1 = cell_x(std::max(xa, xb) + margin);
+            for (std::uint32_t ix = x0; ix <= x1; ++ix)
+            {
+                std::uint32_t cell = iy * m_cells_x + ix;
+                visited++;
+                INTERSECTION_STAT(thread_query_stats().nodes++);
+                for (std::uint32_t i = m_cell_start[cell]; i < m_cell_start[cell + 1]; ++i)
+                {
+                    std::uint32_t id = m_circles.ids[i];
+                    if (marks[id] == stamp) continue;
+                    marks[id] = stamp;
+                    if (capsule.reaches(m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]) 
+                        && !visitor.on_circle(id, m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]))
+                        return visited;
+                }
+            }
+        }
+        return visited;
+    }
+
+    // rings of cells around the cell of the point, until a whole ring is
+    // beyond the bound. a circle is referenced from every cell its box
+    // overlaps, so the cell holding its point nearest to the query is reached.
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        std::size_t visited = 0;
+        if (m_cell_start.empty()) return visited;
+
+        std::uint32_t stamp = next_stamp(m_size);
+        std::uint32_t* marks = stamps().data();
+        long cx = cell_x(point.x), cy = cell_y(point.y);
+        long max_ring = std::max(std::max(cx, long(m_cells_x) - 1 - cx), std::max(cy, long(m_cells_y) - 1 - cy));
+
+        for (long ring = 0; ring <= max_ring; ++ring)
+        {
+            bool near = false;
+            for (long iy = cy - ring; iy <= cy + ring; ++iy)
+            {
+                if (iy < 0 || iy >= long(m_cells_y)) continue;
+                // inner rows only have the two cells on the ring
+                long step = (iy == cy - ring || iy == cy + ring) ? 1 : std::max(1L, 2 * ring);
+                for (long ix = cx - ring; ix <= cx + ring; ix += step)
+                {
+                    if (ix < 0 || ix >= long(m_cells_x)) continue;
+                    BBox cell(Point(m_bounds.bottom_left.x + ix * m_cell_size, m_bounds.bottom_left.y + iy * m_cell_size),
+                        Point(m_bounds.bottom_left.x + (ix + 1) * m_cell_size, m_bounds.bottom_left.y + (iy + 1) * m_cell_size));
+                    if (cell.distance(point) > heap.bound()) continue;
+                    near = true;
+                    visited++;
+                    INTERSECTION_STAT(thread_query_stats().nodes++);
+
+                    std::uint32_t c = std::uint32_t(iy) * m_cells_x + std::uint32_t(ix);
+                    for (std::uint32_t i = m_cell_start[c]; i < m_cell_start[c + 1]; ++i)
+                    {
+                        std::uint32_t id = m_circles.ids[i];
+                        if (marks[id] == stamp) continue;
+                        marks[id] = stamp;
+                        heap.offer_circle(id, point, m_circles.cx[i], m_circles.cy[i], m_circles.radius[i]);
+                    }
+                }
+            }
+            if (!near && ring > 0) break;
+        }
+        return visited;
+    }
+
+    // closest hit: the walk stops at the first cell the ray leaves after the
+    // best hit so far, since a circle hit earlier is referenced from a cell
+    // the ray crosses before that point
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        const Ray& ray = range.ray;
+        hit = RayHit();
+        double best = range.tmax;
+
+        std::size_t visited = walk(range, [&](std::uint32_t first, std::uint32_t count, double texit) {
+            for (std::uint32_t chunk = first; chunk < first + count; chunk += 32)
+                m_circles.closest_in_leaf(range, chunk, std::min(32u, first + count - chunk), best, hit);
+            return !(hit.valid() && best <= texit);
+        });
+
+        if (hit.valid())
+        {
+            hit.t = best;
+            hit.point = ray.origin + ray.direction * best;
+        }
+        return visited;
+    }
+};
+
+#endif
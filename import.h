@@ -0,0 +1,307 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "chunked_index.h"
+#include "snapshot.h"
+
+// streaming import of circle sets from files too large to read at once
+// two formats, told apart by the extension:
+//   .bin          packed little-endian IEEE double triples x, y, r; a
+//                 big-endian host swaps the bytes as it reads them
+//   anything else text, one circle per line: x, y and r separated by commas,
+//                 semicolons or white space; lines that do not start with
+//                 three numbers (headers, comments) are skipped and counted
+// the file is read in blocks into one reused buffer. a block is cut at line
+// ends into a piece per thread and the pieces are parsed in parallel, each into
+// its own reused vector; the circles are handed on in file order. circles with
+// a negative or non-finite radius or center are skipped.
+
+enum class ImportFormat { text, binary };
+
+struct ImportStats
+{
+    std::size_t bytes = 0;
+    std::size_t lines = 0;   // text only
+    std::size_t circles = 0; // handed on
+    std::size_t skipped = 0; // lines or records
+    std::size_t blocks = 0;
+    std::size_t chunks = 0;  // sub-indexes built by import_chunked
+};
+
+inline ImportFormat import_format(const std::string& path)
+{
+    std::size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) return ImportFormat::text;
+    std::string ext = path.substr(dot + 1);
+    for (char& c : ext) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return ext == "bin" ? ImportFormat::binary : ImportFormat::text;
+}
+
+inline bool import_valid(const Circle& circle)
+{
+    return std::isfinite(circle.center.x) && std::isfinite(circle.center.y)
+        && std::isfinite(circle.radius) && circle.radius >= 0.0;
+}
+
+namespace import_detail
+{
+    inline bool is_separator(char c) { return c == ',' || c == ';' || c == ' ' || c == '\t'; }
+
+    // parses the lines in [first, last), which ends at a line end or the end
+    // of the file; returns the number of lines
+    inline std::size_t parse_lines(const char* first, const char* last,
+        std::vector<Circle>& circles, std::size_t& skipped)
+    {
+        std::size_t lines = 0;
+        const char* p = first;
+        while (p < last)
+        {
+            const char* end = static_cast<const char*>(std::memchr(p, '\n', last - p));
+            if (!end) end = last;
+            const char* q = p;
+            const char* line_end = end > p && end[-1] == '\r' ? end - 1 : end;
+            ++lines;
+
+            double v[3];
+            int n = 0;
+            while (n < 3)
+            {
+                while (q < line_end && is_separator(*q)) ++q;
+                std::from_chars_result r = std::from_chars(q, line_end, v[n]);
+                if (r.ec != std::errc()) break;
+                q = r.ptr;
+                ++n;
+            }
+
+            if (n == 3)
+            {
+                Circle circle(Point(v[0], v[1]), v[2]);
+                if (import_valid(circle)) circles.push_back(circle);
+                else ++skipped;
+            }
+            else
+            {
+                // blank lines are not counted, lines of one or two numbers are
+                while (q < line_end && is_separator(*q)) ++q;
+                if (n > 0 || q < line_end) ++skipped;
+            }
+            p = end + 1;
+        }
+        return lines;
+    }
+
+    inline bool little_endian_host()
+    {
+        const std::uint32_t one = 1;
+        unsigned char first;
+        std::memcpy(&first, &one, 1);
+        return first == 1;
+    }
+
+    // turns little-endian doubles into host ones on a big-endian host
+    inline void swap_doubles(Circle* circles, std::size_t n)
+    {
+        unsigned char* bytes = reinterpret_cast<unsigned char*>(circles);
+        for (std::size_t i = 0; i < n * sizeof(Circle); i += sizeof(double))
+            std::reverse(bytes + i, bytes + i + sizeof(double));
+    }
+}
+
+// streams the circles of a file to sink, a block at a time. returns false and
+// sets error when the file cannot be read or a binary file ends in a partial
+// record; the circles of the blocks before have been handed on by then.
+inline bool read_circles(const std::string& path,
+    const std::function<void(const Circle*, std::size_t)>& sink,
+    ThreadPool* pool = nullptr, ImportStats* stats = nullptr, std::string* error = nullptr,
+    std::size_t block_size = std::size_t(16) << 20)
+{
+    ImportStats local;
+    ImportStats& st = stats ? *stats : local;
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        if (error) *error = "cannot open " + path;
+        return false;
+    }
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> guard(file, &std::fclose);
+    block_size = std::max<std::size_t>(block_size, 4096);
+
+    if (import_format(path) == ImportFormat::binary)
+    {
+        static_assert(sizeof(Circle) == 3 * sizeof(double), "Circle must be three packed doubles");
+
+        std::vector<Circle> block(block_size / sizeof(Circle));
+        const bool swap = !import_detail::little_endian_host();
+        std::size_t kept = 0;
+        for (;;)
+        {
+            std::size_t n = std::fread(block.data(), 1, block.size() * sizeof(Circle), file);
+            st.bytes += n;
+            if (n % sizeof(Circle))
+            {
+                if (error) *error = path + " ends in a partial record";
+                return false;
+            }
+            n /= sizeof(Circle);
+            if (n == 0) break;
+            ++st.blocks;
+            if (swap) import_detail::swap_doubles(block.data(), n);
+
+            kept = 0;
+            for (std::size_t i = 0; i < n; ++i)
+                if (import_valid(block[i])) block[kept++] = block[i];
+            st.skipped += n - kept;
+            st.circles += kept;
+            if (kept) sink(block.data(), kept);
+        }
+        if (std::ferror(file))
+        {
+            if (error) *error = "cannot read " + path;
+            return false;
+        }
+        return true;
+    }
+
+    std::size_t pieces = pool ? pool->size() : 1;
+    std::vector<std::vector<Circle>> parsed(pieces);
+    std::vector<std::size_t> skipped(pieces), lines(pieces);
+    std::vector<const char*> cuts(pieces + 1);
+
+    std::vector<char> buffer(block_size);
+    std::size_t filled = 0;
+    bool eof = false;
+    while (!eof)
+    {
+        if (filled == buffer.size()) buffer.resize(2 * buffer.size()); // a line longer than a block
+        std::size_t n = std::fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+        st.bytes += n;
+        filled += n;
+        eof = filled < buffer.size();
+        if (eof && std::ferror(file))
+        {
+            if (error) *error = "cannot read " + path;
+            return false;
+        }
+
+        // the block ends after the last line end; the rest waits for the next read
+        const char* begin = buffer.data();
+        const char* end = begin + filled;
+        if (!eof)
+        {
+            while (end > begin && end[-1] != '\n') --end;
+            if (end == begin) continue;
+        }
+        if (end == begin) break;
+        ++st.blocks;
+
+        // pieces of about the same size, moved forward to the next line start
+        cuts[0] = begin;
+        cuts[pieces] = end;
+        for (std::size_t k = 1; k < pieces; ++k)
+        {
+            const char* cut = std::max(cuts[k - 1], begin + (end - begin) * k / pieces);
+            while (cut < end && cut > begin && cut[-1] != '\n') ++cut;
+            cuts[k] = cut;
+        }
+
+        auto parse = [&](std::size_t first, std::size_t last)
+        {
+            for (std::size_t k = first; k < last; ++k)
+            {
+                parsed[k].clear();
+                skipped[k] = 0;
+                lines[k] = import_detail::parse_lines(cuts[k], cuts[k + 1], parsed[k], skipped[k]);
+            }
+        };
+        if (pool && pieces > 1) pool->parallel_for(0, pieces, 1, parse);
+        else parse(0, pieces);
+
+        for (std::size_t k = 0; k < pieces; ++k)
+        {
+            st.lines += lines[k];
+            st.skipped += skipped[k];
+            st.circles += parsed[k].size();
+            if (!parsed[k].empty()) sink(parsed[k].data(), parsed[k].size());
+        }
+
+        std::size_t rest = buffer.data() + filled - end;
+        std::memmove(buffer.data(), end, rest);
+        filled = rest;
+    }
+    return true;
+}
+
+// appends the circles of a file
+inline bool import_circles(const std::string& path, std::vector<Circle>& circles,
+    ThreadPool* pool = nullptr, ImportStats* stats = nullptr, std::string* error = nullptr)
+{
+    return read_circles(path, [&circles](const Circle* first, std::size_t n)
+        { circles.insert(circles.end(), first, first + n); }, pool, stats, error);
+}
+
+// indexes a file a chunk of index.chunk_size() circles at a time, so no more
+// than one chunk is held besides the sub-indexes. with a spill directory every
+// chunk is written there as a kd-tree snapshot and mapped back, which leaves
+// the paging of the sub-indexes to the system. circles, if given, gets all of
+// them, e.g. for drawing.
+inline bool import_chunked(const std::string& path, ChunkedIndex& index,
+    std::vector<Circle>* circles = nullptr, const std::string& spill_dir = std::string(),
+    ThreadPool* pool = nullptr, ImportStats* stats = nullptr, std::string* error = nullptr)
+{
+    ImportStats local;
+    ImportStats& st = stats ? *stats : local;
+    index.clear();
+    std::vector<Circle> chunk;
+    chunk.reserve(index.chunk_size());
+    bool spill_ok = true;
+
+    auto flush = [&]
+    {
+        if (chunk.empty() || !spill_ok) return;
+        ++st.chunks;
+        if (spill_dir.empty())
+        {
+            index.append(chunk, pool);
+        }
+        else
+        {
+            KDTree tree;
+            tree.build(chunk, BBox(), pool);
+            std::string file = spill_dir + "/chunk_" + std::to_string(st.chunks - 1) + ".snap";
+            std::unique_ptr<Snapshot> snapshot = std::make_unique<Snapshot>();
+            spill_ok = save_snapshot(file, chunk, tree, error)
+                && snapshot->open_file(file, false, error);
+            if (spill_ok) index.append(std::make_unique<SnapshotIndex>(std::move(snapshot)), chunk.size());
+        }
+        chunk.clear();
+    };
+
+    bool ok = read_circles(path, [&](const Circle* first, std::size_t n)
+    {
+        if (circles) circles->insert(circles->end(), first, first + n);
+        while (n)
+        {
+            std::size_t take = std::min(n, index.chunk_size() - chunk.size());
+            chunk.insert(chunk.end(), first, first + take);
+            first += take;
+            n -= take;
+            if (chunk.size() == index.chunk_size()) flush();
+        }
+    }, pool, &st, error);
+    if (ok) flush();
+    return ok && spill_ok;
+}
+
+#endif // IMPORT_H
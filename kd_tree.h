@@ -0,0 +1,757 @@
+#ifndef KD_TREE_H
+#define KD_TREE_H
+
+#include "geometric.h"
+
+// kd-tree
+// nodes are stored contiguously in pre-order: the left child of an inner node
+// is the next node in the array, the right child is referenced by index.
+// leaves hold buckets of up to KDTree::max_leaf_size circles.
+struct KDNode 
+{
+    BBox bbox;
+    double split;
+    std::uint32_t index; // inner node: right child, leaf: first circle
+    std::uint32_t flags; // bit 0: split axis, bits 1-31: circle count of a leaf
+
+    KDNode() : bbox(), split(0.0), index(0), flags(0) {}
+
+    static KDNode inner(const BBox& bbox, double split, int axis, std::uint32_t right)
+    {
+        KDNode node;
+        node.bbox = bbox;
+        node.split = split;
+        node.index = right;
+        node.flags = axis & 1;
+        return node;
+    }
+
+    static KDNode leaf(const BBox& bbox, std::uint32_t first, std::uint32_t count)
+    {
+        KDNode node;
+        node.bbox = bbox;
+        node.index = first;
+        node.flags = count << 1;
+        return node;
+    }
+
+    int axis() const { return flags & 1; }
+    bool is_leaf() const { return (flags >> 1) != 0; }
+    std::uint32_t count() const { return flags >> 1; }
+    std::uint32_t right() const { return index; }
+    std::uint32_t first() const { return index; }
+};
+
+// read-only kd-tree over arrays it does not own: the nodes in pre-order and
+// the circles of the leaves, padded as in CircleBuckets. KDTree queries
+// through a view of its own arrays, a snapshot through a view of a mapped file.
+struct KDTreeView
+{
+    const KDNode* nodes = nullptr;
+    std::size_t num_nodes = 0;
+    const double *cx = nullptr, *cy = nullptr, *r2 = nullptr, *radius = nullptr;
+    const std::uint32_t* ids = nullptr; // index of each circle in the build input
+    std::size_t num_circles = 0;
+
+    RayCircleKernel kernel = ray_circle_kernel();
+
+    Circle circle(std::uint32_t index) const 
+    { 
+        return Circle(Point(cx[index], cy[index]), radius[index]); 
+    }
+
+    // keeps the closest hit of the circles of a leaf in best and hit.id
+    void closest_in_leaf(const RayRange &range, std::uint32_t first, std::uint32_t count,
+        double &best, RayHit &hit) const
+    {
+        std::uint32_t mask = CircleBuckets::intersect(kernel, cx + first, cy + first, r2 + first, count, range);
+        while (mask)
+        {
+            std::uint32_t index = first + lowest_bit(mask);
+            mask &= mask - 1;
+            double t = CircleBuckets::hit_parameter(cx[index], cy[index], r2[index], range.ray, range.tmin);
+            if (t <= best && (t < best || !hit.valid()))
+            {
+                best = t;
+                hit.id = ids[index];
+            }
+        }
+    }
+
+    // calls on_hit(index) for every circle hit by the ray within its range, in
+    // depth-first order, where index is the circle's position in the leaf
+    // order; a bool on_hit ends the walk with false. subtrees whose box the
+    // range does not reach are skipped. returns the number of visited nodes.
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const 
+    {
+        std::size_t visited = 0;
+        if (!num_nodes) return visited;
+
+        // depth-first walk with an explicit stack of pending right children;
+        // the tree is median-balanced, so its height never exceeds 64
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+
+        while (true)
+        {
+            const KDNode& n = nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            // Check if ray intersects the bounding box of the current node
+            double tnear, tfar;
+            if (ray_bbox_interval(range, n.bbox, range.tmin, range.tmax, tnear, tfar)) 
+            {
+                if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    INTERSECTION_STAT(thread_query_stats().push(top));
+                    node = node + 1;
+                    continue;
+                }
+
+                // Check if ray intersects the circles of the leaf
+                std::uint32_t mask = CircleBuckets::intersect(kernel, cx + n.first(), cy + n.first(), 
+                    r2 + n.first(), n.count(), range);
+                while (mask)
+                {
+                    int i = lowest_bit(mask);
+                    mask &= mask - 1;
+                    if (!call_on_hit(on_hit, n.first() + i)) return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+
+        return visited;
+    }
+
+    // closest hit along the ray. children are visited near to far, by the
+    // parameter where the ray enters their boxes, or by its direction along
+    // the split axis when it starts in both; a subtree is skipped once its
+    // entry parameter is beyond the best hit so far. uses a fixed-size stack.
+    // returns the number of visited nodes.
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const
+    {
+        const Ray& ray = range.ray;
+        hit = RayHit();
+        std::size_t visited = 0;
+        if (!num_nodes) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            double tnear;
+        };
+        Entry stack[64];
+        int top = 0;
+
+        double best = range.tmax;
+        double tnear, tfar;
+        if (!ray_bbox_interval(range, nodes[0].bbox, range.tmin, best, tnear, tfar)) 
+            return visited;
+        stack[top++] = Entry{0, tnear};
+
+        while (top > 0)
+        {
+            Entry entry = stack[--top];
+            if (entry.tnear > best) continue;
+
+            const KDNode& n = nodes[entry.node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (n.is_leaf())
+            {
+                closest_in_leaf(range, n.first(), n.count(), best, hit);
+                continue;
+            }
+
+            // push the far child first so the near one is popped next
+            std::uint32_t near_child = entry.node + 1, far_child = n.right();
+            double direction = n.axis() == 0 ? ray.direction.x : ray.direction.y;
+            if (direction < 0.0) std::swap(near_child, far_child);
+
+            double near_tnear, far_tnear;
+            bool near_hit = ray_bbox_interval(range, nodes[near_child].bbox, range.tmin, best, near_tnear, tfar);
+            bool far_hit = ray_bbox_interval(range, nodes[far_child].bbox, range.tmin, best, far_tnear, tfar);
+            if (near_hit && far_hit && far_tnear < near_tnear)
+            {
+                std::swap(near_child, far_child);
+                std::swap(near_tnear, far_tnear);
+            }
+            if (far_hit) stack[top++] = Entry{far_child, far_tnear};
+            if (near_hit) stack[top++] = Entry{near_child, near_tnear};
+            INTERSECTION_STAT(thread_query_stats().push(top));
+        }
+
+        if (hit.valid())
+        {
+            hit.t = best;
+            hit.point = ray.origin + ray.direction * best;
+        }
+        return visited;
+    }
+
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const
+    {
+        if (!num_nodes) return 0;
+        return best_first_search(point, 0, nodes[0].bbox, heap, [&](std::uint32_t node, const BBox &, auto &&push) {
+            const KDNode& n = nodes[node];
+            if (n.is_leaf())
+            {
+                for (std::uint32_t i = n.first(); i < n.first() + n.count(); ++i)
+                    heap.offer_circle(ids[i], point, cx[i], cy[i], radius[i]);
+                return;
+            }
+            push(node + 1, nodes[node + 1].bbox);
+            push(n.right(), nodes[n.right()].bbox);
+        });
+    }
+
+    // nodes whose box grown by margin meets the segment are opened
+    std::size_t query_capsule(const Segment &segment, double margin, CircleVisitor &visitor) const
+    {
+        std::size_t visited = 0;
+        if (!num_nodes) return visited;
+
+        RayRange range(segment);
+        Capsule capsule(segment, margin);
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        double tnear, tfar;
+
+        while (true)
+        {
+            const KDNode& n = nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (ray_bbox_interval(range, n.bbox.expanded(margin), range.tmin, range.tmax, tnear, tfar))
+            {
+                if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    node = node + 1;
+                    continue;
+                }
+                for (std::uint32_t i = n.first(); i < n.first() + n.count(); ++i)
+                {
+                    if (capsule.reaches(cx[i], cy[i], radius[i]) 
+                        && !visitor.on_circle(ids[i], cx[i], cy[i], radius[i])) 
+                        return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+        return visited;
+    }
+
+    // circles of the subtree at node: the leaves of a subtree are consecutive
+    // in leaf order, from its leftmost to its rightmost leaf
+    std::size_t subtree_size(std::uint32_t node) const
+    {
+        std::uint32_t left = node, right = node;
+        while (!nodes[left].is_leaf()) left = left + 1;
+        while (!nodes[right].is_leaf()) right = nodes[right].right();
+        return nodes[right].first() + nodes[right].count() - nodes[left].first();
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const
+    {
+        std::size_t visited = 0;
+        if (!num_nodes) return visited;
+
+        std::uint32_t stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+
+        while (true)
+        {
+            const KDNode& n = nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            if (n.bbox.overlaps(window))
+            {
+                if (n.bbox.width() < detail && n.bbox.height() < detail)
+                {
+                    if (!visitor.on_cluster(n.bbox, subtree_size(node))) return visited;
+                }
+                else if (!n.is_leaf())
+                {
+                    stack[top++] = n.right();
+                    node = node + 1;
+                    continue;
+                }
+                else
+                {
+                    for (std::uint32_t i = n.first(); i < n.first() + n.count(); ++i)
+                        if (window.overlaps_circle(cx[i], cy[i], radius[i]) && !visitor.on_circle(ids[i])) 
+                            return visited;
+                }
+            }
+
+            if (top == 0) break;
+            node = stack[--top];
+        }
+        return visited;
+    }
+};
+
+class KDTree : public SpatialIndex
+{
+public:
+    static constexpr std::size_t max_leaf_size = 16;
+
+private:
+    std::vector<KDNode> m_nodes;
+    CircleBuckets m_circles;
+    KDTreeView m_view; // of the two above
+
+    void update_view()
+    {
+        m_view.nodes = m_nodes.data();
+        m_view.num_nodes = m_nodes.size();
+        m_view.cx = m_circles.cx.data();
+        m_view.cy = m_circles.cy.data();
+        m_view.r2 = m_circles.r2.data();
+        m_view.radius = m_circles.radius.data();
+        m_view.ids = m_circles.ids.data();
+        m_view.num_circles = m_circles.size();
+        m_view.kernel = m_circles.kernel;
+    }
+
+    PacketBBoxKernel m_packet_kernel = packet_bbox_kernel();
+
+public:
+    KDTree() {}
+
+    const char* name() const override { return "kd-tree"; }
+
+    void clear() override
+    { 
+        m_nodes.clear(); 
+        m_circles.clear();
+        update_view();
+    }
+
+    bool empty() const { return m_nodes.empty(); }
+    std::size_t size() const override { return m_circles.size(); }
+    std::size_t node_count() const { return m_nodes.size(); }
+
+    std::size_t memory_bytes() const override
+    {
+        return m_nodes.capacity() * sizeof(KDNode) + m_circles.memory_bytes();
+    }
+
+    // number of nodes of a subtree holding count circles
+    static std::size_t subtree_size(std::size_t count)
+    {
+        if (count <= max_leaf_size) return 1;
+        return 1 + subtree_size(count / 2) + subtree_size(count - count / 2);
+    }
+
+    // the circle stored at a position of the leaf order
+    Circle circle(std::uint32_t index) const { return m_circles.circle(index); }
+
+    // construct kd tree
+    // the items in items[first, last) are partitioned in place around their
+    // median; the node is written at pre-order position `node` and its subtree
+    // occupies the next subtree_size(last - first) slots. ranges of at most
+    // max_leaf_size circles become leaves, whose circles are sorted by id.
+    // the split axis alternates with the depth.
+    // each node is bounded by the tight box of all circles in its subtree,
+    // radii included.
+    // the tree depends only on the circles: the median is unique under the
+    // ordering below and leaves are sorted, so a parallel build produces the
+    // same tree as a serial one.
+    struct BuildItem
+    {
+        Point center;
+        std::uint32_t id;
+    };
+
+    struct BuildContext
+    {
+        const std::vector<Circle>& circles;
+        std::vector<BuildItem>& items;
+        std::vector<BuildItem>& scratch; // parallel selection only
+        ThreadPool* pool;
+        JobControl* control;
+    };
+
+    // subtrees of fewer circles are built serially
+    static constexpr std::size_t parallel_build_cutoff = std::size_t(1) << 14;
+    // ranges of fewer circles are partitioned serially
+    static constexpr std::size_t parallel_select_cutoff = std::size_t(1) << 17;
+
+    // quickselect whose partition steps run on the pool. the pivot is the
+    // median of evenly spaced samples; each chunk counts its items below and
+    // above the pivot, then scatters them into the scratch buffer, keeping
+    // the chunk order. ends with a serial nth_element once the range is small.
+    template <class Less>
+    static void parallel_select(BuildContext& ctx, std::size_t first, std::size_t nth, 
+        std::size_t last, const Less& less)
+    {
+        const std::size_t grain = parallel_build_cutoff;
+        std::vector<BuildItem>& items = ctx.items;
+        std::vector<BuildItem>& scratch = ctx.scratch;
+
+        while (last - first > parallel_select_cutoff)
+        {
+            const int num_samples = 63;
+            BuildItem samples[num_samples];
+            for (int k = 0; k < num_samples; ++k)
+                samples[k] = items[first + (last - first) * (2 * k + 1) / (2 * num_samples)];
+            std::nth_element(samples, samples + num_samples / 2, samples + num_samples, less);
+            const BuildItem pivot = samples[num_samples / 2];
+
+            std::size_t num_chunks = (last - first + grain - 1) / grain;
+            std::vector<std::size_t> below(num_chunks + 1, 0), above(num_chunks + 1, 0);
+            ctx.pool->parallel_for(0, num_chunks, 1, [&](std::size_t c0, std::size_t c1) {
+                for (std::size_t c = c0; c < c1; ++c)
+                {
+                    std::size_t end = std::min(last, first + (c + 1) * grain);
+                    for (std::size_t i = first + c * grain; i < end; ++i)
+                    {
+                        below[c + 1] += less(items[i], pivot);
+                        above[c + 1] += less(pivot, items[i]);
+                    }
+                }
+            });
+            for (std::size_t c = 0; c < num_chunks; ++c)
+            {
+                below[c + 1] += below[c];
+                above[c + 1] += above[c];
+            }
+
+            // the ordering is total, so exactly one item equals the pivot
+            std::size_t split = first + below[num_chunks];
+            ctx.pool->parallel_for(0, num_chunks, 1, [&](std::size_t c0, std::size_t c1) {
+                for (std::size_t c = c0; c < c1; ++c)
+                {
+                    std::size_t lo = first + below[c], hi = split + 1 + above[c];
+                    std::size_t end = std::min(last, first + (c + 1) * grain);
+                    for (std::size_t i = first + c * grain; i < end; ++i)
+                    {
+                        if (less(items[i], pivot)) scratch[lo++] = items[i];
+                        else if (less(pivot, items[i])) scratch[hi++] = items[i];
+                    }
+                }
+            });
+            scratch[split] = pivot;
+            ctx.pool->parallel_for(first, last, grain, [&](std::size_t c0, std::size_t c1) {
+                std::copy(scratch.begin() + c0, scratch.begin() + c1, items.begin() + c0);
+            });
+
+            if (nth == split) return;
+            if (nth < split) last = split;
+            else first = split + 1;
+        }
+
+        std::nth_element(items.begin() + first, items.begin() + nth, items.begin() + last, less);
+    }
+
+    template <class Less>
+    static void select(BuildContext& ctx, std::size_t first, std::size_t nth, 
+        std::size_t last, const Less& less)
+    {
+        if (ctx.pool && ctx.pool->size() > 1 && last - first > parallel_select_cutoff)
+            parallel_select(ctx, first, nth, last, less);
+        else
+            std::nth_element(ctx.items.begin() + first, ctx.items.begin() + nth, ctx.items.begin() + last, less);
+    }
+
+    void recursive_build(BuildContext& ctx, std::size_t first, std::size_t last, 
+        std::size_t node, std::size_t depth) 
+    {
+        if (ctx.control && ctx.control->cancelled()) return;
+        std::vector<BuildItem>& items = ctx.items;
+        if (last - first <= max_leaf_size)
+        {
+            std::sort(items.begin() + first, items.begin() + last, 
+                [](const BuildItem& a, const BuildItem& b) { return a.id < b.id; });
+
+            BBox bbox = BBox::of(ctx.circles[items[first].id]);
+            for (std::size_t i = first; i < last; ++i)
+            {
+                const Circle& circle = ctx.circles[items[i].id];
+                bbox.extend(BBox::of(circle));
+                m_circles.set(i, circle, items[i].id);
+            }
+            m_nodes[node] = KDNode::leaf(bbox, static_cast<std::uint32_t>(first), 
+                static_cast<std::uint32_t>(last - first));
+            if (ctx.control) ctx.control->advance(last - first);
+            return;
+        }
+
+        int cd = depth % 2;
+        std::size_t median_index = first + (last - first) / 2;
+
+        if (cd == 0) 
+        {
+            select(ctx, first, median_index, last, 
+                [](const BuildItem& a, const BuildItem& b) {
+                if (a.center.x != b.center.x) return a.center.x < b.center.x;
+                if (a.center.y != b.center.y) return a.center.y < b.center.y;
+                return a.id < b.id;}
+                );
+        } 
+        else 
+        {
+            select(ctx, first, median_index, last, 
+                [](const BuildItem& a, const BuildItem& b) {
+                if (a.center.y != b.center.y) return a.center.y < b.center.y;
+                if (a.center.x != b.center.x) return a.center.x < b.center.x;
+                return a.id < b.id;}
+                );
+        }
+
+        const Point median = items[median_index].center;
+        std::size_t left = node + 1;
+        std::size_t right = left + subtree_size(median_index - first);
+
+        // the halves write disjoint ranges of items and nodes, so the right
+        // one can be built by another thread
+        if (ctx.pool && last - first > parallel_build_cutoff)
+        {
+            TaskGroup group(*ctx.pool);
+            group.run([this, &ctx, median_index, last, right, depth] {
+                recursive_build(ctx, median_index, last, right, depth + 1);
+            });
+            recursive_build(ctx, first, median_index, left, depth + 1);
+            group.wait();
+        }
+        else
+        {
+            recursive_build(ctx, first, median_index, left, depth + 1);
+            recursive_build(ctx, median_index, last, right, depth + 1);
+        }
+
+        BBox bbox = m_nodes[left].bbox;
+        bbox.extend(m_nodes[right].bbox);
+        m_nodes[node] = KDNode::inner(bbox, cd == 0 ? median.x : median.y, cd, 
+            static_cast<std::uint32_t>(right));
+    }
+
+    // number of node levels of a subtree holding count circles
+    static std::size_t subtree_depth(std::size_t count)
+    {
+        if (count <= max_leaf_size) return 1;
+        return 1 + subtree_depth(count - count / 2);
+    }
+
+    // subtrees are built as tasks on the pool when one is given
+    BuildInfo build(const std::vector<Circle>& circles, BBox, ThreadPool* pool = nullptr, 
+        JobControl* control = nullptr) override
+    {
+        clear();
+        if (circles.empty()) return BuildInfo();
+
+        BuildInfo info;
+        PhaseTimer timer(info.phases);
+
+        std::size_t n = circles.size();
+        m_nodes.resize(subtree_size(n));
+        m_circles.resize(n);
+
+        std::vector<BuildItem> items(n), scratch;
+        if (pool && pool->size() > 1 && n > parallel_select_cutoff) scratch.resize(n);
+
+        BuildContext ctx{circles, items, scratch, pool, control};
+        if (pool)
+        {
+            pool->parallel_for(0, n, parallel_build_cutoff, [&](std::size_t first, std::size_t last) {
+                for (std::size_t i = first; i < last; ++i)
+                    items[i] = BuildItem{circles[i].center, static_cast<std::uint32_t>(i)};
+            });
+        }
+        else
+        {
+            for (std::size_t i = 0; i < n; ++i)
+                items[i] = BuildItem{circles[i].center, static_cast<std::uint32_t>(i)};
+        }
+
+        timer.lap("items");
+
+        recursive_build(ctx, 0, n, 0, 0);
+        if (control && control->cancelled())
+        {
+            clear();
+            return BuildInfo();
+        }
+        update_view();
+        timer.lap("tree");
+
+        info.nodes = m_nodes.size();
+        info.depth = subtree_depth(n);
+        return info;
+    }
+
+    bool does_ray_intersect_bbox(const Ray &ray, const BBox &bbox) const 
+    {
+        double tnear, tfar;
+        RayRange range(ray);
+        return ray_bbox_interval(range, bbox, range.tmin, range.tmax, tnear, tfar);
+    }
+
+    bool does_ray_intersect_circle(const Ray &ray, const Circle &circle) const 
+    {
+        Vector2d origin_to_center = circle.center - ray.origin;
+        assert(std::abs(ray.direction.length() - 1.0) < 1e-7);
+        double proj = origin_to_center.dot(ray.direction); 
+        double d_square = origin_to_center.dot(origin_to_center) - proj * proj; 
+        double radius_square = circle.radius * circle.radius; 
+
+        if (d_square > radius_square) return false;
+
+        double t = std::sqrt(radius_square - d_square); 
+        double t0 = proj - t;
+        double t1 = proj + t; 
+
+        if (t0 > t1) std::swap(t0, t1);
+
+        if (t0 > 0) return true;
+
+        return t1 > 0;
+    }
+
+    // bit mask of the circles of a leaf whose chord with the ray overlaps
+    // (tmin, tmax]
+    std::uint32_t intersect_leaf(const RayRange &range, const KDNode &leaf) const
+    {
+        return m_circles.intersect(range, leaf.first(), leaf.count());
+    }
+
+    // bounds of the whole tree
+    BBox bounds() const { return m_nodes.empty() ? BBox() : m_nodes[0].bbox; }
+
+    const std::vector<KDNode>& nodes() const { return m_nodes; }
+    const CircleBuckets& buckets() const { return m_circles; }
+    const KDTreeView& view() const { return m_view; }
+
+    // calls on_hit(index) for every circle hit by the ray within its range, in
+    // depth-first order, where index is the circle's position in the leaf
+    // order. returns the number of visited nodes.
+    template <class F>
+    std::size_t traverse(const RayRange &range, F &&on_hit) const 
+    {
+        return m_view.traverse(range, on_hit);
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { results.push_back(circle(index)); });
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { ids.push_back(m_circles.ids[index]); });
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        return traverse(range, [&](std::uint32_t index) { return visitor.on_hit(m_circles.ids[index]); });
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        return m_view.query_window(window, visitor, detail);
+    }
+
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        return m_view.query_capsule(segment, margin, visitor);
+    }
+
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        return m_view.search_nearest(point, heap);
+    }
+
+    // closest hit along the ray, see KDTreeView::closest_hit()
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        return m_view.closest_hit(range, hit);
+    }
+
+    // packet version of traverse(): the rays of the packet walk the tree
+    // together and a node is entered while any of them still overlaps its box.
+    // calls on_hit(ray, index) for every hit; the hits of each ray come in
+    // the same order as from traverse(). returns the number of visited nodes.
+    template <class F>
+    std::size_t traverse_packet(const RayPacket &packet, F &&on_hit) const 
+    {
+        std::size_t visited = 0;
+        if (m_nodes.empty() || packet.size == 0) return visited;
+
+        struct Entry
+        {
+            std::uint32_t node;
+            std::uint32_t mask;
+        };
+        Entry stack[64];
+        int top = 0;
+        std::uint32_t node = 0;
+        std::uint32_t active = packet.active_mask();
+
+        while (true)
+        {
+            const KDNode& n = m_nodes[node];
+            visited++;
+            INTERSECTION_STAT(thread_query_stats().nodes++);
+
+            active &= m_packet_kernel(packet.ox, packet.oy, packet.inv_dx, packet.inv_dy,
+                n.bbox.bottom_left.x, n.bbox.bottom_left.y, n.bbox.top_right.x, n.bbox.top_right.y);
+            INTERSECTION_STAT(thread_query_stats().bbox_tests += packet.size);
+            if (active) 
+            {
+                if (!n.is_leaf())
+                {
+                    stack[top++] = Entry{n.right(), active};
+                    INTERSECTION_STAT(thread_query_stats().push(top));
+                    node = node + 1;
+                    continue;
+                }
+
+                std::uint32_t first = n.first();
+                for (std::uint32_t rays = active; rays; rays &= rays - 1)
+                {
+                    int r = lowest_bit(rays);
+                    INTERSECTION_STAT(thread_query_stats().circle_tests += n.count());
+                    std::uint32_t mask = m_circles.kernel(&m_circles.cx[first], &m_circles.cy[first], 
+                        &m_circles.r2[first], n.count(), packet.ox[r], packet.oy[r], packet.dx[r], packet.dy[r]);
+                    while (mask)
+                    {
+                        int i = lowest_bit(mask);
+                        mask &= mask - 1;
+                        on_hit(r, first + i);
+                    }
+                }
+            }
+
+            if (top == 0) break;
+            --top;
+            node = stack[top].node;
+            active = stack[top].mask;
+        }
+
+        return visited;
+    }
+
+    std::size_t detect_intersection_packet(const RayPacket &packet, std::vector<std::uint32_t> *ids) const override
+    {
+        return traverse_packet(packet, [&](int ray, std::uint32_t index) { ids[ray].push_back(m_circles.ids[index]); });
+    }
+};
+
+#endif
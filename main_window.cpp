@@ -7,6 +7,7 @@
 #include <QMessageBox>
 #include <QDialog>
 #include <QInputDialog>
+#include <QMimeData>
 
 #include "main_window.h"
 
@@ -20,7 +21,23 @@ QMainWindow(), Ui_MainWindow()
 	// init scene
 	m_scene = new Scene;
 	viewer->set_scene(m_scene);
+
+	// acceleration structures
+	QActionGroup* index_group = new QActionGroup(this);
+	index_group->addAction(actionUse_KDTree);
+	index_group->addAction(actionUse_BVH);
+	index_group->addAction(actionUse_Grid);
+	index_group->addAction(actionUse_Compact_KDTree);
 	
+	// background jobs
+	m_job_timer = new QTimer(this);
+	m_job_timer->setInterval(50);
+	connect(m_job_timer, SIGNAL(timeout()), this, SLOT(poll_job()));
+	m_progress = new QProgressBar(this);
+	m_progress->setMaximumWidth(200);
+	m_progress->hide();
+	statusbar->addPermanentWidget(m_progress);
+
 	// accepts drop events
 	setAcceptDrops(true);
     
@@ -36,6 +53,72 @@ void MainWindow::update()
 	viewer->repaint();
 }
 
+// called after asking the scene for a job; it may have refused
+void MainWindow::start_job()
+{
+	if (!m_scene->busy())
+	{
+		statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
+		return;
+	}
+	set_busy(true);
+	statusbar->showMessage(QString::fromStdString(m_scene->job_name()) + "...");
+	m_job_timer->start();
+}
+
+void MainWindow::poll_job()
+{
+	if (m_scene->poll_job())
+	{
+		m_job_timer->stop();
+		set_busy(false);
+		statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
+		update();
+		return;
+	}
+
+	// an unknown total shows as a busy bar
+	double progress = m_scene->job_progress();
+	if (progress < 0.0)
+	{
+		m_progress->setRange(0, 0);
+	}
+	else
+	{
+		m_progress->setRange(0, 100);
+		m_progress->setValue(int(100.0 * progress));
+	}
+}
+
+void MainWindow::set_busy(bool busy)
+{
+	QAction* actions[] = { actionClearAll, actionClear_Circles, actionClear_Ray, actionSave_Snapshot, 
+		actionLoad_Snapshot, actionRandom_Circles, actionRandom_Ray, actionBuild_KDTree, actionDetect_Intersection, 
+		actionDetect_Overlaps, actionUse_KDTree, actionUse_BVH, actionUse_Grid, actionUse_Compact_KDTree };
+	for (QAction* action : actions)
+		action->setEnabled(!busy);
+	actionCancel->setEnabled(busy);
+	setAcceptDrops(!busy);
+
+	m_progress->setRange(0, 0);
+	m_progress->setVisible(busy);
+}
+
+void MainWindow::dragEnterEvent(QDragEnterEvent* event)
+{
+	if (event->mimeData()->hasUrls())
+		event->acceptProposedAction();
+}
+
+void MainWindow::dropEvent(QDropEvent* event)
+{
+	QList<QUrl> urls = event->mimeData()->urls();
+	if (urls.isEmpty() || !urls.first().isLocalFile()) return;
+	m_scene->import_circles(urls.first().toLocalFile().toStdString());
+	start_job();
+	event->acceptProposedAction();
+}
+
 void MainWindow::on_actionClearAll_triggered()
 {
 	QApplication::setOverrideCursor(Qt::WaitCursor);
@@ -60,12 +143,43 @@ void MainWindow::on_actionClear_Ray_triggered()
 	update();
 }
 
+void MainWindow::on_actionSave_Snapshot_triggered()
+{
+	QString path = QFileDialog::getSaveFileName(this, tr("Save Snapshot"), ".", tr("Snapshots (*.snap)"));
+	if (path.isEmpty()) return;
+	m_scene->save_snapshot(path.toStdString());
+	start_job();
+}
+
+void MainWindow::on_actionLoad_Snapshot_triggered()
+{
+	QString path = QFileDialog::getOpenFileName(this, tr("Load Snapshot"), ".", tr("Snapshots (*.snap)"));
+	if (path.isEmpty()) return;
+	m_scene->load_snapshot(path.toStdString());
+	start_job();
+}
+
+// dropped files are indexed a chunk at a time, each spilled to a snapshot in
+// the directory; a cancelled dialog keeps the one before
+void MainWindow::on_actionSpill_Directory_triggered()
+{
+	QString dir = QFileDialog::getExistingDirectory(this, tr("Spill Directory"), 
+		QString::fromStdString(m_scene->get_spill_dir()));
+	if (dir.isEmpty()) return;
+	m_scene->set_spill_dir(dir.toStdString());
+	statusbar->showMessage(tr("imports spill to ") + dir);
+}
+
+void MainWindow::on_actionNo_Spilling_triggered()
+{
+	m_scene->set_spill_dir(std::string());
+	statusbar->showMessage(tr("imports are not spilled"));
+}
+
 void MainWindow::on_actionRandom_Circles_triggered()
 {
-	QApplication::setOverrideCursor(Qt::WaitCursor);
   	m_scene->generate_random_circles();
-	QApplication::restoreOverrideCursor();
-	update();
+	start_job();
 }
 
 void MainWindow::on_actionRandom_Ray_triggered()
@@ -78,15 +192,86 @@ void MainWindow::on_actionRandom_Ray_triggered()
 
 void MainWindow::on_actionBuild_KDTree_triggered()
 {
-	m_scene->build_kdtree();
+	m_scene->build_index();
+	start_job();
 }
 
 void MainWindow::on_actionDetect_Intersection_triggered()
 {
-	QApplication::setOverrideCursor(Qt::WaitCursor);
 	m_scene->detect_intersection();
-	QApplication::restoreOverrideCursor();
+	start_job();
+}
+
+void MainWindow::on_actionTrack_Ray_toggled(bool checked)
+{
+	m_scene->set_track_ray(checked);
+	statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
+	update();
+}
+
+void MainWindow::on_actionVisibility_toggled(bool checked)
+{
+	m_scene->set_show_visibility(checked);
+	statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
+	update();
+}
+
+void MainWindow::on_actionVisibility_Rays_triggered()
+{
+	bool ok = false;
+	int count = QInputDialog::getInt(this, tr("Visibility Rays"), 
+		tr("Rays cast from the mouse:"), int(m_scene->get_visibility_rays()), 1, 1 << 20, 1, &ok);
+	if (!ok) return;
+	m_scene->set_visibility_rays(std::size_t(count));
+	statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
 	update();
 }
 
+// the tracked ray and the visibility report their hits and timing on every move
+void MainWindow::on_viewer_hovered()
+{
+	if ((m_scene->get_track_ray() || m_scene->get_show_visibility()) && !m_scene->busy())
+		statusbar->showMessage(QString::fromStdString(m_scene->get_status()));
+}
+
+void MainWindow::on_actionNearest_Circles_triggered()
+{
+	bool ok = false;
+	int count = QInputDialog::getInt(this, tr("Nearest Circles"), 
+		tr("Circles highlighted under the mouse:"), int(m_scene->get_hover_count()), 0, 100, 1, &ok);
+	if (!ok) return;
+	m_scene->set_hover_count(std::size_t(count));
+	update();
+}
 
+void MainWindow::on_actionDetect_Overlaps_triggered()
+{
+	m_scene->detect_overlaps();
+	start_job();
+}
+
+void MainWindow::on_actionCancel_triggered()
+{
+	m_scene->cancel_job();
+	statusbar->showMessage(QString::fromStdString(m_scene->job_name()) + ": cancelling...");
+}
+
+void MainWindow::on_actionUse_KDTree_triggered()
+{
+	m_scene->set_index_type(IndexType::kdtree);
+}
+
+void MainWindow::on_actionUse_BVH_triggered()
+{
+	m_scene->set_index_type(IndexType::bvh);
+}
+
+void MainWindow::on_actionUse_Grid_triggered()
+{
+	m_scene->set_index_type(IndexType::grid);
+}
+
+void MainWindow::on_actionUse_Compact_KDTree_triggered()
+{
+	m_scene->set_index_type(IndexType::compact_kdtree);
+}
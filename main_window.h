@@ -4,6 +4,8 @@
 // Qt
 #include <QWidget>
 #include <QString>
+#include <QTimer>
+#include <QProgressBar>
 
 #include "scene.h"
 #include "ui_intersection.h"
@@ -16,24 +18,55 @@ class MainWindow : public QMainWindow, public Ui_MainWindow
 private:
 	Scene* m_scene;
 
+	// a job of the scene runs in the background: polled for its progress and
+	// to commit it, and the actions changing the scene are disabled meanwhile
+	QTimer* m_job_timer;
+	QProgressBar* m_progress;
+
 public:
 	MainWindow();
 	~MainWindow();
 
 	void update();
 
+private:
+	void start_job();
+	void set_busy(bool busy);
+
+private slots:
+	void poll_job();
+
+protected:
+	// circle files dropped on the window are imported
+	void dragEnterEvent(QDragEnterEvent* event) override;
+	void dropEvent(QDropEvent* event) override;
 
 public slots:
     // menu
 	void on_actionClearAll_triggered(); 
 	void on_actionClear_Circles_triggered();
     void on_actionClear_Ray_triggered();
+	void on_actionSave_Snapshot_triggered();
+	void on_actionLoad_Snapshot_triggered();
+	void on_actionSpill_Directory_triggered();
+	void on_actionNo_Spilling_triggered();
 
 	// algorithms
 	void on_actionRandom_Circles_triggered();
 	void on_actionRandom_Ray_triggered();
 	void on_actionBuild_KDTree_triggered();
 	void on_actionDetect_Intersection_triggered();
+	void on_actionTrack_Ray_toggled(bool checked);
+	void on_actionVisibility_toggled(bool checked);
+	void on_actionVisibility_Rays_triggered();
+	void on_viewer_hovered();
+	void on_actionNearest_Circles_triggered();
+	void on_actionDetect_Overlaps_triggered();
+	void on_actionCancel_triggered();
+	void on_actionUse_KDTree_triggered();
+	void on_actionUse_BVH_triggered();
+	void on_actionUse_Grid_triggered();
+	void on_actionUse_Compact_KDTree_triggered();
 
 
 };
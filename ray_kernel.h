@@ -0,0 +1,186 @@
+#ifndef RAY_KERNEL_H
+#define RAY_KERNEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RAY_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+// ray vs. circle bucket kernels
+// a bucket is up to 32 circles stored as structure of arrays: center x,
+// center y and squared radius. a kernel returns a bit mask of the circles hit
+// by the ray, bit i standing for circle i.
+// a ray hits a circle when its line passes within the radius (d^2 <= r^2) and
+// the far intersection lies in front of the origin, that is when the center
+// projects in front of the origin or the origin is inside the circle; no
+// square root is needed.
+// the vector kernels read whole vectors, so the arrays must stay readable for
+// 3 elements past the bucket; bits past count are cleared.
+
+typedef std::uint32_t (*RayCircleKernel)(const double *cx, const double *cy, const double *r2,
+    std::size_t count, double ox, double oy, double dx, double dy);
+
+inline std::uint32_t ray_circle_mask_scalar(const double *cx, const double *cy, const double *r2,
+    std::size_t count, double ox, double oy, double dx, double dy)
+{
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        double x = cx[i] - ox;
+        double y = cy[i] - oy;
+        double proj = x * dx + y * dy;
+        double oc2 = x * x + y * y;
+        double d2 = oc2 - proj * proj;
+        bool hit = d2 <= r2[i] && (proj > 0.0 || oc2 < r2[i]);
+        mask |= std::uint32_t(hit) << i;
+    }
+    return mask;
+}
+
+// ray packet vs. box kernels
+// a packet is 8 rays stored as structure of arrays: origin x, origin y and the
+// inverse direction, with zero direction components replaced by a tiny value
+// so that no lane produces 0 * inf. a kernel returns a bit mask of the rays
+// whose slab interval [tnear, tfar] is not empty and not behind the origin.
+
+typedef std::uint32_t (*PacketBBoxKernel)(const double *ox, const double *oy,
+    const double *inv_dx, const double *inv_dy, double xmin, double ymin, double xmax, double ymax);
+
+inline std::uint32_t packet_bbox_mask_scalar(const double *ox, const double *oy,
+    const double *inv_dx, const double *inv_dy, double xmin, double ymin, double xmax, double ymax)
+{
+    std::uint32_t mask = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        double tx0 = (xmin - ox[i]) * inv_dx[i];
+        double tx1 = (xmax - ox[i]) * inv_dx[i];
+        double ty0 = (ymin - oy[i]) * inv_dy[i];
+        double ty1 = (ymax - oy[i]) * inv_dy[i];
+        double tnear = std::max(std::min(tx0, tx1), std::min(ty0, ty1));
+        double tfar = std::min(std::max(tx0, tx1), std::max(ty0, ty1));
+        bool hit = tnear <= tfar && tfar >= 0.0;
+        mask |= std::uint32_t(hit) << i;
+    }
+    return mask;
+}
+
+// index of the lowest set bit of a non-zero mask
+inline int lowest_bit(std::uint32_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    int i = 0;
+    while (!(mask & 1u)) { mask >>= 1; ++i; }
+    return i;
+#endif
+}
+
+#ifdef RAY_KERNEL_X86
+
+__attribute__((target("sse2")))
+inline std::uint32_t ray_circle_mask_sse2(const double *cx, const double *cy, const double *r2,
+    std::size_t count, double ox, double oy, double dx, double dy)
+{
+    const __m128d vox = _mm_set1_pd(ox), voy = _mm_set1_pd(oy);
+    const __m128d vdx = _mm_set1_pd(dx), vdy = _mm_set1_pd(dy);
+    const __m128d zero = _mm_setzero_pd();
+
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < count; i += 2)
+    {
+        __m128d x = _mm_sub_pd(_mm_loadu_pd(cx + i), vox);
+        __m128d y = _mm_sub_pd(_mm_loadu_pd(cy + i), voy);
+        __m128d r = _mm_loadu_pd(r2 + i);
+        __m128d proj = _mm_add_pd(_mm_mul_pd(x, vdx), _mm_mul_pd(y, vdy));
+        __m128d oc2 = _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y));
+        __m128d d2 = _mm_sub_pd(oc2, _mm_mul_pd(proj, proj));
+        __m128d hit = _mm_and_pd(_mm_cmple_pd(d2, r),
+            _mm_or_pd(_mm_cmpgt_pd(proj, zero), _mm_cmplt_pd(oc2, r)));
+        mask |= std::uint32_t(_mm_movemask_pd(hit)) << i;
+    }
+    return count < 32 ? mask & ((1u << count) - 1) : mask;
+}
+
+__attribute__((target("avx2")))
+inline std::uint32_t ray_circle_mask_avx2(const double *cx, const double *cy, const double *r2,
+    std::size_t count, double ox, double oy, double dx, double dy)
+{
+    const __m256d vox = _mm256_set1_pd(ox), voy = _mm256_set1_pd(oy);
+    const __m256d vdx = _mm256_set1_pd(dx), vdy = _mm256_set1_pd(dy);
+    const __m256d zero = _mm256_setzero_pd();
+
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < count; i += 4)
+    {
+        __m256d x = _mm256_sub_pd(_mm256_loadu_pd(cx + i), vox);
+        __m256d y = _mm256_sub_pd(_mm256_loadu_pd(cy + i), voy);
+        __m256d r = _mm256_loadu_pd(r2 + i);
+        __m256d proj = _mm256_add_pd(_mm256_mul_pd(x, vdx), _mm256_mul_pd(y, vdy));
+        __m256d oc2 = _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y));
+        __m256d d2 = _mm256_sub_pd(oc2, _mm256_mul_pd(proj, proj));
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(d2, r, _CMP_LE_OQ),
+            _mm256_or_pd(_mm256_cmp_pd(proj, zero, _CMP_GT_OQ), _mm256_cmp_pd(oc2, r, _CMP_LT_OQ)));
+        mask |= std::uint32_t(_mm256_movemask_pd(hit)) << i;
+    }
+    return count < 32 ? mask & ((1u << count) - 1) : mask;
+}
+
+__attribute__((target("avx2")))
+inline std::uint32_t packet_bbox_mask_avx2(const double *ox, const double *oy,
+    const double *inv_dx, const double *inv_dy, double xmin, double ymin, double xmax, double ymax)
+{
+    const __m256d vxmin = _mm256_set1_pd(xmin), vymin = _mm256_set1_pd(ymin);
+    const __m256d vxmax = _mm256_set1_pd(xmax), vymax = _mm256_set1_pd(ymax);
+    const __m256d zero = _mm256_setzero_pd();
+
+    std::uint32_t mask = 0;
+    for (int i = 0; i < 8; i += 4)
+    {
+        __m256d x = _mm256_loadu_pd(ox + i), y = _mm256_loadu_pd(oy + i);
+        __m256d idx = _mm256_loadu_pd(inv_dx + i), idy = _mm256_loadu_pd(inv_dy + i);
+        __m256d tx0 = _mm256_mul_pd(_mm256_sub_pd(vxmin, x), idx);
+        __m256d tx1 = _mm256_mul_pd(_mm256_sub_pd(vxmax, x), idx);
+        __m256d ty0 = _mm256_mul_pd(_mm256_sub_pd(vymin, y), idy);
+        __m256d ty1 = _mm256_mul_pd(_mm256_sub_pd(vymax, y), idy);
+        __m256d tnear = _mm256_max_pd(_mm256_min_pd(tx0, tx1), _mm256_min_pd(ty0, ty1));
+        __m256d tfar = _mm256_min_pd(_mm256_max_pd(tx0, tx1), _mm256_max_pd(ty0, ty1));
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(tnear, tfar, _CMP_LE_OQ), 
+            _mm256_cmp_pd(tfar, zero, _CMP_GE_OQ));
+        mask |= std::uint32_t(_mm256_movemask_pd(hit)) << i;
+    }
+    return mask;
+}
+
+#endif // RAY_KERNEL_X86
+
+// the fastest kernel the running cpu supports, chosen once
+inline RayCircleKernel ray_circle_kernel()
+{
+#ifdef RAY_KERNEL_X86
+    static const RayCircleKernel kernel =
+        __builtin_cpu_supports("avx2") ? ray_circle_mask_avx2 :
+        __builtin_cpu_supports("sse2") ? ray_circle_mask_sse2 :
+        ray_circle_mask_scalar;
+    return kernel;
+#else
+    return ray_circle_mask_scalar;
+#endif
+}
+
+inline PacketBBoxKernel packet_bbox_kernel()
+{
+#ifdef RAY_KERNEL_X86
+    static const PacketBBoxKernel kernel =
+        __builtin_cpu_supports("avx2") ? packet_bbox_mask_avx2 : packet_bbox_mask_scalar;
+    return kernel;
+#else
+    return packet_bbox_mask_scalar;
+#endif
+}
+
+#endif // RAY_KERNEL_H
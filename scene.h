@@ -5,12 +5,18 @@
 #include <fstream>
 #include <algorithm>
 #include <vector>
-#include <iostream> // delete=====
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <iostream>
 // Qt
 #include <QtOpenGL>
 
 
-#include "geometric.h"
+#include "algorithm.h"
+#include "snapshot.h"
+#include "import.h"
+#include "circle_renderer.h"
 
 
 class Scene
@@ -26,48 +32,170 @@ public:
 private:
     std::vector<Circle> m_circles;
     Ray m_ray;
-    std::vector<Circle> m_intersected_circles;
+    std::vector<std::uint32_t> m_intersected_ids; // into m_circles, reused by every query
+    std::vector<OverlapPair> m_overlaps;
+    std::string m_status; // outcome of the last build or query
+
+    // m_render_version is bumped on every change of the circles, the hits or
+    // the view; the visible set is collected and uploaded again only then
+    std::uint64_t m_circles_version = 0;
+    std::uint64_t m_indexed_version = ~std::uint64_t(0); // circles the index was built from
+    std::uint64_t m_render_version = 0;
+    std::uint64_t m_visible_version = ~std::uint64_t(0);
+    double m_pixel_size = 0.0; // in world units
+
+    // what is drawn: circles of at least a pixel, smaller ones as points, and
+    // subtrees smaller than a few pixels as shaded boxes
+    CircleRenderer m_renderer;
+    std::vector<std::uint32_t> m_visible_ids;
+    std::vector<float> m_points;
+    std::vector<float> m_box_corners, m_box_colors;
+
+    // the circles nearest to the mouse, found by a query on the index
+    std::size_t m_hover_count = 1;
+    std::vector<Neighbor> m_hover;
+    std::vector<std::uint32_t> m_hover_ids;
+
+    // the ray turned towards the mouse on every move; its hits are found by
+    // testing candidates gathered around it, again only once it moves away
+    bool m_track_ray = false;
+    CoherentRayQuery m_tracker;
+    std::vector<std::uint32_t> m_tracked_ids; // scratch, sorted
+
+    // what a fan of rays from the mouse sees, cast again on every move
+    bool m_show_visibility = false;
+    std::size_t m_visibility_rays = 2048;
+    VisibilityPolygon m_visibility;
+    ThreadPool m_serial_pool{1}; // for the fan while a job may use the pool
+
+    // imported files are indexed a chunk at a time; with a directory, every
+    // chunk is spilled there as a mapped snapshot
+    std::string m_spill_dir;
   
 private:
     std::unique_ptr<Algorithm> m_alg_ptr 
         = std::make_unique<Algorithm>();
 
+    // generation, builds and queries run here, on results of their own that
+    // are committed by poll_job(); meanwhile the circles and the index in
+    // use are only read, and changes to them are refused
+    BackgroundJob m_job;
+
 public:
     Scene() {}
 
     ~Scene()
     {
+        m_job.stop();
         clear_all();
     }
 
-    void set_mouse_pos(const Point &pos) { m_mouse_pos = pos; }
+    bool busy() const { return m_job.busy(); }
+    const std::string& job_name() const { return m_job.name(); }
+    double job_progress() const { return m_job.progress(); }
+    void cancel_job() { m_job.cancel(); }
+
+    // commits the results of the running job if it has finished; returns
+    // whether it had, cancelled or not
+    bool poll_job()
+    {
+        if (!m_job.finished()) return false;
+        m_status = m_job.name() + " cancelled"; // unless the commit says otherwise
+        m_job.poll();
+        return true;
+    }
+
+    void set_mouse_pos(const Point &pos) 
+    { 
+        m_mouse_pos = pos; 
+        update_hover();
+        if (m_track_ray) track_ray();
+        if (m_show_visibility) cast_visibility();
+    }
+
+    std::size_t get_hover_count() const { return m_hover_count; }
+    void set_hover_count(std::size_t count) 
+    { 
+        m_hover_count = count; 
+        update_hover();
+    }
+
+    bool get_track_ray() const { return m_track_ray; }
+    void set_track_ray(bool on)
+    {
+        m_track_ray = on;
+        if (on) track_ray();
+    }
+
+    bool get_show_visibility() const { return m_show_visibility; }
+    void set_show_visibility(bool on)
+    {
+        m_show_visibility = on;
+        m_visibility.vertices.clear();
+        if (on) cast_visibility();
+    }
+
+    std::size_t get_visibility_rays() const { return m_visibility_rays; }
+    void set_visibility_rays(std::size_t count)
+    {
+        m_visibility_rays = count;
+        if (m_show_visibility) cast_visibility();
+    }
+
+    const std::string& get_spill_dir() const { return m_spill_dir; }
+    void set_spill_dir(const std::string& dir) { m_spill_dir = dir; }
 
     void set_circle_radius(const double radius) { m_circle_radius = radius; }
     void set_rect(const BBox& rect) { m_rect = rect; }
-    void set_viewer_rect(const BBox& rect) { m_viewer_rect = rect; }
+    void set_viewer_rect(const BBox& rect) 
+    { 
+        m_viewer_rect = rect; 
+        ++m_render_version;
+    }
+
+    void set_pixel_size(double size) 
+    { 
+        m_pixel_size = size; 
+        ++m_render_version;
+    }
     void set_screen_viewer_rect(const BBox& rect) { m_viewer_rect_screen = rect; }
     Ray& get_random_ray() { return m_ray; }
-    const std::vector<Circle>& get_intersected_circles() { return m_intersected_circles; }
+    const std::vector<std::uint32_t>& get_intersected_ids() const { return m_intersected_ids; }
+    const std::string& get_status() const { return m_status; }
 
     void clear_all()
     {
+       if (!check_idle()) return;
        m_circles.clear();
-       m_intersected_circles.clear();
+       m_intersected_ids.clear();
+       m_hover_ids.clear();
+       m_visibility.vertices.clear();
        m_ray = Ray();
+       m_tracker.reset();
        m_alg_ptr->clear();
+       ++m_circles_version;
+       ++m_render_version;
     }
 
     void clear_circles()
     {
+       if (!check_idle()) return;
        m_circles.clear();
-       m_intersected_circles.clear();
+       m_intersected_ids.clear();
+       m_hover_ids.clear();
+       m_visibility.vertices.clear();
+       m_tracker.reset();
        m_alg_ptr->clear();
+       ++m_circles_version;
+       ++m_render_version;
     }
 
     void clear_ray()
     {
+       if (!check_idle()) return;
        m_ray = Ray();
-       m_intersected_circles.clear();
+       m_intersected_ids.clear();
+       ++m_render_version;
     }
 
     // plot
@@ -75,65 +203,209 @@ public:
     {
         plot_rect(); 
 
+        // plot what the mouse sees, under the circles
+        plot_visibility();
+
         // plot circles
-        for(const auto &circle : m_circles)
-        {
-            plot_circle_boundary(circle);
-        }  
+        update_visible();
+        m_renderer.render_boxes(m_box_corners, m_box_colors);
+        m_renderer.render_points(m_points);
+        m_renderer.render_boundaries();
     
         plot_ray();
 
         // plot intersected circles
-        for(const auto &circle : m_intersected_circles)
-        {
-            plot_shaded_circle(circle);
-        } 
+        m_renderer.render_hits();
+
+        // plot the circles under the mouse
+        m_renderer.render_outlines(m_circles, m_hover_ids, 1.0f, 0.5f, 0.0f, 3.0f);
     }
 
-    void plot_rect()
+    // a single circle is looked for within a few pixels of the mouse, more
+    // than one anywhere; needs the index built from the current circles. the
+    // query goes to the index directly, as a job may be using the algorithm.
+    void update_hover()
     {
-        glColor3f(0.0f, 0.0f, 0.0f); // Set color to black
-        glLineWidth(2.0f);           // Set line width
-        glBegin(GL_LINE_LOOP);
-        glVertex2f(m_rect.bottom_left.x, m_rect.bottom_left.y);
-        glVertex2f(m_rect.top_right.x, m_rect.bottom_left.y);
-        glVertex2f(m_rect.top_right.x, m_rect.top_right.y);
-        glVertex2f(m_rect.bottom_left.x, m_rect.top_right.y);
-        glEnd();
+        m_hover_ids.clear();
+        if (m_indexed_version != m_circles_version || m_circles.empty() || m_hover_count == 0)
+            return;
+
+        double max_distance = m_hover_count == 1 ? 20.0 * m_pixel_size 
+            : std::numeric_limits<double>::infinity();
+        m_alg_ptr->m_index_ptr->nearest(m_mouse_pos, m_hover_count, m_hover, max_distance);
+        for (const Neighbor& neighbor : m_hover)
+            m_hover_ids.push_back(neighbor.id);
     }
 
-    void plot_circle_boundary(const Circle& circle)
+    // turns the ray from its origin, or from the middle of the circles when
+    // there is none, towards the mouse and finds its hits with the tracker;
+    // they need the index built from the current circles. the candidates
+    // reach 16 pixels to either side of the ray.
+    void track_ray()
     {
-        int num_segments = 100;
-        const float delta = 2.0f * M_PI / num_segments;
-        
-        glColor3f(0.1f, 0.0f, 0.0f);
-        glBegin(GL_LINE_LOOP); 
-        for (int i = 0; i < num_segments; ++i)
+        if (m_ray.direction.x == 0.0 && m_ray.direction.y == 0.0)
+            m_ray.origin = Point(0.5 * (m_rect.bottom_left.x + m_rect.top_right.x), 
+                0.5 * (m_rect.bottom_left.y + m_rect.top_right.y));
+        Vector2d direction = m_mouse_pos - m_ray.origin;
+        double length = direction.length();
+        if (length == 0.0) return;
+        m_ray.direction = direction * (1.0 / length);
+        double reach = (m_viewer_rect.top_right - m_viewer_rect.bottom_left).length() 
+            + (m_ray.origin - m_viewer_rect.bottom_left).length();
+        m_ray.plot_segment = Segment(m_ray.origin, m_ray.origin + m_ray.direction * reach);
+        if (m_indexed_version != m_circles_version || m_circles.empty())
         {
-            float angle = i * delta;
-            float x = circle.center.x + circle.radius * std::cos(angle);
-            float y = circle.center.y + circle.radius * std::sin(angle);
-            glVertex2f(x, y);
+            if (!m_intersected_ids.empty())
+            {
+                m_intersected_ids.clear();
+                ++m_render_version;
+            }
+            m_status = "tracked ray: no index of the circles";
+            return;
         }
-        glEnd();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        m_tracked_ids.clear();
+        bool gathered = m_tracker.query(*m_alg_ptr->m_index_ptr, m_circles, m_ray, 
+            16.0 * m_pixel_size, m_tracked_ids);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+        // the visible set and the instance buffer are redone only for new hits
+        std::sort(m_tracked_ids.begin(), m_tracked_ids.end());
+        if (m_tracked_ids != m_intersected_ids)
+        {
+            m_intersected_ids.swap(m_tracked_ids);
+            ++m_render_version;
+        }
+
+        std::ostringstream status;
+        status << "tracked ray, intersected circles: " << m_intersected_ids.size() 
+            << ", candidates: " << m_tracker.candidates() << (gathered ? " (gathered)" : "")
+            << ", gathers: " << m_tracker.gathers() << "/" << m_tracker.queries() << ", " << us << " us";
+        m_status = status.str();
+    }
+
+    // casts a full turn of rays from the mouse, as far as the view reaches;
+    // needs the index built from the current circles
+    void cast_visibility()
+    {
+        m_visibility.vertices.clear();
+        if (m_indexed_version != m_circles_version || m_circles.empty() || m_visibility_rays == 0)
+        {
+            m_status = "visibility: no index of the circles";
+            return;
+        }
+
+        RayFan fan;
+        fan.origin = m_mouse_pos;
+        fan.from = 0.0;
+        fan.count = m_visibility_rays;
+        fan.to = 2.0 * std::acos(-1.0) * (1.0 - 1.0 / double(fan.count)); // the ray after the last is the first
+        fan.max_distance = (m_viewer_rect.top_right - m_viewer_rect.bottom_left).length();
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ThreadPool& pool = busy() ? m_serial_pool : *m_alg_ptr->m_pool_ptr;
+        std::size_t visited = m_alg_ptr->m_index_ptr->cast_fan(fan, m_circles, m_visibility, pool);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::size_t hits = 0;
+        for (std::uint32_t id : m_visibility.ids) hits += id != RayHit::null;
+        std::ostringstream status;
+        status << "visibility: " << fan.count << " rays, " << hits << " hit, visited nodes: " << visited 
+            << ", " << ms << " ms";
+        m_status = status.str();
     }
 
-    void plot_shaded_circle(const Circle& circle)
+    // the visibility polygon, filled and outlined
+    void plot_visibility()
     {
-        int num_segments = 100;
-        const float delta = 2.0f * M_PI / num_segments;
-        
-        glColor3f(0.1f, 0.0f, 0.0f);
+        if (!m_show_visibility || m_visibility.vertices.empty()) return;
+        glColor4f(0.2f, 0.6f, 1.0f, 0.2f);
         glBegin(GL_TRIANGLE_FAN);
-        glVertex2f(circle.center.x, circle.center.y);
-        for (int i = 0; i < num_segments; ++i)
+        glVertex2f(m_visibility.origin.x, m_visibility.origin.y);
+        for (const Point& vertex : m_visibility.vertices)
+            glVertex2f(vertex.x, vertex.y);
+        glVertex2f(m_visibility.vertices.front().x, m_visibility.vertices.front().y);
+        glEnd();
+
+        glColor4f(0.2f, 0.6f, 1.0f, 0.8f);
+        glBegin(GL_LINE_LOOP);
+        for (const Point& vertex : m_visibility.vertices)
+            glVertex2f(vertex.x, vertex.y);
+        glEnd();
+    }
+
+    // collects what is in view with a window query on the index, when the
+    // index is built from the current circles; otherwise every circle is drawn
+    void update_visible()
+    {
+        if (m_visible_version == m_render_version) return;
+        m_visible_version = m_render_version;
+        m_points.clear();
+        m_box_corners.clear();
+        m_box_colors.clear();
+
+        if (m_indexed_version != m_circles_version || m_pixel_size <= 0.0 || m_circles.empty())
         {
-            float angle = i * delta;
-            float x = circle.center.x + circle.radius * std::cos(angle);
-            float y = circle.center.y + circle.radius * std::sin(angle);
-            glVertex2f(x, y);
+            m_renderer.update(m_circles, nullptr, m_intersected_ids, m_render_version);
+            return;
         }
+
+        struct Visitor : WindowVisitor
+        {
+            Scene &scene;
+            explicit Visitor(Scene &scene) : scene(scene) {}
+
+            bool on_circle(std::uint32_t id) override
+            {
+                const Circle& circle = scene.m_circles[id];
+                if (2.0 * circle.radius >= scene.m_pixel_size)
+                {
+                    scene.m_visible_ids.push_back(id);
+                    return true;
+                }
+                scene.m_points.push_back(float(circle.center.x));
+                scene.m_points.push_back(float(circle.center.y));
+                return true;
+            }
+
+            // shaded by the number of circles per pixel of the box, at least
+            // a pixel wide
+            bool on_cluster(const BBox &box, std::size_t count) override
+            {
+                double pixel = scene.m_pixel_size;
+                double cx = 0.5 * (box.bottom_left.x + box.top_right.x);
+                double cy = 0.5 * (box.bottom_left.y + box.top_right.y);
+                double hw = std::max(0.5 * box.width(), 0.5 * pixel);
+                double hh = std::max(0.5 * box.height(), 0.5 * pixel);
+                double density = count * pixel * pixel / (4.0 * hw * hh);
+                float alpha = float(std::min(1.0, 0.2 + 0.8 * density));
+                float corners[8] = {float(cx - hw), float(cy - hh), float(cx + hw), float(cy - hh), 
+                    float(cx + hw), float(cy + hh), float(cx - hw), float(cy + hh)};
+                scene.m_box_corners.insert(scene.m_box_corners.end(), corners, corners + 8);
+                for (int k = 0; k < 4; ++k)
+                {
+                    float color[4] = {0.1f, 0.0f, 0.0f, alpha};
+                    scene.m_box_colors.insert(scene.m_box_colors.end(), color, color + 4);
+                }
+                return true;
+            }
+        } visitor(*this);
+
+        m_visible_ids.clear();
+        m_alg_ptr->m_index_ptr->query_window(m_viewer_rect, visitor, 4.0 * m_pixel_size);
+        m_renderer.update(m_circles, &m_visible_ids, m_intersected_ids, m_render_version);
+    }
+
+    void plot_rect()
+    {
+        glColor3f(0.0f, 0.0f, 0.0f); // Set color to black
+        glLineWidth(2.0f);           // Set line width
+        glBegin(GL_LINE_LOOP);
+        glVertex2f(m_rect.bottom_left.x, m_rect.bottom_left.y);
+        glVertex2f(m_rect.top_right.x, m_rect.bottom_left.y);
+        glVertex2f(m_rect.top_right.x, m_rect.top_right.y);
+        glVertex2f(m_rect.bottom_left.x, m_rect.top_right.y);
         glEnd();
     }
 
@@ -148,17 +420,29 @@ public:
 
     void generate_random_circles()
     {
-        m_circles.clear();
-
+        if (!check_idle()) return;
         std::uniform_int_distribution<> distri_num_circles(100, 2000);
         std::size_t num_circles = distri_num_circles(m_alg_ptr->random_generator());
 
-        m_alg_ptr->generate_random_circles(m_circles, m_rect, m_circle_radius, num_circles);
-        std::cerr << "generate circles:" << m_circles.size() << std::endl;
+        std::shared_ptr<std::vector<Circle>> circles = std::make_shared<std::vector<Circle>>();
+        m_job.start("generate circles", [this, circles, num_circles](JobControl& control) -> BackgroundJob::Commit {
+            circles->reserve(num_circles);
+            m_alg_ptr->generate_random_circles(*circles, m_rect, m_circle_radius, num_circles, &control);
+            return [this, circles] {
+                m_circles.swap(*circles);
+                m_intersected_ids.clear();
+                m_hover_ids.clear();
+                m_visibility.vertices.clear();
+                ++m_circles_version;
+                ++m_render_version;
+                m_status = "generate circles: " + std::to_string(m_circles.size());
+            };
+        });
     }
 
     void generate_random_ray()
     {
+        if (!check_idle()) return;
         m_alg_ptr->generate_random_ray(m_ray, m_viewer_rect);
         std::cerr << "generate a random ray," 
             << "origin:" << "(" << m_ray.origin.x << "," << m_ray.origin.y << ")" << "," 
@@ -167,16 +451,213 @@ public:
             << "->" << "(" << m_ray.plot_segment.destination.x << "," << m_ray.plot_segment.destination.y << ")" << std::endl;
     }
 
-    void build_kdtree()
+    // writes the circles and a kd-tree over them; the tree of the current
+    // index is reused when it is one
+    void save_snapshot(const std::string& path)
+    {
+        if (!check_idle()) return;
+        m_job.start("save snapshot", [this, path](JobControl& control) -> BackgroundJob::Commit {
+            const KDTree* tree = dynamic_cast<const KDTree*>(m_alg_ptr->m_index_ptr.get());
+            KDTree built;
+            if (!tree || tree->size() != m_circles.size())
+            {
+                control.set_total(m_circles.size());
+                built.build(m_circles, m_rect, m_alg_ptr->m_pool_ptr.get(), &control);
+                tree = &built;
+            }
+            if (control.cancelled()) return nullptr;
+            std::string error;
+            bool ok = ::save_snapshot(path, m_circles, *tree, &error);
+            return [this, path, ok, error] { m_status = ok ? "saved " + path : error; };
+        });
+    }
+
+    // maps a snapshot and queries its kd-tree in place; the circles are
+    // copied for drawing
+    void load_snapshot(const std::string& path)
+    {
+        if (!check_idle()) return;
+        std::shared_ptr<std::unique_ptr<Snapshot>> snapshot 
+            = std::make_shared<std::unique_ptr<Snapshot>>(std::make_unique<Snapshot>());
+        std::shared_ptr<std::vector<Circle>> circles = std::make_shared<std::vector<Circle>>();
+        m_job.start("load snapshot", [this, path, snapshot, circles](JobControl&) -> BackgroundJob::Commit {
+            std::string error;
+            if (!(*snapshot)->open_file(path, true, &error))
+                return [this, error] { m_status = error; };
+            circles->assign((*snapshot)->circles(), (*snapshot)->circles() + (*snapshot)->num_circles());
+
+            return [this, path, snapshot, circles] {
+                m_circles.swap(*circles);
+                m_intersected_ids.clear();
+                m_indexed_version = ++m_circles_version;
+                m_tracker.reset();
+                ++m_render_version;
+                m_alg_ptr->m_index_ptr = std::make_unique<SnapshotIndex>(std::move(*snapshot));
+                update_hover();
+                if (m_show_visibility) cast_visibility();
+                m_status = "loaded " + path + ", circles: " + std::to_string(m_circles.size());
+            };
+        });
+    }
+
+    // reads circles from a text or binary file (see import.h) and indexes them
+    // while reading, a sub-index of the current type per chunk_size circles
+    void import_circles(const std::string& path, std::size_t chunk_size = std::size_t(1) << 22)
+    {
+        if (!check_idle()) return;
+        IndexType type = m_alg_ptr->m_index_type;
+        std::shared_ptr<std::unique_ptr<ChunkedIndex>> index = std::make_shared<std::unique_ptr<ChunkedIndex>>(
+            std::make_unique<ChunkedIndex>([type] { return Algorithm::make_index(type); }, chunk_size));
+        std::shared_ptr<std::vector<Circle>> circles = std::make_shared<std::vector<Circle>>();
+        std::string spill_dir = m_spill_dir;
+        m_job.start("import", [this, path, index, circles, spill_dir](JobControl&) -> BackgroundJob::Commit {
+            ImportStats stats;
+            std::string error;
+            if (!::import_chunked(path, **index, circles.get(), spill_dir, m_alg_ptr->m_pool_ptr.get(), &stats, &error))
+                return [this, error] { m_status = error; };
+
+            return [this, path, index, circles, stats] {
+                m_circles.swap(*circles);
+                m_intersected_ids.clear();
+                m_indexed_version = ++m_circles_version;
+                m_tracker.reset();
+                ++m_render_version;
+                m_alg_ptr->m_index_ptr = std::move(*index);
+                update_hover();
+                if (m_show_visibility) cast_visibility();
+                std::ostringstream status;
+                status << "imported " << path << ", circles: " << stats.circles 
+                    << ", skipped: " << stats.skipped << ", chunks: " << stats.chunks;
+                m_status = status.str();
+            };
+        });
+    }
+
+    // switching the structure drops the index until it is built again
+    void set_index_type(IndexType type)
     {
-        std::size_t depth = m_alg_ptr->build_kdtree(m_circles, m_rect);
-        std::cerr << "construct kdtree, depth: " << depth << std::endl;
+        if (!check_idle()) return;
+        m_alg_ptr->set_index_type(type);
+        m_indexed_version = ~std::uint64_t(0);
+        m_tracker.reset();
+        m_visibility.vertices.clear();
+        ++m_render_version;
+        update_hover();
+    }
+
+    // a new index is built aside; the one in use stays until it is done
+    void build_index()
+    {
+        if (!check_idle()) return;
+        std::shared_ptr<std::unique_ptr<SpatialIndex>> index 
+            = std::make_shared<std::unique_ptr<SpatialIndex>>(m_alg_ptr->create_index());
+        m_job.start("build", [this, index](JobControl& control) -> BackgroundJob::Commit {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            control.set_total(m_circles.size());
+            BuildInfo info = (*index)->build(m_circles, m_rect, m_alg_ptr->m_pool_ptr.get(), &control);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return [this, index, info, ms] { commit_index(std::move(*index), info, ms); };
+        });
     }
 
     void detect_intersection()
     {
-        m_alg_ptr->detect_intersection(m_ray, m_circles, m_intersected_circles);
-        std::cerr << "intersected circles: " << m_intersected_circles.size() << std::endl;
+        if (!check_idle()) return;
+        std::shared_ptr<std::vector<std::uint32_t>> ids = std::make_shared<std::vector<std::uint32_t>>();
+        Ray ray = m_ray;
+        m_job.start("detect intersection", [this, ids, ray](JobControl&) -> BackgroundJob::Commit {
+            std::size_t visited = m_alg_ptr->detect_intersection(ray, *ids);
+            return [this, ids, visited] {
+                m_intersected_ids.swap(*ids);
+                ++m_render_version;
+                std::ostringstream status;
+                status << "intersected circles: " << m_intersected_ids.size() 
+                    << ", visited nodes: " << visited << "/" << m_circles.size();
+                if (query_stats_enabled)
+                {
+                    const QueryStats& stats = m_alg_ptr->last_query_stats();
+                    status << ", bbox tests: " << stats.bbox_tests << ", circle tests: " << stats.circle_tests
+                        << ", max stack depth: " << stats.max_stack_depth;
+                }
+                m_status = status.str();
+            };
+        });
+    }
+
+    // every pair of overlapping circles, from the index, which is built
+    // first when it is not; the circles of the pairs are shown as hits
+    void detect_overlaps()
+    {
+        if (!check_idle()) return;
+        std::shared_ptr<std::unique_ptr<SpatialIndex>> index = std::make_shared<std::unique_ptr<SpatialIndex>>();
+        if (m_indexed_version != m_circles_version) *index = m_alg_ptr->create_index();
+        std::shared_ptr<std::vector<OverlapPair>> pairs = std::make_shared<std::vector<OverlapPair>>();
+
+        m_job.start("detect overlaps", [this, index, pairs](JobControl& control) -> BackgroundJob::Commit {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            BuildInfo info;
+            double build_ms = 0.0;
+            if (*index)
+            {
+                control.set_total(m_circles.size());
+                info = (*index)->build(m_circles, m_rect, m_alg_ptr->m_pool_ptr.get(), &control);
+                build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                if (control.cancelled()) return nullptr;
+                start = std::chrono::steady_clock::now();
+            }
+            const SpatialIndex& searched = *index ? **index : *m_alg_ptr->m_index_ptr;
+            searched.detect_overlaps(m_circles, *pairs, *m_alg_ptr->m_pool_ptr, nullptr, &control);
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+            return [this, index, info, build_ms, pairs, ms] {
+                if (*index) commit_index(std::move(*index), info, build_ms);
+                m_overlaps.swap(*pairs);
+                m_intersected_ids.clear();
+                for (const OverlapPair& pair : m_overlaps)
+                {
+                    m_intersected_ids.push_back(pair.first);
+                    m_intersected_ids.push_back(pair.second);
+                }
+                std::sort(m_intersected_ids.begin(), m_intersected_ids.end());
+                m_intersected_ids.erase(std::unique(m_intersected_ids.begin(), m_intersected_ids.end()), 
+                    m_intersected_ids.end());
+                ++m_render_version;
+
+                std::ostringstream status;
+                status << "overlapping pairs: " << m_overlaps.size() 
+                    << ", overlapping circles: " << m_intersected_ids.size() << "/" << m_circles.size()
+                    << ", " << ms << " ms";
+                m_status = status.str();
+            };
+        });
+    }
+
+private:
+    // refuses changes while a job runs
+    bool check_idle()
+    {
+        if (!m_job.busy()) return true;
+        m_status = m_job.name() + " is running";
+        return false;
+    }
+
+    void commit_index(std::unique_ptr<SpatialIndex> index, const BuildInfo& info, double ms)
+    {
+        m_alg_ptr->set_index(std::move(index), info);
+        m_indexed_version = m_circles_version;
+        m_tracker.reset();
+        ++m_render_version;
+        update_hover();
+        if (m_show_visibility) cast_visibility();
+
+        std::size_t memory = m_alg_ptr->m_index_ptr->memory_bytes();
+        std::ostringstream status;
+        status << "construct " << m_alg_ptr->m_index_ptr->name() 
+            << " in " << ms << " ms, depth: " << info.depth << ", nodes: " << info.nodes 
+            << ", memory per circle: " << (m_circles.empty() ? 0 : memory / m_circles.size()) << " bytes";
+        for (const BuildPhase& phase : info.phases)
+            status << ", " << phase.name << ": " << phase.ms << " ms";
+        m_status = status.str();
     }
 
 }; // end of class scence
@@ -0,0 +1,413 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "kd_tree.h"
+
+// binary snapshot of a set of circles and the kd-tree built over them
+// the file is a header followed by sections, each aligned to 64 bytes:
+//   circles  Circle[num_circles], in input order
+//   nodes    KDNode[num_nodes], pre-order
+//   cx, cy, r2, radius  double[num_circles + 3], leaf order, padded for the kernels
+//   ids      uint32[num_circles], leaf order
+// sections are located by offsets from the start of the file and nodes refer
+// to each other by index, so the file can be mapped anywhere and queried in
+// place. the header records the byte order and the sizes of the stored types;
+// a file written on a machine with another layout is rejected, not converted.
+// the checksum covers everything after the header.
+
+struct SnapshotHeader
+{
+    static constexpr char magic_value[8] = {'C', 'I', 'R', 'C', 'S', 'N', 'A', 'P'};
+    static constexpr std::uint32_t current_version = 1;
+    static constexpr std::uint32_t byte_order_value = 0x01020304u;
+
+    enum Section { circles, nodes, cx, cy, r2, radius, ids, num_sections };
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;   // byte_order_value as written
+    std::uint32_t header_size;
+    std::uint32_t circle_size;  // sizeof(Circle)
+    std::uint32_t node_size;    // sizeof(KDNode)
+    std::uint32_t max_leaf_size;
+    std::uint64_t num_circles;
+    std::uint64_t num_nodes;
+    std::uint64_t file_size;
+    std::uint64_t checksum;
+    std::uint64_t offsets[num_sections];
+    std::uint64_t sizes[num_sections]; // in bytes
+};
+
+constexpr char SnapshotHeader::magic_value[8];
+
+// 64-bit checksum over whole words, four independent lanes so it runs near
+// memory speed; the tail is padded with zeros
+inline std::uint64_t snapshot_checksum(const unsigned char* data, std::size_t size)
+{
+    const std::uint64_t prime = 0x100000001b3ull;
+    std::uint64_t lanes[4] = {0xcbf29ce484222325ull, 0x84222325cbf29ce4ull,
+        0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full};
+
+    std::size_t words = size / 8;
+    std::size_t i = 0;
+    for (; i + 4 <= words; i += 4)
+    {
+        for (int k = 0; k < 4; ++k)
+        {
+            std::uint64_t w;
+            std::memcpy(&w, data + 8 * (i + k), 8);
+            lanes[k] = (lanes[k] ^ w) * prime;
+        }
+    }
+    for (; i < words; ++i)
+    {
+        std::uint64_t w;
+        std::memcpy(&w, data + 8 * i, 8);
+        lanes[0] = (lanes[0] ^ w) * prime;
+    }
+    if (size % 8)
+    {
+        std::uint64_t w = 0;
+        std::memcpy(&w, data + 8 * words, size % 8);
+        lanes[1] = (lanes[1] ^ w) * prime;
+    }
+
+    std::uint64_t h = size;
+    for (int k = 0; k < 4; ++k)
+    {
+        h = (h ^ lanes[k]) * prime;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+// writes the circles and the kd-tree built from them; returns false and sets
+// error when the file cannot be written
+inline bool save_snapshot(const std::string& path, const std::vector<Circle>& circles,
+    const KDTree& tree, std::string* error = nullptr)
+{
+    static_assert(sizeof(Circle) == 3 * sizeof(double), "Circle must be three packed doubles");
+
+    const KDTreeView& view = tree.view();
+    if (view.num_circles != circles.size())
+    {
+        if (error) *error = "the tree was not built from these circles";
+        return false;
+    }
+
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, SnapshotHeader::magic_value, sizeof(header.magic));
+    header.version = SnapshotHeader::current_version;
+    header.byte_order = SnapshotHeader::byte_order_value;
+    header.header_size = sizeof(SnapshotHeader);
+    header.circle_size = sizeof(Circle);
+    header.node_size = sizeof(KDNode);
+    header.max_leaf_size = KDTree::max_leaf_size;
+    header.num_circles = circles.size();
+    header.num_nodes = view.num_nodes;
+
+    std::size_t padded = circles.empty() ? 0 : circles.size() + 3;
+    const void* data[SnapshotHeader::num_sections] = {
+        circles.data(), view.nodes, view.cx, view.cy, view.r2, view.radius, view.ids};
+    header.sizes[SnapshotHeader::circles] = circles.size() * sizeof(Circle);
+    header.sizes[SnapshotHeader::nodes] = view.num_nodes * sizeof(KDNode);
+    header.sizes[SnapshotHeader::cx] = padded * sizeof(double);
+    header.sizes[SnapshotHeader::cy] = padded * sizeof(double);
+    header.sizes[SnapshotHeader::r2] = padded * sizeof(double);
+    header.sizes[SnapshotHeader::radius] = circles.size() * sizeof(double);
+    header.sizes[SnapshotHeader::ids] = circles.size() * sizeof(std::uint32_t);
+
+    const std::uint64_t alignment = 64;
+    std::uint64_t offset = sizeof(SnapshotHeader);
+    for (int k = 0; k < SnapshotHeader::num_sections; ++k)
+    {
+        offset = (offset + alignment - 1) / alignment * alignment;
+        header.offsets[k] = offset;
+        offset += header.sizes[k];
+    }
+    header.file_size = offset;
+
+    // assembled in memory so the checksum is computed in one pass
+    std::vector<unsigned char> body(header.file_size - sizeof(SnapshotHeader), 0);
+    for (int k = 0; k < SnapshotHeader::num_sections; ++k)
+    {
+        if (header.sizes[k])
+            std::memcpy(&body[header.offsets[k] - sizeof(SnapshotHeader)], data[k], header.sizes[k]);
+    }
+    header.checksum = snapshot_checksum(body.data(), body.size());
+
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        if (error) *error = "cannot open " + path + " for writing";
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+        && (body.empty() || std::fwrite(body.data(), body.size(), 1, file) == 1);
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok && error) *error = "cannot write " + path;
+    return ok;
+}
+
+// a snapshot file mapped read-only; the views point into the mapping
+class Snapshot
+{
+private:
+    const unsigned char* m_data = nullptr;
+    std::size_t m_size = 0;
+#ifdef _WIN32
+    std::vector<unsigned char> m_buffer; // read, not mapped
+#endif
+    const SnapshotHeader* m_header = nullptr;
+    KDTreeView m_view;
+
+    void unmap()
+    {
+#ifdef _WIN32
+        m_buffer.clear();
+#else
+        if (m_data) munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+        m_header = nullptr;
+        m_view = KDTreeView();
+    }
+
+    bool fail(std::string* error, const std::string& message)
+    {
+        unmap();
+        if (error) *error = message;
+        return false;
+    }
+
+    bool map(const std::string& path, std::string* error)
+    {
+#ifdef _WIN32
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file) return fail(error, "cannot open " + path);
+        m_buffer.resize(static_cast<std::size_t>(file.tellg()));
+        file.seekg(0);
+        if (!file.read(reinterpret_cast<char*>(m_buffer.data()), m_buffer.size()))
+            return fail(error, "cannot read " + path);
+        m_data = m_buffer.data();
+        m_size = m_buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return fail(error, "cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader)))
+        {
+            close(fd);
+            return fail(error, path + " is not a snapshot");
+        }
+        void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return fail(error, "cannot map " + path);
+        m_data = static_cast<const unsigned char*>(data);
+        m_size = static_cast<std::size_t>(st.st_size);
+#endif
+        return true;
+    }
+
+    // the checksum only catches accidental damage, so the tree is checked
+    // before it is queried: children lie after their parent and within the
+    // nodes, no path is deeper than the traversal stacks, leaves hold at most
+    // max_leaf_size circles within the circles, and ids are below their count
+    bool check_tree(const SnapshotHeader* header) const
+    {
+        const KDNode* nodes = section<KDNode>(SnapshotHeader::nodes);
+        const std::uint32_t* ids = section<std::uint32_t>(SnapshotHeader::ids);
+        std::uint64_t num_nodes = header->num_nodes, n = header->num_circles;
+
+        const std::uint8_t max_levels = 64;
+        std::vector<std::uint8_t> levels(num_nodes, 0);
+        if (num_nodes) levels[0] = 1;
+        for (std::uint64_t i = 0; i < num_nodes; ++i)
+        {
+            const KDNode& node = nodes[i];
+            if (node.is_leaf())
+            {
+                if (node.count() > KDTree::max_leaf_size || node.first() + std::uint64_t(node.count()) > n)
+                    return false;
+                continue;
+            }
+            if (i + 1 >= num_nodes || node.right() <= i + 1 || node.right() >= num_nodes) return false;
+            if (levels[i] >= max_levels) return false;
+            levels[i + 1] = std::max<std::uint8_t>(levels[i + 1], levels[i] + 1);
+            levels[node.right()] = std::max<std::uint8_t>(levels[node.right()], levels[i] + 1);
+        }
+        for (std::uint64_t i = 0; i < n; ++i)
+            if (ids[i] >= n) return false;
+        return true;
+    }
+
+public:
+    Snapshot() {}
+    ~Snapshot() { unmap(); }
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    // maps the file and checks its header, the structure of its tree and,
+    // with verify, its checksum, which reads the whole file. returns false and
+    // sets error on failure.
+    bool open_file(const std::string& path, bool verify = true, std::string* error = nullptr)
+    {
+        unmap();
+        if (!map(path, error)) return false;
+        if (m_size < sizeof(SnapshotHeader)) return fail(error, path + " is not a snapshot");
+
+        const SnapshotHeader* header = reinterpret_cast<const SnapshotHeader*>(m_data);
+        if (std::memcmp(header->magic, SnapshotHeader::magic_value, sizeof(header->magic)) != 0)
+            return fail(error, path + " is not a snapshot");
+        if (header->byte_order != SnapshotHeader::byte_order_value)
+            return fail(error, path + " was written with another byte order");
+        if (header->version != SnapshotHeader::current_version)
+            return fail(error, path + " has unsupported version " + std::to_string(header->version));
+        if (header->header_size != sizeof(SnapshotHeader) || header->circle_size != sizeof(Circle)
+            || header->node_size != sizeof(KDNode) || header->max_leaf_size != KDTree::max_leaf_size)
+            return fail(error, path + " was written with another layout");
+        if (header->file_size != m_size)
+            return fail(error, path + " is truncated");
+        for (int k = 0; k < SnapshotHeader::num_sections; ++k)
+        {
+            if (header->offsets[k] % 64 || header->offsets[k] > m_size
+                || header->sizes[k] > m_size - header->offsets[k])
+                return fail(error, path + " is corrupt");
+        }
+
+        // counts too large for the file are rejected before they are multiplied
+        std::uint64_t n = header->num_circles;
+        if (n > m_size / sizeof(Circle) || n > 0xffffffffu || header->num_nodes > m_size / sizeof(KDNode))
+            return fail(error, path + " is corrupt");
+        std::uint64_t padded = n ? n + 3 : 0;
+        if (header->sizes[SnapshotHeader::circles] != n * sizeof(Circle)
+            || header->sizes[SnapshotHeader::nodes] != header->num_nodes * sizeof(KDNode)
+            || header->sizes[SnapshotHeader::cx] != padded * sizeof(double)
+            || header->sizes[SnapshotHeader::cy] != padded * sizeof(double)
+            || header->sizes[SnapshotHeader::r2] != padded * sizeof(double)
+            || header->sizes[SnapshotHeader::radius] != n * sizeof(double)
+            || header->sizes[SnapshotHeader::ids] != n * sizeof(std::uint32_t))
+            return fail(error, path + " is corrupt");
+
+        if (verify && snapshot_checksum(m_data + sizeof(SnapshotHeader), m_size - sizeof(SnapshotHeader))
+            != header->checksum)
+            return fail(error, path + " fails its checksum");
+        if (!check_tree(header)) return fail(error, path + " is corrupt");
+
+        m_header = header;
+        m_view.nodes = section<KDNode>(SnapshotHeader::nodes);
+        m_view.num_nodes = header->num_nodes;
+        m_view.cx = section<double>(SnapshotHeader::cx);
+        m_view.cy = section<double>(SnapshotHeader::cy);
+        m_view.r2 = section<double>(SnapshotHeader::r2);
+        m_view.radius = section<double>(SnapshotHeader::radius);
+        m_view.ids = section<std::uint32_t>(SnapshotHeader::ids);
+        m_view.num_circles = n;
+        return true;
+    }
+
+    void close_file() { unmap(); }
+
+    bool is_open() const { return m_header != nullptr; }
+    std::size_t file_size() const { return m_size; }
+
+    template <class T>
+    const T* section(int k) const
+    {
+        return reinterpret_cast<const T*>(m_data + reinterpret_cast<const SnapshotHeader*>(m_data)->offsets[k]);
+    }
+
+    // the circles in input order, in place
+    const Circle* circles() const { return is_open() ? section<Circle>(SnapshotHeader::circles) : nullptr; }
+    std::size_t num_circles() const { return m_view.num_circles; }
+
+    const KDTreeView& view() const { return m_view; }
+};
+
+// kd-tree queried in place from a mapped snapshot. the index is read-only:
+// build() is refused and leaves the mapping as it is; other circles get a
+// snapshot of their own through save_snapshot().
+class SnapshotIndex : public SpatialIndex
+{
+private:
+    std::unique_ptr<Snapshot> m_snapshot;
+
+public:
+    explicit SnapshotIndex(std::unique_ptr<Snapshot> snapshot) : m_snapshot(std::move(snapshot)) {}
+
+    const char* name() const override { return "snapshot kd-tree"; }
+
+    const Snapshot& snapshot() const { return *m_snapshot; }
+
+    BuildInfo build(const std::vector<Circle>&, BBox, ThreadPool* = nullptr, JobControl* = nullptr) override
+    {
+        return BuildInfo();
+    }
+
+    void clear() override { m_snapshot->close_file(); }
+
+    std::size_t size() const override { return m_snapshot->num_circles(); }
+
+    // the mapping is shared with the page cache; this is its size
+    std::size_t memory_bytes() const override { return m_snapshot->file_size(); }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<Circle> &results) const override
+    {
+        const KDTreeView& view = m_snapshot->view();
+        return view.traverse(range, [&](std::uint32_t index) { results.push_back(view.circle(index)); });
+    }
+
+    std::size_t detect_intersection(const RayRange &range, std::vector<std::uint32_t> &ids) const override
+    {
+        const KDTreeView& view = m_snapshot->view();
+        return view.traverse(range, [&](std::uint32_t index) { ids.push_back(view.ids[index]); });
+    }
+
+    std::size_t visit_intersections(const RayRange &range, HitVisitor &visitor) const override
+    {
+        const KDTreeView& view = m_snapshot->view();
+        return view.traverse(range, [&](std::uint32_t index) { return visitor.on_hit(view.ids[index]); });
+    }
+
+    std::size_t query_window(const BBox &window, WindowVisitor &visitor, double detail = 0.0) const override
+    {
+        return m_snapshot->view().query_window(window, visitor, detail);
+    }
+
+    std::size_t query_capsule(const Segment &segment, double margin, 
+        const std::vector<Circle> &, CircleVisitor &visitor) const override
+    {
+        return m_snapshot->view().query_capsule(segment, margin, visitor);
+    }
+
+    std::size_t search_nearest(const Point &point, NeighborHeap &heap) const override
+    {
+        return m_snapshot->view().search_nearest(point, heap);
+    }
+
+    std::size_t closest_hit(const RayRange &range, RayHit &hit) const override
+    {
+        return m_snapshot->view().closest_hit(range, hit);
+    }
+};
+
+#endif
@@ -0,0 +1,327 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// work-stealing thread pool
+// every worker owns a deque: it pushes and pops its own tasks at the back and
+// steals from the front of the other deques when it runs dry. tasks submitted
+// from outside the pool go to one extra shared deque. a thread waiting on a
+// TaskGroup runs pending tasks instead of blocking, so tasks may spawn and
+// wait on subtasks, and a pool without workers still makes progress.
+class ThreadPool
+{
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<Queue>> m_queues; // one per worker, plus the shared one
+    std::atomic<std::size_t> m_num_queued;
+    std::mutex m_sleep_mutex;
+    std::condition_variable m_sleep_cv;
+    bool m_stop;
+
+    // index of the calling thread's queue, or the shared queue
+    std::size_t queue_index() const
+    {
+        if (current_pool() == this) return current_worker();
+        return m_workers.size();
+    }
+
+    static const ThreadPool*& current_pool()
+    {
+        static thread_local const ThreadPool* pool = nullptr;
+        return pool;
+    }
+
+    static std::size_t& current_worker()
+    {
+        static thread_local std::size_t index = 0;
+        return index;
+    }
+
+    bool pop(std::size_t index, std::function<void()>& task)
+    {
+        // own queue: newest task first
+        {
+            Queue& queue = *m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                m_num_queued--;
+                return true;
+            }
+        }
+
+        // steal: oldest task of another queue
+        for (std::size_t k = 1; k < m_queues.size(); ++k)
+        {
+            Queue& queue = *m_queues[(index + k) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                m_num_queued--;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker_loop(std::size_t index)
+    {
+        current_pool() = this;
+        current_worker() = index;
+
+        std::function<void()> task;
+        while (true)
+        {
+            if (pop(index, task))
+            {
+                task();
+                task = nullptr;
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_sleep_mutex);
+            m_sleep_cv.wait(lock, [this] { return m_stop || m_num_queued > 0; });
+            if (m_stop && m_num_queued == 0) return;
+        }
+    }
+
+public:
+    // num_threads counts the threads that wait on task groups as well, so a
+    // pool of n threads starts n - 1 workers
+    explicit ThreadPool(std::size_t num_threads = std::thread::hardware_concurrency())
+        : m_num_queued(0), m_stop(false)
+    {
+        std::size_t num_workers = num_threads > 1 ? num_threads - 1 : 0;
+        for (std::size_t i = 0; i <= num_workers; ++i)
+            m_queues.push_back(std::make_unique<Queue>());
+        for (std::size_t i = 0; i < num_workers; ++i)
+            m_workers.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_stop = true;
+        }
+        m_sleep_cv.notify_all();
+        for (auto& worker : m_workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // number of threads that execute tasks, including the waiting one
+    std::size_t size() const { return m_workers.size() + 1; }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            Queue& queue = *m_queues[queue_index()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_mutex);
+            m_num_queued++;
+        }
+        m_sleep_cv.notify_one();
+    }
+
+    // runs one pending task on the calling thread, if there is any
+    bool run_pending_task()
+    {
+        std::function<void()> task;
+        if (!pop(queue_index(), task)) return false;
+        task();
+        return true;
+    }
+
+    // calls f(first, last) on consecutive chunks of [begin, end) of at most
+    // grain indices; the chunking does not depend on the number of threads
+    template <class F>
+    void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, const F& f);
+};
+
+// a set of tasks that can be waited on together
+class TaskGroup
+{
+private:
+    ThreadPool& m_pool;
+    std::atomic<std::size_t> m_pending;
+
+public:
+    explicit TaskGroup(ThreadPool& pool) : m_pool(pool), m_pending(0) {}
+    ~TaskGroup() { wait(); }
+
+    template <class F>
+    void run(F&& f)
+    {
+        m_pending++;
+        m_pool.submit([this, f = std::forward<F>(f)]() mutable {
+            f();
+            m_pending--;
+        });
+    }
+
+    // runs pending tasks of the pool until all tasks of the group are done
+    void wait()
+    {
+        while (m_pending > 0)
+        {
+            if (!m_pool.run_pending_task()) std::this_thread::yield();
+        }
+    }
+};
+
+template <class F>
+void ThreadPool::parallel_for(std::size_t begin, std::size_t end, std::size_t grain, const F& f)
+{
+    if (grain == 0) grain = 1;
+    if (end <= begin) return;
+    if (end - begin <= grain)
+    {
+        f(begin, end);
+        return;
+    }
+
+    TaskGroup group(*this);
+    for (std::size_t first = begin; first < end; first += grain)
+    {
+        std::size_t last = std::min(end, first + grain);
+        group.run([&f, first, last] { f(first, last); });
+    }
+    group.wait();
+}
+
+// shared between a long operation and the thread that started it: a cancel
+// request the operation checks now and then, and its progress
+class JobControl
+{
+private:
+    std::atomic<bool> m_cancelled;
+    std::atomic<std::size_t> m_done, m_total;
+
+public:
+    JobControl() : m_cancelled(false), m_done(0), m_total(0) {}
+
+    void cancel() { m_cancelled = true; }
+    bool cancelled() const { return m_cancelled; }
+
+    void set_total(std::size_t total) 
+    { 
+        m_done = 0; 
+        m_total = total; 
+    }
+    void advance(std::size_t done = 1) { m_done += done; }
+
+    // fraction done, or -1 while the total is not known
+    double progress() const
+    {
+        std::size_t total = m_total;
+        if (total == 0) return -1.0;
+        return std::min(1.0, double(m_done) / double(total));
+    }
+};
+
+// one long operation at a time on a thread of its own, so the thread that
+// started it, e.g. the one of a window, stays free. the operation works on
+// buffers of its own and returns a commit function, which poll() calls on the
+// starting thread once the operation has finished: its results replace the
+// old ones there in one step, and until then the old ones stay in use. a
+// cancelled operation stops at its next check and its commit is dropped.
+class BackgroundJob
+{
+public:
+    typedef std::function<void()> Commit;
+    typedef std::function<Commit(JobControl&)> Work;
+
+private:
+    std::thread m_thread;
+    std::unique_ptr<JobControl> m_control;
+    std::string m_name;
+    Commit m_commit;                 // written by the job before m_finished
+    std::atomic<bool> m_finished;
+
+    // joins the finished or cancelled job and hands out its commit
+    Commit join()
+    {
+        m_thread.join();
+        Commit commit = std::move(m_commit);
+        m_commit = nullptr;
+        if (m_control->cancelled()) commit = nullptr;
+        return commit;
+    }
+
+public:
+    BackgroundJob() : m_finished(false) {}
+    ~BackgroundJob() { stop(); }
+
+    BackgroundJob(const BackgroundJob&) = delete;
+    BackgroundJob& operator=(const BackgroundJob&) = delete;
+
+    bool busy() const { return m_thread.joinable(); }
+    bool finished() const { return busy() && m_finished; }
+    const std::string& name() const { return m_name; }
+    double progress() const { return m_control ? m_control->progress() : -1.0; }
+
+    // false while another job runs
+    bool start(const std::string& name, Work work)
+    {
+        if (busy()) return false;
+        m_control = std::make_unique<JobControl>();
+        m_name = name;
+        m_finished = false;
+        JobControl* control = m_control.get();
+        m_thread = std::thread([this, control, work = std::move(work)] {
+            m_commit = work(*control);
+            m_finished = true;
+        });
+        return true;
+    }
+
+    void cancel() 
+    { 
+        if (busy()) m_control->cancel(); 
+    }
+
+    // commits the job if it has finished; returns whether it had
+    bool poll()
+    {
+        if (!finished()) return false;
+        Commit commit = join();
+        if (commit) commit();
+        return true;
+    }
+
+    // cancels the job and waits for it, without committing
+    void stop()
+    {
+        if (!busy()) return;
+        m_control->cancel();
+        join();
+    }
+};
+
+#endif // THREAD_POOL_H